@@ -8,9 +8,11 @@
 #include "lib/hiredis.h"
 #include <sys/stat.h>
 #include <error.h>
+#include <stdarg.h>
 
 
-#define FILEBUF (16*1024*1024)
+/*bytes sent per fmupload chunk, under the query buffer limit of gsh.*/
+#define CHUNKSIZE (1024*1024)
 
 redisContext *redis_c;
 redisReply *reply;
@@ -19,6 +21,46 @@ char *ip;
 int port;
 char *fm_name;
 
+/*CRC-32 (IEEE), as src/common/util.c computes it.*/
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+		static uint32_t table[256];
+		const unsigned char *p = buf;
+		uint32_t c;
+		int j, k;
+
+		if (!table[1]) {
+				for (j = 0; j < 256; j++) {
+						for (c = j, k = 0; k < 8; k++)
+								c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+						table[j] = c;
+				}
+		}
+		crc = ~crc;
+		while (len--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		return ~crc;
+}
+
+/*send a command, exit unless the reply is of the expected type.*/
+static redisReply *command(int type, const char *fmt, ...)
+{
+		va_list ap;
+		redisReply *r;
+
+		va_start(ap,fmt);
+		r = redisvCommand(redis_c,fmt,ap);
+		va_end(ap);
+		if (!r) {
+				fprintf(stderr,"error: %s\r\n",redis_c->errstr);
+				exit(1);
+		}
+		if (r->type != type) {
+				fprintf(stderr,"error: %s\r\n",r->type == REDIS_REPLY_ERROR ? r->str : "unexpected reply");
+				exit(1);
+		}
+		return r;
+}
+
 off_t get_file_size(char *fname)
 {
 		struct stat buff;
@@ -56,7 +98,7 @@ int main(int argc, char* argv[])
 {
 		if(argc!=7)
 		{
-				fprintf(stderr,"wrong argument. please input arguments like '-h 127.0.0.1 -p 6522 -f libsina.so\r\n");
+				fprintf(stderr,"wrong argument. please input arguments like '-h 127.0.0.1 -p 6522 -f sina' to upload ./libsina.so\r\n");
 				exit(-1);
 		}
 		parseOption(argc,argv);
@@ -71,35 +113,50 @@ int main(int argc, char* argv[])
 		char f_name[1024];
 		sprintf(f_name,"./lib%s.so",fm_name);
 		FILE *f =fopen(f_name,"r");
-		char *p = malloc(FILEBUF);
+		if(!f)
+		{
+				fprintf(stderr,"open %s failed.\r\n",f_name);
+				exit(1);
+		}
+		char *p = malloc(CHUNKSIZE);
 		if(!p)
 		{
 				fprintf(stderr,"malloc failed.\r\n");
 				exit(1);
 		}
-		int fsize = get_file_size(f_name);
-		int len=0;
-		int i;
-		int ch;
-		for(i =0;i<fsize; i++)
+		off_t fsize = get_file_size(f_name);
+		uint32_t crc = 0;
+		size_t len;
+
+		/*checksum first, gsh checks it before installing the file.*/
+		while((len = fread(p,1,CHUNKSIZE,f)) > 0)
+				crc = crc32(crc,p,len);
+		rewind(f);
+
+		reply = command(REDIS_REPLY_STATUS,"fmupload begin %s %lld %08x",
+						fm_name,(long long)fsize,crc);
+		freeReplyObject(reply);
+		while((len = fread(p,1,CHUNKSIZE,f)) > 0)
 		{
-				ch = fgetc(f);
-				len += sprintf(p+len,"%d,",ch);
+				reply = command(REDIS_REPLY_INTEGER,"fmupload chunk %b",p,len);
+				freeReplyObject(reply);
 		}
+		fclose(f);
+		reply = command(REDIS_REPLY_STATUS,"fmupload commit");
+		freeReplyObject(reply);
 
-		/*char *cmd ="{\"time\":1349688926,\
-					\"ip\":\"127.0.0.1\",\
-					\"script\":\"test.php\",\
-					\"formula\":\"carsvm\",\
-					\"programmer\":\"shunli\",\
-					\"data\":{\
-					\"tag\":\"qiche\",\
-					\"parameter\":\"+1\t1:0.6\t2:0.3\"}}";
-		*/
-		reply = redisCommand(redis_c,"load %s %s",fm_name,p);
+		/*the formula is loaded in the background, wait for it.*/
+		while(1)
+		{
+				reply = command(REDIS_REPLY_STRING,"fmstatus %s",fm_name);
+				if(!strstr(reply->str,"state:loading"))
+						break;
+				freeReplyObject(reply);
+				usleep(100000);
+		}
+		printf("%s",reply->str);
 		freeReplyObject(reply);
-		/*reply = redisCommand(redis_c,"grun aaa %s",cmd);
-		freeReplyObject(reply);*/
+		free(p);
 		return 0;
 
 }
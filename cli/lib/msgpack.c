@@ -0,0 +1,247 @@
+/* Minimal MessagePack support, the same as the server's common/msgpack.c:
+ * a grun envelope built with the mpAppend*() calls, e.g. mpAppendCJSON() of
+ * the JSON one, is taken by the server like the JSON text. Send it with %b,
+ * it is binary. */
+
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include "msgpack.h"
+
+static uint64_t mpLoad(const unsigned char *p, int n) {
+    uint64_t v = 0;
+
+    while (n--) v = (v << 8) | *p++;
+    return v;
+}
+
+/* Decode the head of the value at buf. Returns the bytes it takes, which
+ * for strings, binaries and extensions includes their payload, or 0 if the
+ * buffer is truncated or the byte is not valid. */
+size_t mpReadHead(const char *buf, size_t len, mpHead *h) {
+    const unsigned char *p = (const unsigned char*)buf;
+    size_t need = 1, n = 0;
+    uint64_t u;
+    int size = 0;
+    float f;
+
+    if (len == 0) return 0;
+    h->len = 0;
+    if (*p <= 0x7f) {
+        h->type = MP_INT;
+        h->i = *p;
+        return 1;
+    }
+    if (*p >= 0xe0) {
+        h->type = MP_INT;
+        h->i = (int8_t)*p;
+        return 1;
+    }
+    if (*p <= 0x9f) {
+        h->type = (*p <= 0x8f) ? MP_MAP : MP_ARRAY;
+        h->len = *p & 0x0f;
+        return 1;
+    }
+    if (*p <= 0xbf) {
+        h->type = MP_STR;
+        n = *p & 0x1f;
+        goto payload;
+    }
+
+    switch (*p) {
+    case 0xc0: h->type = MP_NIL; return 1;
+    case 0xc2:
+    case 0xc3: h->type = MP_BOOL; h->b = *p & 1; return 1;
+    case 0xc4: case 0xc5: case 0xc6:
+        h->type = MP_BIN;
+        size = 1 << (*p-0xc4);
+        break;
+    case 0xd9: case 0xda: case 0xdb:
+        h->type = MP_STR;
+        size = 1 << (*p-0xd9);
+        break;
+    case 0xc7: case 0xc8: case 0xc9:
+        h->type = MP_EXT;
+        size = 1 << (*p-0xc7);
+        need = 1+size+1;
+        if (len < need) return 0;
+        n = mpLoad(p+1,size);
+        goto payload;
+    case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+        h->type = MP_EXT;
+        n = 1 << (*p-0xd4);
+        need = 2;
+        goto payload;
+    case 0xca:
+        if (len < 5) return 0;
+        u = mpLoad(p+1,4);
+        {
+            uint32_t u32 = (uint32_t)u;
+            memcpy(&f,&u32,4);
+        }
+        h->type = MP_DOUBLE;
+        h->d = f;
+        return 5;
+    case 0xcb:
+        if (len < 9) return 0;
+        u = mpLoad(p+1,8);
+        h->type = MP_DOUBLE;
+        memcpy(&h->d,&u,8);
+        return 9;
+    case 0xcc: case 0xcd: case 0xce: case 0xcf:
+        size = 1 << (*p-0xcc);
+        if (len < 1+(size_t)size) return 0;
+        u = mpLoad(p+1,size);
+        if (u > INT64_MAX) {
+            h->type = MP_UINT;
+            h->u = u;
+        } else {
+            h->type = MP_INT;
+            h->i = (int64_t)u;
+        }
+        return 1+size;
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+        size = 1 << (*p-0xd0);
+        if (len < 1+(size_t)size) return 0;
+        u = mpLoad(p+1,size);
+        h->type = MP_INT;
+        if (size < 8 && (u >> (size*8-1))) u |= ~0ULL << (size*8); /* sign */
+        h->i = (int64_t)u;
+        return 1+size;
+    case 0xdc: case 0xdd:
+    case 0xde: case 0xdf:
+        h->type = (*p <= 0xdd) ? MP_ARRAY : MP_MAP;
+        size = (*p & 1) ? 4 : 2;
+        if (len < 1+(size_t)size) return 0;
+        h->len = (uint32_t)mpLoad(p+1,size);
+        return 1+size;
+    default:
+        return 0;   /* 0xc1 is never used */
+    }
+
+    /* str and bin with an explicit length. */
+    need = 1+size;
+    if (len < need) return 0;
+    n = mpLoad(p+1,size);
+payload:
+    if (len < need || len-need < n) return 0;
+    h->str = (const char*)p+need;
+    h->len = (uint32_t)n;
+    return need+n;
+}
+
+/* Return the bytes taken by the whole value at buf, 0 if it is truncated
+ * or not valid. Nothing is allocated and nesting depth does not matter. */
+size_t mpSkip(const char *buf, size_t len) {
+    size_t pos = 0, n;
+    uint64_t pending = 1;
+    mpHead h;
+
+    while (pending) {
+        if (!(n = mpReadHead(buf+pos,len-pos,&h))) return 0;
+        pos += n;
+        pending--;
+        if (h.type == MP_ARRAY) pending += h.len;
+        else if (h.type == MP_MAP) pending += (uint64_t)h.len*2;
+        /* Every value takes a byte at least. */
+        if (pending > len-pos) return 0;
+    }
+    return pos;
+}
+
+static sds mpAppendHead(sds s, unsigned char tag, uint64_t v, int size) {
+    unsigned char b[9];
+    int j;
+
+    b[0] = tag;
+    for (j = 0; j < size; j++) b[1+j] = (unsigned char)(v >> (8*(size-1-j)));
+    return sdscatlen(s,b,1+size);
+}
+
+sds mpAppendNil(sds s) {
+    return mpAppendHead(s,0xc0,0,0);
+}
+
+sds mpAppendBool(sds s, int b) {
+    return mpAppendHead(s,b ? 0xc3 : 0xc2,0,0);
+}
+
+sds mpAppendInt(sds s, long long v) {
+    if (v >= 0) {
+        if (v <= 0x7f) return mpAppendHead(s,(unsigned char)v,0,0);
+        if (v <= 0xff) return mpAppendHead(s,0xcc,v,1);
+        if (v <= 0xffff) return mpAppendHead(s,0xcd,v,2);
+        if (v <= 0xffffffffLL) return mpAppendHead(s,0xce,v,4);
+        return mpAppendHead(s,0xcf,v,8);
+    }
+    if (v >= -32) return mpAppendHead(s,(unsigned char)v,0,0);
+    if (v >= -128) return mpAppendHead(s,0xd0,(uint64_t)v,1);
+    if (v >= -32768) return mpAppendHead(s,0xd1,(uint64_t)v,2);
+    if (v >= INT32_MIN) return mpAppendHead(s,0xd2,(uint64_t)v,4);
+    return mpAppendHead(s,0xd3,(uint64_t)v,8);
+}
+
+sds mpAppendDouble(sds s, double d) {
+    uint64_t u;
+
+    memcpy(&u,&d,8);
+    return mpAppendHead(s,0xcb,u,8);
+}
+
+sds mpAppendStr(sds s, const char *str, size_t len) {
+    if (len <= 31) s = mpAppendHead(s,0xa0|(unsigned char)len,0,0);
+    else if (len <= 0xff) s = mpAppendHead(s,0xd9,len,1);
+    else if (len <= 0xffff) s = mpAppendHead(s,0xda,len,2);
+    else s = mpAppendHead(s,0xdb,len,4);
+    return sdscatlen(s,(void*)str,len);
+}
+
+sds mpAppendArrayHead(sds s, uint32_t n) {
+    if (n <= 15) return mpAppendHead(s,0x90|(unsigned char)n,0,0);
+    if (n <= 0xffff) return mpAppendHead(s,0xdc,n,2);
+    return mpAppendHead(s,0xdd,n,4);
+}
+
+sds mpAppendMapHead(sds s, uint32_t n) {
+    if (n <= 15) return mpAppendHead(s,0x80|(unsigned char)n,0,0);
+    if (n <= 0xffff) return mpAppendHead(s,0xde,n,2);
+    return mpAppendHead(s,0xdf,n,4);
+}
+
+/* Append a cJSON tree, numbers are written as integers when cJSON would
+ * print them as integers. */
+sds mpAppendCJSON(sds s, cJSON *item) {
+    cJSON *c;
+    uint32_t n;
+    double d;
+
+    switch (item->type & 255) {
+    case cJSON_False: return mpAppendBool(s,0);
+    case cJSON_True: return mpAppendBool(s,1);
+    case cJSON_NULL: return mpAppendNil(s);
+    case cJSON_Number:
+        d = item->valuedouble;
+        if (fabs((double)item->valueint-d) <= DBL_EPSILON && d <= INT_MAX && d >= INT_MIN)
+            return mpAppendInt(s,item->valueint);
+        return mpAppendDouble(s,d);
+    case cJSON_String:
+        return mpAppendStr(s,item->valuestring ? item->valuestring : "",
+                           item->valuestring ? strlen(item->valuestring) : 0);
+    case cJSON_Array:
+    case cJSON_Object:
+        for (n = 0, c = item->child; c; c = c->next) n++;
+        if ((item->type & 255) == cJSON_Array) {
+            s = mpAppendArrayHead(s,n);
+            for (c = item->child; c; c = c->next) s = mpAppendCJSON(s,c);
+        } else {
+            s = mpAppendMapHead(s,n);
+            for (c = item->child; c; c = c->next) {
+                s = mpAppendStr(s,c->string,strlen(c->string));
+                s = mpAppendCJSON(s,c);
+            }
+        }
+        return s;
+    }
+    return s;
+}
@@ -0,0 +1,130 @@
+#include "gsh.h"
+#include <math.h>
+
+/*-----------------------------------------------------------------------------
+ * Latency based admission control for grun
+ *
+ * Every formula keeps the sojourn time (arrival of the request to the end of
+ * the call, so time spent queued behind other work counts too) of the
+ * requests it served during the current interval. When the interval closes
+ * the configured percentile of those samples is compared against the target.
+ * While it is over the target the probability of shedding a new request
+ * grows by a gradient step proportional to the relative error:
+ *
+ *   reject += ADMISSION_GAIN * (latency - target) / target
+ *
+ * and once it is back under the target the probability is halved every
+ * interval, so shedding stops quickly when the overload goes away.
+ *
+ * Requests waiting on a flight (see flight.c) only give a sample when it
+ * lands, so the formula also counts them: an interval in which none
+ * completed while some kept waiting is not idle, the time the queue has
+ * been standing stands for the latency, like the sojourn time of CoDel.
+ *
+ * Shed requests are answered with -BUSY as soon as their envelope is read,
+ * before "data" is parsed.
+ *----------------------------------------------------------------------------*/
+
+#define ADMISSION_GAIN          0.1
+#define ADMISSION_MAX_REJECT    0.95    /* always let some traffic through */
+
+static int compareLongLong(const void *a, const void *b) {
+		long long x = *(const long long*)a, y = *(const long long*)b;
+		return (x > y) - (x < y);
+}
+
+/* Close the current interval: compute the latency percentile and move the
+ * reject probability towards what keeps it under the target. */
+static void admissionUpdate(admissionState *adm, long long now) {
+		long long interval = (long long)server.admission_interval*1000;
+		long long idle;
+		double err;
+
+		if (adm->nsamples) {
+				int idx = (adm->nsamples*server.admission_percentile+99)/100-1;
+
+				if (idx < 0) idx = 0;
+				qsort(adm->samples,adm->nsamples,sizeof(long long),compareLongLong);
+				adm->latency = adm->samples[idx];
+		} else if (adm->queued) {
+				/* Nothing completed, requests are stuck behind a flight. */
+				adm->latency = now-adm->queued_since;
+		} else {
+				/* Nothing completed: either idle or everything was shed. */
+				adm->latency = 0;
+		}
+		if (adm->latency) {
+				err = (double)(adm->latency-server.admission_target)/
+						server.admission_target;
+				if (err > 1) err = 1;
+				if (err > 0)
+						adm->reject += ADMISSION_GAIN*err;
+				else
+						adm->reject /= 2;
+		} else {
+				adm->reject /= 2;
+		}
+		/* Intervals that went by without any request count as idle ones. */
+		idle = adm->queued ? 0 : (now-adm->window_end)/interval;
+		for (; idle > 0 && adm->reject; idle--)
+				adm->reject /= 2;
+		if (adm->reject < 0.01) adm->reject = 0;
+		if (adm->reject > ADMISSION_MAX_REJECT) adm->reject = ADMISSION_MAX_REJECT;
+
+		adm->nsamples = 0;
+		adm->seen = 0;
+		adm->window_end = now+interval;
+}
+
+/* Return 0 when a new request for the formula should be shed. */
+int admissionAllow(FMITEM *fm) {
+		admissionState *adm = &fm->adm;
+		long long now;
+
+		if (!server.admission_target || fm->noadmission) return 1;
+
+		now = ustime();
+		if (now >= adm->window_end) admissionUpdate(adm,now);
+		if (adm->reject == 0 || rand() >= adm->reject*RAND_MAX) return 1;
+
+		adm->stat_rejected++;
+		server.stat_rejected_requests++;
+		return 0;
+}
+
+/* A request for the formula starts or stops waiting on a flight. */
+void admissionQueued(FMITEM *fm, int delta) {
+		admissionState *adm = &fm->adm;
+
+		if (!adm->queued) adm->queued_since = ustime();
+		adm->queued += delta;
+}
+
+/* Record the sojourn time of a request served by the formula. When more
+ * requests than samples complete in one interval a reservoir is kept. */
+void admissionRecord(FMITEM *fm, long long latency) {
+		admissionState *adm = &fm->adm;
+		long long now;
+
+		if (!server.admission_target || fm->noadmission) return;
+
+		now = ustime();
+		if (now >= adm->window_end) admissionUpdate(adm,now);
+		adm->seen++;
+		if (adm->nsamples < REDIS_ADMISSION_SAMPLES) {
+				adm->samples[adm->nsamples++] = latency;
+		} else {
+				long long j = rand()%adm->seen;
+
+				if (j < REDIS_ADMISSION_SAMPLES) adm->samples[j] = latency;
+		}
+}
+
+sds admissionInfoString(sds info, char *name, FMITEM *fm) {
+		if (!server.admission_target) return info;
+		return sdscatprintf(info,
+						"admission[%s]=latency_p%d:%lld,reject_rate:%.2f,queued:%d,rejected:%lld%s\r\n",
+						name,server.admission_percentile,fm->adm.latency,
+						fm->adm.reject,fm->adm.queued,fm->adm.stat_rejected,
+						fm->noadmission ? ",exempt" : "");
+}
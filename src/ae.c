@@ -21,7 +21,8 @@ aeEventLoop *aeCreateEventLoop(void) {
 		eventLoop->timeEventNextId = 0;
 		eventLoop->stop = 0;
 		eventLoop->maxfd = -1;
-		//    eventLoop->beforesleep = NULL;
+		eventLoop->beforesleep = NULL;
+		eventLoop->aftersleep = NULL;
 		if (aeApiCreate(eventLoop) == -1) {
 				zfree(eventLoop);
 				return NULL;
@@ -276,6 +277,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 				}
 
 				numevents = aeApiPoll(eventLoop, tvp);
+				if (eventLoop->aftersleep != NULL)
+						eventLoop->aftersleep(eventLoop);
 				for (j = 0; j < numevents; j++) {
 						aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
 						int mask = eventLoop->fired[j].mask;
@@ -329,6 +332,8 @@ void aeMain(aeEventLoop *eventLoop) {
 		eventLoop->stop = 0;
 		while (!eventLoop->stop) 
 		{
+				if (eventLoop->beforesleep != NULL)
+						eventLoop->beforesleep(eventLoop);
 				aeProcessEvents(eventLoop, AE_ALL_EVENTS);
 		}
 }
@@ -337,3 +342,10 @@ char *aeGetApiName(void) {
 		return aeApiName();
 }
 
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
+		eventLoop->beforesleep = beforesleep;
+}
+
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep) {
+		eventLoop->aftersleep = aftersleep;
+}
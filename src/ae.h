@@ -62,7 +62,8 @@ typedef struct aeEventLoop {
 		aeTimeEvent *timeEventHead;
 		int stop;
 		void *apidata; /* This is used for polling API specific data */
-		//    aeBeforeSleepProc *beforesleep;
+		aeBeforeSleepProc *beforesleep;
+		aeBeforeSleepProc *aftersleep; /* called when the poll returns */
 } aeEventLoop;
 
 /* Prototypes */
@@ -81,6 +82,7 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
-//void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
 
 #endif
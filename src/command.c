@@ -1,195 +1,833 @@
 #include "gsh.h"
 #include "common/cJSON.h"
 #include "common/formula.h"
+#include "common/sjson.h"
 #include <sys/stat.h>
-
-#define JS_GOItem(x,y) cJSON_GetObjectItem(x,y) 
-
-typedef int formuaProc(void*,void*);
-typedef struct kwit {
-		char *kw;
-		int  type;
-}KWIT;
-
-KWIT kw_list[] = {
-		{"time",		cJSON_Number},
-		{"ip",			cJSON_String},
-		{"script",		cJSON_String},
-		{"programmer",	cJSON_String},
-		{"formula",		cJSON_String},
-		{"data",		cJSON_Object}
-};
-
-/*function: formula_init, formula_run*/
-typedef struct fmitem {
-		formuaProc *init;
-		formuaProc *run;
-}FMITEM;
-FMITEM *fmlist;
+#include <fcntl.h>
 
 /*formula buf*/
 void *fm_buf;
 
-cJSON *root,*data,*formula;
+/*parser for "data", its buffers are kept between requests.*/
+sjsonParser *data_parser;
 
-void* loadfm(char *fm_name) {
+/*ctx->out of the formulas.*/
+jsonw *reply_writer;
 
-		char path[BUFSIZ];
-		sprintf(path,"./lib/lib%s.so",fm_name);
+/*dlerror() reports the last dl* failure, and loadfm runs on the loader
+  thread while the main thread may dlclose(): the calls whose error is read
+  hold this lock until it is.*/
+static pthread_mutex_t dl_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-		FMITEM *it = zmalloc(sizeof(FMITEM));
+/*build the descriptor of an old style formula from its
+  gsh_formula_<name>_* symbols.*/
+static int loadLegacyFormula(FMITEM *it, char *fm_name, char *err, size_t errlen) {
 
-		int ret;
-		void *handle = dlopen(path,/*RTLD_LAZY*/RTLD_NOW);
-		if (!handle) {
-				fprintf(stderr, "%s\n", dlerror());
-				goto err;
-		}
+		char sym[BUFSIZ];
+		const int *layout;
+		int *flags;
+
+		it->desc.abi = 1;
 
-		/*export formula function.*/
-		it->init = zmalloc(sizeof(formuaProc*));
-		it->run = zmalloc(sizeof(formuaProc*));
+		/*export formula_exec function, optional, takes over from formula_run.*/
+		snprintf(sym,sizeof(sym),"gsh_formula_%s_exec",fm_name);
+		it->desc.run = dlsym(it->handle,sym);
 
 		/*export formula_run function*/
-		sprintf(path,"gsh_formula_%s_run",fm_name);
-		it->run = dlsym(handle,path);
-		if (!it->run) {
-				fprintf(stderr,"load <<%s>> function failed.\r\n",path);
-				goto err;
+		snprintf(sym,sizeof(sym),"gsh_formula_%s_run",fm_name);
+		it->legacyrun = dlsym(it->handle,sym);
+		if (!it->desc.run && !it->legacyrun) {
+				snprintf(err,errlen,"load <<%s>> function failed",sym);
+				return REDIS_ERR;
 		}
 
 		/*export formula_init function*/
-		sprintf(path,"gsh_formula_%s_init",fm_name);
-		it->init = dlsym(handle,path);
-		if (!it->init) {
-				fprintf(stderr,"load gsh_formula_%s_init failed.\r\n",path);
+		snprintf(sym,sizeof(sym),"gsh_formula_%s_init",fm_name);
+		it->legacyinit = dlsym(it->handle,sym);
+		if (!it->legacyinit) {
+				snprintf(err,errlen,"load <<%s>> function failed",sym);
+				return REDIS_ERR;
+		}
+
+		/*no descriptor tells the ABI, but the cJSON.h it was built with
+		  leaves its layout. a formula without one predates the mark, or
+		  does not include cJSON.h at all.*/
+		layout = dlsym(it->handle,"cJSON_layout");
+		if (layout && *layout != cJSON_LAYOUT) {
+				snprintf(err,errlen,"formula %s is built for cJSON layout %d, the server has %d",
+								fm_name,*layout,cJSON_LAYOUT);
+				return REDIS_ERR;
+		}
+		if (!layout)
+				redisLog(REDIS_WARNING,"formula [%s] does not tell its cJSON layout, rebuild it if it allocates cJSON nodes itself",fm_name);
+
+		/*export formula_flags and formula_schema, optional.*/
+		snprintf(sym,sizeof(sym),"gsh_formula_%s_flags",fm_name);
+		flags = dlsym(it->handle,sym);
+		if (flags) it->desc.flags = *flags;
+		snprintf(sym,sizeof(sym),"gsh_formula_%s_schema",fm_name);
+		it->desc.schema = dlsym(it->handle,sym);
+		return REDIS_OK;
+}
+
+/*copy a formula library, see loadfm().*/
+static int copyFile(const char *src, const char *dst) {
+
+		char buf[1024*64];
+		ssize_t nread;
+		int in, out, ret = REDIS_ERR;
+
+		if ((in = open(src,O_RDONLY)) == -1) return REDIS_ERR;
+		if ((out = open(dst,O_WRONLY|O_CREAT|O_TRUNC,S_IRWXU)) == -1) {
+				close(in);
+				return REDIS_ERR;
+		}
+		while ((nread = read(in,buf,sizeof(buf))) > 0)
+				if (write(out,buf,nread) != nread) goto done;
+		if (nread == 0) ret = REDIS_OK;
+done:
+		close(in);
+		if (close(out) == -1) ret = REDIS_ERR;
+		if (ret != REDIS_OK) unlink(dst);
+		return ret;
+}
+
+/*load version of the formula fm_name, running its init. Returns NULL and
+  says why in err on failure. Only touches the formula itself, so it can
+  run on the loader thread, see loader.c.*/
+void* loadfm(char *fm_name, int version, char *err, size_t errlen) {
+
+		char lib[BUFSIZ], path[BUFSIZ];
+		fmDescriptor *desc;
+		FMITEM *it;
+		void *handle;
+		char *schemaerr;
+		int tag, ok;
+
+		/*every version is loaded from a private copy, unlinked once mapped:
+		  dlopen() would hand back the running instance of a file it has
+		  loaded already, and the next deploy can overwrite lib<name>.so
+		  without touching the code in use.*/
+		snprintf(lib,sizeof(lib),"./lib/lib%s.so",fm_name);
+		snprintf(path,sizeof(path),"./lib/.lib%s.so.%ld.%d",fm_name,(long)getpid(),version);
+		if (copyFile(lib,path) != REDIS_OK) {
+				snprintf(err,errlen,"copy %s to %s failed: %s",lib,path,strerror(errno));
+				return NULL;
+		}
+		pthread_mutex_lock(&dl_mutex);
+		handle = dlopen(path,/*RTLD_LAZY*/RTLD_NOW);
+		if (!handle) snprintf(err,errlen,"%s",dlerror());
+		pthread_mutex_unlock(&dl_mutex);
+		unlink(path);
+		if (!handle) return NULL;
+
+		it = zcalloc(sizeof(FMITEM));
+		it->handle = handle;
+		it->version = version;
+
+		/*the ABI v2 descriptor, else the symbols of an old style formula.*/
+		desc = dlsym(handle,"gsh_formula_descriptor");
+		if (desc) {
+
+				if (desc->abi != FM_ABI_VERSION) {
+						snprintf(err,errlen,"formula %s is built for ABI %d, the server runs ABI %d",
+										fm_name,desc->abi,FM_ABI_VERSION);
+						goto err;
+				}
+				it->desc = *desc;
+				if (!it->desc.run) {
+						snprintf(err,errlen,"formula %s has no run function",fm_name);
+						goto err;
+				}
+		} else if (loadLegacyFormula(it,fm_name,err,errlen) != REDIS_OK) {
 				goto err;
 		}
 
+		if (it->desc.schema) {
+
+				it->schema = schemaCompile(it->desc.schema,&schemaerr);
+				if (!it->schema) {
+						snprintf(err,errlen,"schema of formula %s is not valid: %s",fm_name,schemaerr);
+						goto err;
+				}
+		}
+
 		/*formula init.*/
-		ret = it->init(0,0);
-		if (!ret) {
-				fprintf(stderr,"<<gsh_formula_%s_init>> failed.\r\n",path);
+		tag = zmalloc_set_tag(ZMALLOC_TAG_FORMULA);
+		ok = (!it->desc.init || it->desc.init()) &&
+				(!it->legacyinit || it->legacyinit(0,0));
+		zmalloc_set_tag(tag);
+		if (!ok) {
+				snprintf(err,errlen,"init of formula %s failed",fm_name);
 				goto err;
 		}
-		
 		return it;
 err:
-		return 0;
+		schemaFree(it->schema);
+		pthread_mutex_lock(&dl_mutex);
+		dlclose(handle);
+		pthread_mutex_unlock(&dl_mutex);
+		zfree(it);
+		return NULL;
+}
+
+/*free a formula version nothing uses anymore.*/
+void unloadfm(FMITEM *it) {
+
+		if (it->pool) workerStop(it);
+		if (it->desc.destroy) it->desc.destroy();
+		schemaFree(it->schema);
+		if (it->cache) fmCacheFree(it->cache);
+		if (it->flights) dictRelease(it->flights);
+		if (it->stats) fmStatsRelease(it->stats);
+		pthread_mutex_lock(&dl_mutex);
+		dlclose(it->handle);
+		pthread_mutex_unlock(&dl_mutex);
+		zfree(it);
+}
+
+/*drop a reference taken by a flight, the last one of a version replaced by
+  reload unloads it.*/
+void releasefm(FMITEM *it) {
+
+		if (--it->refcount == 0 && it->retired) {
+
+				server.fms_draining--;
+				unloadfm(it);
+		}
+}
+
+/*let the formulas release what they hold, called on shutdown.*/
+void destroyFormulas(void) {
+
+		dictIterator *di = dictGetSafeIterator(server.fms);
+		dictEntry *de;
+
+		while ((de = dictNext(di)) != NULL) {
+
+				FMITEM *it = dictGetEntryVal(de);
+				if (it->desc.destroy) it->desc.destroy();
+		}
+		dictReleaseIterator(di);
 }
 
 void gsh_init(void) {
 
+		int tag = zmalloc_set_tag(ZMALLOC_TAG_FORMULA);
 		fm_buf = zmalloc(FORMULA_BUFLEN);
+		zmalloc_set_tag(tag);
+		data_parser = sjsonNew();
+		reply_writer = jsonwNew();
 		return ;
 }
 
+/*the ustime() after which the request is not worth answering, 0 when it
+  has no deadline. a timeout or deadline of 0 or less means none.*/
+static long long requestDeadline(redisClient *c, envelope *env) {
+
+		long long deadline = 0, t;
+
+		if ((env->flags & ENVELOPE_DEADLINE) && env->deadline_ms > 0)
+				deadline = (long long)(env->deadline_ms*1000);
+		if ((env->flags & ENVELOPE_TIMEOUT) && env->timeout > 0) {
+
+				t = c->querytime + (long long)(env->timeout*1000);
+				if (!deadline || t < deadline) deadline = t;
+		}
+		return deadline;
+}
+
+/*time spent parsing "data" in the current call, -1 if it was not, and
+  running the formula aside from that. See callFormula().*/
+static long long parse_us, run_us;
+
+static void addParseTime(long long start) {
+
+		if (parse_us < 0) parse_us = 0;
+		parse_us += ustime()-start;
+}
+
+/*what the current call cost, see fmUsage, the CPU time of parsing "data"
+  from inside it, left out like it is of run_us, and the allocation tag to
+  set back after it.*/
+static fmUsage call_usage;
+static zmalloc_scope call_mem;
+static long long call_parse_cpu;
+static int call_tag;
+
+/*the main thread enters and leaves the code of formula it, for the latency
+  monitor and the profiler, to charge it its usage and to tag what it
+  allocates. Only what is allocated as ZMALLOC_TAG_FORMULA is charged: the
+  reply writer and "data" tag theirs as ZMALLOC_TAG_JSON, the reply is
+  handed to the client and freed with it.*/
+static int enterFormula(FMITEM *it) {
+
+		server.fm_running = it->id;
+		call_tag = zmalloc_set_tag(ZMALLOC_TAG_FORMULA);
+		zmalloc_scope_begin(&call_mem,ZMALLOC_TAG_FORMULA);
+		call_parse_cpu = 0;
+		call_usage.cpu_us = threadustime();
+		return latencyEnterPhase(LATENCY_PHASE_FORMULA);
+}
+
+static void leaveFormula(int phase) {
+
+		call_usage.cpu_us = threadustime()-call_usage.cpu_us-call_parse_cpu;
+		zmalloc_scope_end(&call_mem);
+		zmalloc_set_tag(call_tag);
+		call_usage.mem_net = call_mem.net;
+		call_usage.mem_peak = call_mem.peak;
+		server.fm_running = -1;
+		latencyEnterPhase(phase);
+}
+
+/*"data" is parsed in the encoding of its envelope.*/
+static int parseData(fmContext *ctx) {
+
+		if (ctx->encoding == FM_ENCODING_MSGPACK)
+				return sjsonParseMsgpack(data_parser,ctx->raw,ctx->rawlen);
+		return sjsonParse(data_parser,ctx->raw,ctx->rawlen);
+}
+
+void *fmContextData(fmContext *ctx) {
+
+		long long start, cpu;
+
+		if (!ctx->data) {
+				start = ustime();
+				cpu = threadustime();
+				if (parseData(ctx) == SJSON_OK)
+						ctx->data = sjsonToCJSONArena(data_parser,server.reqarena);
+				addParseTime(start);
+				call_parse_cpu += threadustime()-cpu;
+		}
+		return ctx->data;
+}
+
+static void countInvalid(FMITEM *it) {
+
+		server.stat_invalid_requests++;
+		it->stats->invalid++;
+}
+
+/*parse "data" and check it against the schema of the formula, on success
+  ctx->data and ctx->fields are set (unless FM_RAW), else the reason is
+  returned.*/
+static const char *validateData(FMITEM *it, fmContext *ctx) {
+
+		long long start = ustime();
+		const char *err = NULL;
+
+		if (parseData(ctx) != SJSON_OK) {
+				err = data_parser->err;
+		} else if (schemaValidate(it->schema,data_parser) != REDIS_OK) {
+				err = it->schema->err;
+		} else if (!(it->desc.flags & FM_RAW)) {
+				ctx->data = sjsonToCJSONArena(data_parser,server.reqarena);
+				ctx->fields = schemaResolve(it->schema,ctx->data);
+		}
+		addParseTime(start);
+		return err;
+}
+
+static void initContext(fmContext *ctx, const char *raw, size_t len, int encoding) {
+
+		ctx->raw = raw;
+		ctx->rawlen = len;
+		ctx->encoding = (encoding == ENVELOPE_MSGPACK) ? FM_ENCODING_MSGPACK : FM_ENCODING_JSON;
+		ctx->data = NULL;
+		ctx->fields = NULL;
+		ctx->ret = fm_buf;
+		ctx->out = reply_writer;
+		*(char*)fm_buf = '\0';
+}
+
+/*call the formula, its reply is then in reply_writer or fm_buf. A request
+  the formula can not handle is rejected before calling it, *err says why.
+  parse_us, run_us and call_usage are then set and recorded.*/
+static int callFormula(FMITEM *it, fmContext *ctx, const char **err) {
+
+		long long start = ustime();
+		int ok, phase;
+
+		parse_us = run_us = call_usage.cpu_us = -1;
+		if (it->schema && (*err = validateData(it,ctx)) != NULL) {
+
+				countInvalid(it);
+				fmStatsTimes(it,parse_us,run_us);
+				return 0;
+		}
+		*err = NULL;
+		phase = enterFormula(it);
+		if (it->desc.run)
+				ok = it->desc.run(ctx);
+		else
+				ok = fmContextData(ctx) && it->legacyrun(ctx->data,fm_buf);
+		leaveFormula(phase);
+		run_us = ustime()-start-(parse_us > 0 ? parse_us : 0);
+		fmStatsTimes(it,parse_us,run_us);
+		fmStatsUsage(it,&call_usage,1);
+		return ok;
+}
+
+/*the length of the reply of a call returning ok, -1 when there is none:
+  the call failed or left an incomplete document in ctx->out. Whatever was
+  written to ctx->out is the reply, else ctx->ret, which batch and async
+  calls do not have: they reply nothing then. The same for every way a
+  formula is called.*/
+static long long replyLength(fmContext *ctx, int ok) {
+
+		if (!ok || (jsonwLength(ctx->out) && !jsonwDone(ctx->out))) return -1;
+		if (jsonwLength(ctx->out)) return jsonwLength(ctx->out);
+		return ctx->ret ? strlen(ctx->ret) : 0;
+}
+
+/*the reply of a call as one object, to be shared by the clients of a
+  flight and kept in the cache of its formula, under key when given.*/
+static robj *createReplyObject(FMITEM *it, fmCacheEntry *key, fmContext *ctx, int ok) {
+
+		long long len = replyLength(ctx,ok);
+		robj *reply;
+		sds s, chunk;
+
+		if (len < 0) {
+
+				incrRefCount(shared.err);
+				return shared.err;
+		}
+		s = sdscatprintf(sdsempty(),"$%lld\r\n",len);
+		if (jsonwLength(ctx->out)) {
+
+				while ((chunk = jsonwNextChunk(ctx->out)) != NULL) {
+
+						s = sdscatlen(s,chunk,sdslen(chunk));
+						sdsfree(chunk);
+				}
+		} else if (len) {
+				s = sdscatlen(s,ctx->ret,len);
+		}
+		s = sdscatlen(s,"\r\n",2);
+		reply = createObject(REDIS_STRING,s);
+		if (key && it->cache) fmCacheStore(it->cache,key,reply);
+		return reply;
+}
+
+static robj *createInvalidReply(const char *err) {
+
+		return createObject(REDIS_STRING,
+						sdscatprintf(sdsempty(),"-ERR invalid data: %s\r\n",err));
+}
+
+/*run the request of a flight, see flight.c. Returns its reply, successful
+  ones are cached when the formula has a cache.*/
+robj *grunFlight(fmFlight *f) {
+
+		fmContext ctx;
+		const char *err;
+		robj *reply;
+		int ok;
+
+		initContext(&ctx,f->key.data,f->key.datalen,f->key.encoding);
+		ok = callFormula(f->fm,&ctx,&err);
+		f->parse_us = parse_us;
+		f->run_us = run_us;
+		f->usage = call_usage;
+		reply = err ? createInvalidReply(err) : createReplyObject(f->fm,&f->key,&ctx,ok);
+		jsonwReset(reply_writer);
+
+		/*drops the "data" DOM without walking it.*/
+		arenaReset(server.reqarena);
+		return reply;
+}
+
+/*set up f->ctx for a batch or an async call. Unlike the inline path each
+  context has its own reply writer and fields, and the "data" of an async
+  call is parsed right away to the heap, the parser and the request arena
+  being reused before it completes. Returns why the request is rejected,
+  NULL if it is not.*/
+static const char *prepareFlight(fmFlight *f, int async) {
+
+		FMITEM *it = f->fm;
+		fmContext *ctx = &f->ctx;
+		const char *err = NULL;
+		long long start;
+		size_t size;
+
+		initContext(ctx,f->key.data,f->key.datalen,f->key.encoding);
+		ctx->ret = NULL;
+		ctx->out = jsonwNew();
+		f->parse_us = f->run_us = -1;
+		if (!it->schema && (!async || (it->desc.flags & FM_RAW)))
+				return NULL;
+
+		start = ustime();
+		if (parseData(ctx) != SJSON_OK)
+				err = data_parser->err;
+		else if (it->schema && schemaValidate(it->schema,data_parser) != REDIS_OK)
+				err = it->schema->err;
+		if (err) {
+				if (it->schema) countInvalid(it);
+		} else if (!(it->desc.flags & FM_RAW)) {
+				if (async)
+						ctx->data = f->dom = sjsonToCJSON(data_parser);
+				else
+						ctx->data = sjsonToCJSONArena(data_parser,server.reqarena);
+				if (it->schema) {
+						size = sizeof(void*)*it->schema->nfields;
+						f->fields = zmalloc(size ? size : 1);
+						memcpy(f->fields,schemaResolve(it->schema,ctx->data),size);
+						ctx->fields = f->fields;
+				}
+		}
+		f->parse_us = ustime()-start;
+		return err;
+}
+
+static void releaseFlight(fmFlight *f) {
+
+		if (f->ctx.out) jsonwFree(f->ctx.out);
+		if (f->dom) cJSON_Delete(f->dom);
+		zfree(f->fields);
+		f->ctx.out = NULL;
+		f->dom = NULL;
+		f->fields = NULL;
+}
+
+/*run the n flights of a formula exporting a batch entry point in one call,
+  see flight.c. n is at most FM_BATCH_MAX.*/
+void grunBatch(fmFlight **f, robj **replies, int n) {
+
+		fmContext *ctx[FM_BATCH_MAX];
+		int ok[FM_BATCH_MAX];
+		const char *err;
+		long long start, run = -1;
+		int j, m = 0, phase;
+
+		for (j = 0; j < n; j++) {
+
+				replies[j] = NULL;
+				if ((err = prepareFlight(f[j],0)) != NULL)
+						replies[j] = createInvalidReply(err);
+				else
+						ctx[m++] = &f[j]->ctx;
+		}
+		if (m) {
+				start = ustime();
+				phase = enterFormula(f[0]->fm);
+				f[0]->fm->desc.batch(ctx,ok,m);
+				leaveFormula(phase);
+				run = (ustime()-start)/m;
+				fmStatsUsage(f[0]->fm,&call_usage,m);
+		}
+
+		for (j = 0, m = 0; j < n; j++) {
+
+				/*the requests of a batch share its running time.*/
+				fmStatsTimes(f[j]->fm,f[j]->parse_us,replies[j] ? -1 : run);
+				if (!replies[j]) replies[j] = createReplyObject(f[j]->fm,&f[j]->key,&f[j]->ctx,ok[m++]);
+				releaseFlight(f[j]);
+		}
+
+		/*drops the "data" DOMs without walking them.*/
+		arenaReset(server.reqarena);
+}
+
+/*hand the request of a flight to the async entry point of its formula.
+  Returns 1 when the formula took it, it then comes back to grunAsyncDone()
+  through fmComplete(). Else *reply is the answer.*/
+int grunAsync(fmFlight *f, robj **reply) {
+
+		const char *err;
+		int phase, ok;
+
+		err = prepareFlight(f,1);
+		fmStatsTimes(f->fm,f->parse_us,-1);
+		if (err) {
+				*reply = createInvalidReply(err);
+		} else {
+				phase = enterFormula(f->fm);
+				ok = f->fm->desc.async(&f->ctx);
+				leaveFormula(phase);
+				fmStatsUsage(f->fm,&call_usage,1);
+				if (ok) return 1;
+				*reply = shared.err;
+				incrRefCount(*reply);
+		}
+		releaseFlight(f);
+		return 0;
+}
+
+robj *grunAsyncDone(fmFlight *f, int ok) {
+
+		robj *reply = createReplyObject(f->fm,&f->key,&f->ctx,ok);
+
+		releaseFlight(f);
+		return reply;
+}
+
 void grunCommand(redisClient *c) {
 		
 		char *cmd = c->argv[2]->ptr;
-		root = cJSON_Parse(cmd);
-		
-		if (!root) {
-		
-				redisLog(REDIS_WARNING, "Fatal error, command format's not JSON: %s",cmd);
-				goto err;
+		envelope env;
+		fmContext ctx;
+		const char *err;
+		long long len = 0;
+		int ok;
+
+		if (parseEnvelope(cmd,sdslen(cmd),&env) != REDIS_OK) {
+
+				/*the body may be binary msgpack: log an escaped prefix only.*/
+				sds bytes = sdscatrepr(sdsempty(),cmd,sdslen(cmd) < 64 ? sdslen(cmd) : 64);
+
+				redisLog(REDIS_WARNING, "Fatal error, command format {%s} is wrong: %s",env.err,bytes);
+				sdsfree(bytes);
+				addReply(c,shared.err);
+				return ;
 		}
-		int i;
-		cJSON *cj;
-		for (i = 0 ; i < sizeof(kw_list)/sizeof(struct kwit); i++) {
 
-				cj = JS_GOItem(root,kw_list[i].kw);
-				if (!cj || cj->type != kw_list[i].type) {
-				
-						redisLog(REDIS_WARNING, "Fatal error, command format {%s} is wrong", kw_list[i].kw);
-						goto err;
-				} else if (!strcmp(cj->string,"data"))	
-						data = cj;
-				else if (!strcmp(cj->string,"formula"))	
-						formula = cj;
+		/*find formula_func by its id, and shed load before spending anything
+		  more on the request.*/
+		FMITEM *it = lookupFormula(c,env.formula,env.formulalen);
+		if (it && !admissionAllow(it)) {
+
+				it->stats->rejected++;
+				addReply(c,shared.busyerr);
+				return ;
 		}
 
-		/*find formula_func from server.fms(dict)*/
-		sds s = sdsnew(formula->valuestring);
-		void* val = dictFetchValue(server.fms,s);
-		sdsfree(s);
+		traceStart(c,&env);
 
-		FMITEM *it = (FMITEM*)val;
-		if (!it || !it->run(data, fm_buf)) goto err;
+		/*skip requests the caller has already given up on. the ones that
+		  wait for a flight are checked again before it runs.*/
+		long long deadline = requestDeadline(c,&env);
+		if (deadline && ustime() > deadline) {
 
-		addReplyBulkCString(c,fm_buf);
-		cJSON_Delete(root);
-		return ;
-err:
-		addReply(c,shared.err);
-		cJSON_Delete(root);
-		return ;
+				server.stat_timedout_requests++;
+				addReply(c,shared.timeouterr);
+				return ;
+		}
+
+		if (!it) {
+
+				/*a formula being loaded will be there soon.*/
+				sds s = sdsnewlen(env.formula,env.formulalen);
+				addReply(c,fmLoading(s) ? shared.loadingerr : shared.err);
+				sdsfree(s);
+				return ;
+		}
+		c->fm = it;
+		fmStatsRequest(it,sdslen(cmd));
+
+		/*a deterministic formula answers repeats from its cache, and an
+		  identical request already in flight is waited for. Async formulas,
+		  batch ones and the ones run by workers are called from a flight,
+		  the client waits for it. The rest run right here.*/
+		fmCacheEntry key, *store = NULL;
+		if ((it->desc.flags & FM_DETERMINISTIC) || it->desc.async || it->pool) {
+
+				fmCacheKey(&key,env.encoding,env.data,env.datalen);
+				robj *hit = it->cache ? fmCacheLookup(it->cache,&key) : NULL;
+				if (hit) {
+
+						addReply(c,hit);
+						fmStatsReplyObject(it,ustime()-c->querytime,hit);
+						return ;
+				}
+				if (it->desc.async || it->pool || it->desc.batch || flightFind(it,&key)) {
+
+						flightJoin(c,it,&key,deadline);
+						c->fm = NULL; /*admission is told when the flight lands.*/
+						return ;
+				}
+				if (it->cache) store = &key;
+		}
+
+		initContext(&ctx,env.data,env.datalen,env.encoding);
+		if (c->trace) c->trace->ts[TRACE_FM_START] = ustime();
+		ok = callFormula(it,&ctx,&err);
+		c->parse_us = parse_us;
+		c->run_us = run_us;
+		if (c->trace) {
+				c->trace->ts[TRACE_FM_END] = ustime();
+				c->trace->parse_us = parse_us;
+				c->trace->run_us = run_us;
+		}
+
+		/*replied in place unless it is cached.*/
+		if (err) {
+				addReplyErrorFormat(c,"invalid data: %s",err);
+				ok = 0;
+		} else if ((len = replyLength(&ctx,ok)) < 0) {
+				addReply(c,shared.err);
+				ok = 0;
+		} else if (store) {
+				robj *reply = createReplyObject(it,store,&ctx,ok);
+
+				addReply(c,reply);
+				decrRefCount(reply);
+		} else if (jsonwLength(ctx.out)) {
+				addReplyJson(c,ctx.out);
+		} else {
+				addReplyBulkCBuffer(c,ctx.ret,len);
+		}
+		fmStatsReply(it,ustime()-c->querytime,ok ? len : 0,!ok);
+		jsonwReset(reply_writer);
+
+		/*drops the "data" DOM without walking it.*/
+		arenaReset(server.reqarena);
 }
 
+/*load <name> <bytes>: the library as comma separated decimal byte values,
+  as the old fmload sends it. See fmupload for the binary safe way.*/
 void loadCommand(redisClient *c) {
 
 		char path[BUFSIZ];
-		char *fm_name = c->argv[1]->ptr;
+		sds fm_name = c->argv[1]->ptr;
 		char *fm_body = c->argv[2]->ptr;
-		FILE* fp = fopen(path,"w+");
-		char ch[BUFSIZ];
 		char *stop;
+		FILE *fp;
+
+		if (!fmValidName(fm_name)) goto err;
 
 		/*exist or not.*/
-		dictEntry *de = dictFind(server.fms,fm_name);
-		if (de) {
-				redisLog(REDIS_WARNING, "formula [%s] was already loaded.",fm_name);
+		if (dictFind(server.fms,fm_name) || fmLoadRunning(fm_name)) {
+				redisLog(REDIS_WARNING, "formula [%s] was already loaded, see reload.",fm_name);
 				goto err;
 		}
 
-		sprintf(path,"./lib/lib%s.so",fm_name);
+		/*write a temp file, installed once complete.*/
+		snprintf(path,sizeof(path),"./lib/.lib%s.so.load.%d",fm_name,c->fd);
+		if (!(fp = fopen(path,"w"))) {
 
-		/*create new file.*/
-		if (!fp) {
-
-				fprintf(stderr,"open %s failed.\r\n",fm_name);
+				redisLog(REDIS_WARNING, "open %s failed: %s",path,strerror(errno));
 				goto err;
 		}
 
 		/*write file.*/
 		while(1) {
 
-				ch[0]=strtol(fm_body,&stop,10);
-				if (1!=fwrite(ch,1,1,fp)) {
+				if (putc((int)strtol(fm_body,&stop,10),fp) == EOF) {
 
-						redisLog(REDIS_WARNING, "write file %s failed.",fm_name);
+						redisLog(REDIS_WARNING, "write file %s failed.",path);
 						fclose(fp);
+						unlink(path);
 						goto err;
 				}
-				if (stop[1] == '\0') break;
+				if (stop[0] == '\0' || stop[1] == '\0') break;
 				fm_body = stop + 1;
 		}
 
 		/*close*/
-		fclose(fp);
-		if (chmod(path,S_IXUSR|S_IRUSR|S_IWUSR))/*rwx*/{
+		if (fclose(fp) == EOF) {
 
-				redisLog(REDIS_NOTICE,"chmod file wrong.");
-				goto err;	
+				redisLog(REDIS_WARNING, "write file %s failed.",path);
+				unlink(path);
+				goto err;
 		}
-		
-		/*load new formula.*/
-		void *val = loadfm(fm_name);
-		if (!val) goto err;
-		
-		/*add new formula's func and key to dict.*/
-		int retval = dictAdd(server.fms, sdsnew(fm_name), val);
-		if (retval != DICT_OK) goto err;
-
-		redisLog(REDIS_NOTICE,"formula [%s] was loaded successfully.",fm_name);
 
-		addReply(c,shared.ok);
+		/*load new formula in the background, it is added to the dict once
+		  its init has succeeded.*/
+		fmInstall(c,fm_name,path,0);
 		return ;
 err:
 		addReply(c,shared.err);
 		return ;
 }
 
+/*make it the version of the formula name serving requests. Calls the
+  old version has taken already (pending flights, async calls) finish on
+  it, and it is unloaded once the last one has. The admission state and
+  counters carry over, the result cache starts empty with the same budget:
+  the results of the old version may not be those of the new one.*/
+void swapfm(sds name, FMITEM *it) {
+
+		dictEntry *de = dictFind(server.fms,name);
+		FMITEM *old = dictGetEntryVal(de);
+
+		it->noadmission = old->noadmission;
+		it->adm = old->adm;
+		it->adm.queued = 0; /*the requests queued on old land there.*/
+		it->stat_flights = old->stat_flights;
+		it->stat_coalesced = old->stat_coalesced;
+		it->stats = old->stats;
+		it->stats->refcount++;
+		it->nworkers = old->nworkers;
+		if (it->nworkers) workerStart(name,it);
+		if (old->cache) {
+				if (it->desc.flags & FM_DETERMINISTIC)
+						it->cache = fmCacheCreate(old->cache->ttl,old->cache->maxmemory);
+				else
+						redisLog(REDIS_WARNING,"formula [%s] is no longer deterministic, its results are not cached.",
+										name);
+		}
+		dictSetHashVal(server.fms,de,it);
+		it->name = dictGetEntryKey(de);
+		it->id = old->id;
+		server.fmtable[it->id] = it;
+		server.stat_reloads++;
+
+		old->retired = 1;
+		if (old->refcount) server.fms_draining++;
+		else unloadfm(old);
+}
+
+/*publish a formula loaded for the first time under name, giving it the
+  next id. Ids are never reused: formulas are not unloaded, and reload
+  hands the id over to the new version (see swapfm).*/
+int addfm(sds name, FMITEM *it) {
+
+		sds key = sdsdup(name);
+
+		if (dictAdd(server.fms,key,it) != DICT_OK) {
+				sdsfree(key);
+				return REDIS_ERR;
+		}
+		it->name = key;
+		it->stats = fmStatsCreate();
+		server.fmtable = zrealloc(server.fmtable,sizeof(FMITEM*)*(server.fmcount+1));
+		it->id = server.fmcount++;
+		server.fmtable[it->id] = it;
+		return REDIS_OK;
+}
+
+/*find the formula called name for c. Clients mostly send the same formula
+  over and over, so the name of the last one found is kept with its id and
+  a repeat costs a memcmp, no sds and no hash lookup.*/
+FMITEM *lookupFormula(redisClient *c, const char *name, size_t len) {
+
+		FMITEM *it;
+		sds s;
+
+		if (c->fmname && sdslen(c->fmname) == len && !memcmp(c->fmname,name,len))
+				return server.fmtable[c->fmid];
+
+		s = sdsnewlen(name,len);
+		if (!(it = dictFetchValue(server.fms,s))) {
+				sdsfree(s);
+				return NULL;
+		}
+		sdsfree(c->fmname);
+		c->fmname = s;
+		c->fmid = it->id;
+		return it;
+}
+
+/*reload <name>: load the current lib<name>.so as the next version of a
+  loaded formula, in the background (see loader.c). The old version serves
+  until the init of the new one has succeeded, and keeps serving if it
+  fails.*/
+void reloadCommand(redisClient *c) {
+
+		sds fm_name = c->argv[1]->ptr;
+		FMITEM *old = dictFetchValue(server.fms,fm_name);
+
+		if (!old) {
+				addReplyErrorFormat(c,"formula [%s] is not loaded",fm_name);
+				return ;
+		}
+		fmLoadStart(c,fm_name,old->version+1,1);
+}
+
 void setCommand(redisClient *c) {
 
 		addReply(c,shared.ok);
@@ -0,0 +1,79 @@
+/* Bump allocator. See arena.h for the rationale.
+ *
+ * Allocating is a pointer increment in the head chunk, a new chunk is only
+ * needed when the head is full. When a reset finds that more than one chunk
+ * was used, they are merged into a single chunk as large as all of them (up
+ * to a->retain), so once the arena has seen its typical load a reset is a
+ * couple of stores. */
+
+#include <string.h>
+#include "arena.h"
+#include "zmalloc.h"
+
+#define ARENA_ALIGN 8   /* what cJSON and friends need */
+
+static arenaChunk *arenaNewChunk(arena *a, size_t size) {
+    int tag = zmalloc_set_tag(a->tag);
+    arenaChunk *c = zmalloc(sizeof(*c)+size);
+
+    zmalloc_set_tag(tag);
+    c->next = a->head;
+    c->size = size;
+    a->head = c;
+    a->used = 0;
+    a->size += size;
+    return c;
+}
+
+arena *arenaCreate(size_t chunksize, size_t retain) {
+    arena *a = zcalloc(sizeof(*a));
+
+    a->tag = zmalloc_get_tag();
+    a->chunksize = chunksize;
+    a->retain = retain < chunksize ? chunksize : retain;
+    arenaNewChunk(a,chunksize);
+    return a;
+}
+
+static void arenaFreeChunks(arena *a) {
+    arenaChunk *c = a->head, *next;
+
+    while (c) {
+        next = c->next;
+        zfree(c);
+        c = next;
+    }
+    a->head = NULL;
+    a->size = 0;
+}
+
+void arenaRelease(arena *a) {
+    if (!a) return;
+    arenaFreeChunks(a);
+    zfree(a);
+}
+
+void *arenaAlloc(arena *a, size_t size) {
+    void *p;
+
+    size = (size+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+    if (a->used+size > a->head->size)
+        arenaNewChunk(a,size > a->chunksize ? size : a->chunksize);
+    p = a->head->data+a->used;
+    a->used += size;
+    a->allocated += size;
+    if (a->allocated > a->peak) a->peak = a->allocated;
+    return p;
+}
+
+void arenaReset(arena *a) {
+    if (a->head->next || a->size > a->retain) {
+        size_t size = a->size;
+
+        if (size > a->retain) size = a->retain;
+        arenaFreeChunks(a);
+        arenaNewChunk(a,size);
+    }
+    a->used = 0;
+    a->allocated = 0;
+}
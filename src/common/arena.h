@@ -0,0 +1,33 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+/* Bump allocator for memory that dies all at once, e.g. everything built
+ * for one request. Chunks come from zmalloc so they are accounted in
+ * used_memory, single allocations are never freed, arenaReset() drops them
+ * all. */
+typedef struct arenaChunk {
+    struct arenaChunk *next;
+    size_t size;                /* usable bytes in data */
+    char data[];
+} arenaChunk;
+
+typedef struct arena {
+    arenaChunk *head;           /* chunk allocations are served from */
+    size_t used;                /* bytes used in head */
+    size_t chunksize;           /* minimum size of a new chunk */
+    size_t retain;              /* max chunk size kept across resets */
+    size_t size;                /* bytes of all the chunks */
+    size_t allocated;           /* bytes handed out since the last reset */
+    size_t peak;                /* high-water mark of allocated */
+    int tag;                    /* zmalloc tag of the chunks, the one in
+                                   use when the arena was created */
+} arena;
+
+arena *arenaCreate(size_t chunksize, size_t retain);
+void arenaRelease(arena *a);
+void *arenaAlloc(arena *a, size_t size);
+void arenaReset(arena *a);
+
+#endif
@@ -31,6 +31,8 @@
 #include <limits.h>
 #include <ctype.h>
 #include "cJSON.h"
+#include "numconv.h"
+#include "arena.h"
 
 static const char *ep;
 
@@ -57,6 +59,17 @@ static char* cJSON_strdup(const char* str)
       return copy;
 }
 
+/* Nodes of an arena tree (item->arena set, see sjsonToCJSONArena()) live in the arena with their
+   strings and index: they are never handed to free_fn, and what is added to them is allocated there too. */
+static void *cJSON_alloc_for(cJSON *item,size_t len)	{return item->arena?arenaAlloc(item->arena,len):cJSON_malloc(len);}
+static void cJSON_release(cJSON *item,void *ptr)		{if (ptr && !item->arena) cJSON_free(ptr);}
+static char *cJSON_strdup_for(cJSON *item,const char *str)
+{
+	size_t len=strlen(str)+1;char *copy=(char*)cJSON_alloc_for(item,len);
+	if (copy) memcpy(copy,str,len);
+	return copy;
+}
+
 void cJSON_InitHooks(cJSON_Hooks* hooks)
 {
     if (!hooks) { /* Reset hooks */
@@ -69,6 +82,10 @@ void cJSON_InitHooks(cJSON_Hooks* hooks)
 	cJSON_free	 = (hooks->free_fn)?hooks->free_fn:free;
 }
 
+/* Allocate and free with the hooks, for code building cJSON trees itself. */
+void *cJSON_Malloc(size_t sz) {return cJSON_malloc(sz);}
+void cJSON_Free(void *ptr) {cJSON_free(ptr);}
+
 /* Internal constructor. */
 static cJSON *cJSON_New_Item()
 {
@@ -85,9 +102,10 @@ void cJSON_Delete(cJSON *c)
 	{
 		next=c->next;
 		if (!(c->type&cJSON_IsReference) && c->child) cJSON_Delete(c->child);
-		if (!(c->type&cJSON_IsReference) && c->valuestring) cJSON_free(c->valuestring);
-		if (c->string) cJSON_free(c->string);
-		cJSON_free(c);
+		if (!(c->type&cJSON_IsReference) && c->valuestring) cJSON_release(c,c->valuestring);
+		if (c->string) cJSON_release(c,c->string);
+		cJSON_release(c,c->index);
+		cJSON_release(c,c);
 		c=next;
 	}
 }
@@ -95,46 +113,24 @@ void cJSON_Delete(cJSON *c)
 /* Parse the input text to generate a number, and populate the result into item. */
 static const char *parse_number(cJSON *item,const char *num)
 {
-	double n=0,sign=1,scale=0;int subscale=0,signsubscale=1;
-
-	/* Could use sscanf for this? */
-	if (*num=='-') sign=-1,num++;	/* Has sign? */
-	if (*num=='0') num++;			/* is zero */
-	if (*num>='1' && *num<='9')	do	n=(n*10.0)+(*num++ -'0');	while (*num>='0' && *num<='9');	/* Number? */
-	if (*num=='.') {num++;		do	n=(n*10.0)+(*num++ -'0'),scale--; while (*num>='0' && *num<='9');}	/* Fractional part? */
-	if (*num=='e' || *num=='E')		/* Exponent? */
-	{	num++;if (*num=='+') num++;	else if (*num=='-') signsubscale=-1,num++;		/* With sign? */
-		while (*num>='0' && *num<='9') subscale=(subscale*10)+(*num++ - '0');	/* Number? */
-	}
+	double n=0;size_t len=numParseDouble(num,(size_t)-1,&n);	/* correctly rounded, see numconv.c */
 
-	n=sign*n*pow(10.0,(scale+subscale*signsubscale));	/* number = +/- number.fraction * 10^+/- exponent */
-	
+	if (!len) {ep=num;return 0;}
 	item->valuedouble=n;
 	item->valueint=(int)n;
 	item->type=cJSON_Number;
-	return num;
+	return num+len;
 }
 
 /* Render the number nicely from the given item into a string. */
 static char *print_number(cJSON *item)
 {
-	char *str;
+	char *str=(char*)cJSON_malloc(NUM_BUFLEN);
 	double d=item->valuedouble;
-	if (fabs(((double)item->valueint)-d)<=DBL_EPSILON && d<=INT_MAX && d>=INT_MIN)
-	{
-		str=(char*)cJSON_malloc(21);	/* 2^64+1 can be represented in 21 chars. */
-		if (str) sprintf(str,"%d",item->valueint);
-	}
-	else
-	{
-		str=(char*)cJSON_malloc(64);	/* This is a nice tradeoff. */
-		if (str)
-		{
-			if (fabs(floor(d)-d)<=DBL_EPSILON)			sprintf(str,"%.0f",d);
-			else if (fabs(d)<1.0e-6 || fabs(d)>1.0e9)	sprintf(str,"%e",d);
-			else										sprintf(str,"%f",d);
-		}
-	}
+	if (!str) return 0;
+	if (fabs(((double)item->valueint)-d)<=DBL_EPSILON && d<=INT_MAX && d>=INT_MIN)	numPrintInt64(str,item->valueint);
+	else if (!isfinite(d))	strcpy(str,"null");		/* JSON has no inf or nan */
+	else					numPrintDouble(str,d);	/* shortest text that reads back as d */
 	return str;
 }
 
@@ -294,8 +290,9 @@ static const char *parse_array(cJSON *item,const char *value)
 	value=skip(value+1);
 	if (*value==']') return value+1;	/* empty array. */
 
-	item->child=child=cJSON_New_Item();
+	item->child=item->tail=child=cJSON_New_Item();
 	if (!item->child) return 0;		 /* memory fail */
+	item->count=1;
 	value=skip(parse_value(child,skip(value)));	/* skip any spacing, get the value. */
 	if (!value) return 0;
 
@@ -303,7 +300,7 @@ static const char *parse_array(cJSON *item,const char *value)
 	{
 		cJSON *new_item;
 		if (!(new_item=cJSON_New_Item())) return 0; 	/* memory fail */
-		child->next=new_item;new_item->prev=child;child=new_item;
+		child->next=new_item;new_item->prev=child;item->tail=child=new_item;item->count++;
 		value=skip(parse_value(child,skip(value+1)));
 		if (!value) return 0;	/* memory fail */
 	}
@@ -373,8 +370,9 @@ static const char *parse_object(cJSON *item,const char *value)
 	value=skip(value+1);
 	if (*value=='}') return value+1;	/* empty array. */
 	
-	item->child=child=cJSON_New_Item();
+	item->child=item->tail=child=cJSON_New_Item();
 	if (!item->child) return 0;
+	item->count=1;
 	value=skip(parse_string(child,skip(value)));
 	if (!value) return 0;
 	child->string=child->valuestring;child->valuestring=0;
@@ -386,7 +384,7 @@ static const char *parse_object(cJSON *item,const char *value)
 	{
 		cJSON *new_item;
 		if (!(new_item=cJSON_New_Item()))	return 0; /* memory fail */
-		child->next=new_item;new_item->prev=child;child=new_item;
+		child->next=new_item;new_item->prev=child;item->tail=child=new_item;item->count++;
 		value=skip(parse_string(child,skip(value+1)));
 		if (!value) return 0;
 		child->string=child->valuestring;child->valuestring=0;
@@ -457,33 +455,134 @@ static char *print_object(cJSON *item,int depth,int fmt)
 	return out;	
 }
 
+/* Lookup indexes. Arrays and objects of cJSON_INDEX_MIN items or more get one on their first lookup:
+   for arrays a table of the items by position, for objects an open addressing hash on the lowercased
+   name, in which items with the same name are met in chain order. Appending keeps the index up to
+   date while it has room, any other change to the chain drops it. References always walk the chain.
+   tail and count are only kept while the chain belongs to one container: once a reference to it
+   exists it may change through either, so count goes to -1 and both walk the chain from then on.
+   A chain edited by hand is caught when its tail or head no longer match, and stops being kept. */
+#define cJSON_INDEX_MIN 32
+
+typedef struct cJSON_Index {
+	int size;					/* slots */
+	int used;					/* items in the index */
+	cJSON *slot[];
+} cJSON_Index;
+
+static unsigned cJSON_hash(const char *str)	{unsigned h=5381;if (str) while (*str) h=h*33+tolower(*(const unsigned char*)str++);return h;}
+static void cJSON_drop_index(cJSON *c)		{cJSON_release(c,c->index);c->index=0;}
+static void cJSON_untrack(cJSON *c)			{cJSON_drop_index(c);c->tail=0;c->count=-1;}
+/* Whether tail and count of c can be trusted. */
+static int cJSON_tracked(cJSON *c)
+{
+	if ((c->type&cJSON_IsReference) || c->count<0) return 0;
+	if ((c->tail && c->tail->next) || !c->child!=!c->count) {cJSON_untrack(c);return 0;}
+	return 1;
+}
+static int cJSON_indexed(cJSON *c)			{return (c->type==cJSON_Array || c->type==cJSON_Object) && cJSON_tracked(c) && c->count>=cJSON_INDEX_MIN;}
+
+static void cJSON_index_insert(cJSON_Index *index,cJSON *item)
+{
+	unsigned i=cJSON_hash(item->string)&(index->size-1);
+	while (index->slot[i]) i=(i+1)&(index->size-1);
+	index->slot[i]=item;index->used++;
+}
+
+static cJSON_Index *cJSON_get_index(cJSON *c)
+{
+	cJSON_Index *index;cJSON *e;int size=1;size_t len;
+	if (c->index) return c->index;
+
+	while (size<c->count*2) size<<=1;
+	len=sizeof(cJSON_Index)+size*sizeof(cJSON*);
+	index=(cJSON_Index*)cJSON_alloc_for(c,len);
+	if (!index) return 0;
+	memset(index,0,len);
+	index->size=size;
+	for (e=c->child;e;e=e->next)
+	{
+		if (c->type==cJSON_Object) cJSON_index_insert(index,e);
+		else index->slot[index->used++]=e;
+	}
+	return c->index=index;
+}
+
+/* Keep the index in step with an item appended to the chain. */
+static void cJSON_index_append(cJSON *c,cJSON *item)
+{
+	cJSON_Index *index=c->index;
+	if (!index) return;
+	if (c->type==cJSON_Object && (index->used+1)*4<=index->size*3) cJSON_index_insert(index,item);
+	else if (c->type==cJSON_Array && index->used<index->size) index->slot[index->used++]=item;
+	else cJSON_drop_index(c);
+}
+
+static cJSON *cJSON_get_item(cJSON *object,const char *string,int case_sensitive)
+{
+	cJSON_Index *index;cJSON *c;unsigned i;
+	if (object->type==cJSON_Object && cJSON_indexed(object) && (index=cJSON_get_index(object)))
+	{
+		for (i=cJSON_hash(string)&(index->size-1);(c=index->slot[i]);i=(i+1)&(index->size-1))
+			if (case_sensitive?(c->string && !strcmp(c->string,string)):!cJSON_strcasecmp(c->string,string)) return c;
+		return 0;
+	}
+	for (c=object->child;c;c=c->next)
+		if (case_sensitive?(c->string && !strcmp(c->string,string)):!cJSON_strcasecmp(c->string,string)) return c;
+	return 0;
+}
+
 /* Get Array size/item / object item. */
-int    cJSON_GetArraySize(cJSON *array)							{cJSON *c=array->child;int i=0;while(c)i++,c=c->next;return i;}
-cJSON *cJSON_GetArrayItem(cJSON *array,int item)				{cJSON *c=array->child;  while (c && item>0) item--,c=c->next; return c;}
-cJSON *cJSON_GetObjectItem(cJSON *object,const char *string)	{cJSON *c=object->child; while (c && cJSON_strcasecmp(c->string,string)) c=c->next; return c;}
+int    cJSON_GetArraySize(cJSON *array)							{cJSON *c=array->child;int i=0;if (cJSON_tracked(array)) return array->count;while(c)i++,c=c->next;return i;}
+cJSON *cJSON_GetArrayItem(cJSON *array,int item)
+{
+	cJSON_Index *index;cJSON *c=array->child;
+	if (array->type==cJSON_Array && cJSON_indexed(array))
+	{
+		if (item<=0) return c;
+		if (item>=array->count) return 0;
+		if (item==array->count-1) return array->tail;
+		if ((index=cJSON_get_index(array))) return index->slot[item];
+	}
+	while (c && item>0) item--,c=c->next;
+	return c;
+}
+cJSON *cJSON_GetObjectItem(cJSON *object,const char *string)				{return cJSON_get_item(object,string,0);}
+cJSON *cJSON_GetObjectItemCaseSensitive(cJSON *object,const char *string)	{return cJSON_get_item(object,string,1);}
 
 /* Utility for array list handling. */
 static void suffix_object(cJSON *prev,cJSON *item) {prev->next=item;item->prev=prev;}
 /* Utility for handling references. */
-static cJSON *create_reference(cJSON *item) {cJSON *ref=cJSON_New_Item();if (!ref) return 0;memcpy(ref,item,sizeof(cJSON));ref->string=0;ref->type|=cJSON_IsReference;ref->next=ref->prev=0;return ref;}
+static cJSON *create_reference(cJSON *item) {cJSON *ref=cJSON_New_Item();if (!ref) return 0;if (!(item->type&cJSON_IsReference)) cJSON_untrack(item);memcpy(ref,item,sizeof(cJSON));ref->string=0;ref->arena=0;ref->type|=cJSON_IsReference;ref->next=ref->prev=0;return ref;}
 
 /* Add item to array/object. */
-void   cJSON_AddItemToArray(cJSON *array, cJSON *item)						{cJSON *c=array->child;if (!item) return; if (!c) {array->child=item;} else {while (c && c->next) c=c->next; suffix_object(c,item);}}
-void   cJSON_AddItemToObject(cJSON *object,const char *string,cJSON *item)	{if (!item) return; if (item->string) cJSON_free(item->string);item->string=cJSON_strdup(string);cJSON_AddItemToArray(object,item);}
+void   cJSON_AddItemToArray(cJSON *array, cJSON *item)
+{
+	cJSON *c=array->child;if (!item) return;
+	if (!cJSON_tracked(array)) {if (!c) {array->child=item;} else {while (c && c->next) c=c->next; suffix_object(c,item);} return;}
+	if (!c) array->child=item; else suffix_object(array->tail,item);
+	array->tail=item;array->count++;
+	cJSON_index_append(array,item);
+}
+void   cJSON_AddItemToObject(cJSON *object,const char *string,cJSON *item)	{if (!item) return; if (item->string) cJSON_release(item,item->string);item->string=cJSON_strdup_for(item,string);cJSON_AddItemToArray(object,item);}
 void	cJSON_AddItemReferenceToArray(cJSON *array, cJSON *item)						{cJSON_AddItemToArray(array,create_reference(item));}
 void	cJSON_AddItemReferenceToObject(cJSON *object,const char *string,cJSON *item)	{cJSON_AddItemToObject(object,string,create_reference(item));}
 
-cJSON *cJSON_DetachItemFromArray(cJSON *array,int which)			{cJSON *c=array->child;while (c && which>0) c=c->next,which--;if (!c) return 0;
-	if (c->prev) c->prev->next=c->next;if (c->next) c->next->prev=c->prev;if (c==array->child) array->child=c->next;c->prev=c->next=0;return c;}
+cJSON *cJSON_DetachItemFromArray(cJSON *array,int which)			{cJSON *c=cJSON_GetArrayItem(array,which);int tracked=cJSON_tracked(array);if (!c) return 0;
+	if (c->prev) c->prev->next=c->next;if (c->next) c->next->prev=c->prev;if (c==array->child) array->child=c->next;
+	if (tracked) {if (c==array->tail) array->tail=c->prev;array->count--;cJSON_drop_index(array);}
+	c->prev=c->next=0;return c;}
 void   cJSON_DeleteItemFromArray(cJSON *array,int which)			{cJSON_Delete(cJSON_DetachItemFromArray(array,which));}
 cJSON *cJSON_DetachItemFromObject(cJSON *object,const char *string) {int i=0;cJSON *c=object->child;while (c && cJSON_strcasecmp(c->string,string)) i++,c=c->next;if (c) return cJSON_DetachItemFromArray(object,i);return 0;}
 void   cJSON_DeleteItemFromObject(cJSON *object,const char *string) {cJSON_Delete(cJSON_DetachItemFromObject(object,string));}
 
 /* Replace array/object items with new ones. */
-void   cJSON_ReplaceItemInArray(cJSON *array,int which,cJSON *newitem)		{cJSON *c=array->child;while (c && which>0) c=c->next,which--;if (!c) return;
+void   cJSON_ReplaceItemInArray(cJSON *array,int which,cJSON *newitem)		{cJSON *c=cJSON_GetArrayItem(array,which);int tracked=cJSON_tracked(array);if (!c) return;
 	newitem->next=c->next;newitem->prev=c->prev;if (newitem->next) newitem->next->prev=newitem;
-	if (c==array->child) array->child=newitem; else newitem->prev->next=newitem;c->next=c->prev=0;cJSON_Delete(c);}
-void   cJSON_ReplaceItemInObject(cJSON *object,const char *string,cJSON *newitem){int i=0;cJSON *c=object->child;while(c && cJSON_strcasecmp(c->string,string))i++,c=c->next;if(c){newitem->string=cJSON_strdup(string);cJSON_ReplaceItemInArray(object,i,newitem);}}
+	if (c==array->child) array->child=newitem; else newitem->prev->next=newitem;
+	if (tracked) {if (c==array->tail) array->tail=newitem;cJSON_drop_index(array);}
+	c->next=c->prev=0;cJSON_Delete(c);}
+void   cJSON_ReplaceItemInObject(cJSON *object,const char *string,cJSON *newitem){int i=0;cJSON *c=object->child;while(c && cJSON_strcasecmp(c->string,string))i++,c=c->next;if(c){newitem->string=cJSON_strdup_for(newitem,string);cJSON_ReplaceItemInArray(object,i,newitem);}}
 
 /* Create basic types: */
 cJSON *cJSON_CreateNull()						{cJSON *item=cJSON_New_Item();if(item)item->type=cJSON_NULL;return item;}
@@ -496,7 +595,7 @@ cJSON *cJSON_CreateArray()						{cJSON *item=cJSON_New_Item();if(item)item->type
 cJSON *cJSON_CreateObject()						{cJSON *item=cJSON_New_Item();if(item)item->type=cJSON_Object;return item;}
 
 /* Create Arrays: */
-cJSON *cJSON_CreateIntArray(int *numbers,int count)				{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}return a;}
-cJSON *cJSON_CreateFloatArray(float *numbers,int count)			{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}return a;}
-cJSON *cJSON_CreateDoubleArray(double *numbers,int count)		{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}return a;}
-cJSON *cJSON_CreateStringArray(const char **strings,int count)	{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateString(strings[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}return a;}
+cJSON *cJSON_CreateIntArray(int *numbers,int count)				{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}if (a && count>0) a->tail=p,a->count=count;return a;}
+cJSON *cJSON_CreateFloatArray(float *numbers,int count)			{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}if (a && count>0) a->tail=p,a->count=count;return a;}
+cJSON *cJSON_CreateDoubleArray(double *numbers,int count)		{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}if (a && count>0) a->tail=p,a->count=count;return a;}
+cJSON *cJSON_CreateStringArray(const char **strings,int count)	{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateString(strings[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}if (a && count>0) a->tail=p,a->count=count;return a;}
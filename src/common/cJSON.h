@@ -51,8 +51,20 @@ typedef struct cJSON {
 	double valuedouble;			/* The item's number, if type==cJSON_Number */
 
 	char *string;				/* The item's name string, if this item is the child of, or is in the list of subitems of an object. */
+
+	/* Added by formula ABI 3 (see formula.h): nodes are larger than in older builds, allocate them with cJSON_Create* only. */
+	struct cJSON *tail;			/* Last item of the child chain, for arrays and objects. */
+	int count;					/* Number of items in the child chain, -1 once the chain is shared with a reference. */
+	struct cJSON_Index *index;	/* Lookup index of large arrays/objects, built on demand. Edit the chain through the API only. */
+	void *arena;				/* Arena the node, its strings and its index live in, NULL if they come from the hooks. */
 } cJSON;
 
+/* Version of the layout above, bumped with it. Every object built with this header carries it, so code loading
+   a library can check the library allocates nodes of the right size (see loadLegacyFormula() in gsh's command.c). */
+#define cJSON_LAYOUT 3
+extern const int cJSON_layout;
+__attribute__((weak)) const int cJSON_layout = cJSON_LAYOUT;
+
 typedef struct cJSON_Hooks {
       void *(*malloc_fn)(size_t sz);
       void (*free_fn)(void *ptr);
@@ -60,6 +72,9 @@ typedef struct cJSON_Hooks {
 
 /* Supply malloc, realloc and free functions to cJSON */
 extern void cJSON_InitHooks(cJSON_Hooks* hooks);
+/* Allocate/free memory through the hooks, so trees built outside cJSON.c can be released with cJSON_Delete. */
+extern void *cJSON_Malloc(size_t sz);
+extern void cJSON_Free(void *ptr);
 
 
 /* Supply a block of JSON, and this returns a cJSON object you can interrogate. Call cJSON_Delete when finished. */
@@ -77,6 +92,8 @@ extern int	  cJSON_GetArraySize(cJSON *array);
 extern cJSON *cJSON_GetArrayItem(cJSON *array,int item);
 /* Get item "string" from object. Case insensitive. */
 extern cJSON *cJSON_GetObjectItem(cJSON *object,const char *string);
+/* Get item "string" from object. Case sensitive. */
+extern cJSON *cJSON_GetObjectItemCaseSensitive(cJSON *object,const char *string);
 
 /* For analysing failed parses. This returns a pointer to the parse error. You'll probably need to look a few chars back to make sense of it. Defined when cJSON_Parse() returns 0. 0 when cJSON_Parse() succeeds. */
 extern const char *cJSON_GetErrorPtr();
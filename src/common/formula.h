@@ -1,6 +1,148 @@
 #ifndef _FORMULA_H_
 #define _FORMULA_H_
 
+#include <stddef.h>
+
 #define FORMULA_BUFLEN  1024*1024*8
 
+/* Request context handed to the run entry point of a formula (see
+ * fmDescriptor below), or to
+ *   int gsh_formula_<name>_exec(fmContext *ctx);
+ * exported instead of gsh_formula_<name>_run. The "data" value of the envelope is not
+ * parsed unless the formula asks for it with fmContextData(), formulas that
+ * understand the raw bytes can use ctx->raw directly. */
+typedef struct fmContext {
+    const char *raw;        /* raw bytes of "data", not nul terminated */
+    size_t rawlen;
+    int encoding;           /* FM_ENCODING_* of raw, see below */
+    void *data;             /* cJSON DOM of "data", see fmContextData() */
+    void **fields;          /* cJSON item of every schema field, see below */
+    void *ret;              /* FORMULA_BUFLEN bytes buffer for the reply */
+    struct jsonw *out;      /* streaming reply, see below */
+} fmContext;
+
+/* Parse "data" into a cJSON DOM on first use. Returns NULL if it is not
+ * valid JSON. The DOM is owned by the server and lives in a per request
+ * arena dropped as a whole after the call: do not keep pointers into it,
+ * and items the formula creates and adds to it are not freed with it. */
+void *fmContextData(fmContext *ctx);
+
+/* Requests may come as JSON or as MessagePack (common/msgpack.h). ctx->raw
+ * is in the encoding of the request, fmContextData(), the schema checks and
+ * ctx->fields work the same on both. */
+#define FM_ENCODING_JSON    0
+#define FM_ENCODING_MSGPACK 1
+
+/* A formula answering in JSON can write it to ctx->out with the jsonw
+ * calls (common/jsonw.h) instead of filling ctx->ret: the text then goes
+ * to the client's reply memory as it is written. When anything was written
+ * to ctx->out it is the reply and ctx->ret is ignored, an incomplete
+ * document is answered with an error. */
+
+/* Request schema. A formula may describe the fields of "data" it uses:
+ *
+ *   fmField gsh_formula_<name>_schema[] = {
+ *       {"query",  FM_STRING, FM_REQUIRED},
+ *       {"limit",  FM_INT},
+ *       {"words",  FM_ARRAY, 0, FM_STRING},
+ *       {NULL}
+ *   };
+ *
+ * The schema is compiled when the formula is loaded and every request is
+ * checked against it before the formula is called: a missing required
+ * field or a field of another type is answered with an error. Types are
+ * masks (FM_STRING|FM_NULL accepts both), names are matched ignoring case
+ * like cJSON_GetObjectItem() does, fields not in the schema are allowed.
+ * The formula then finds field i of the schema in ctx->fields[i], NULL
+ * when it was not sent, and ctx->data is already parsed. */
+#define FM_NULL     (1<<0)
+#define FM_BOOL     (1<<1)
+#define FM_INT      (1<<2)  /* integer literal that fits 64 bits */
+#define FM_DOUBLE   (1<<3)  /* any other number */
+#define FM_NUMBER   (FM_INT|FM_DOUBLE)
+#define FM_STRING   (1<<4)
+#define FM_ARRAY    (1<<5)
+#define FM_OBJECT   (1<<6)
+#define FM_ANY      0x7f
+
+#define FM_REQUIRED 1
+
+#define FM_SCHEMA_MAX_FIELDS 64
+
+typedef struct fmField {
+    const char *name;
+    int type;               /* accepted types */
+    int flags;              /* FM_REQUIRED */
+    int elemtype;           /* accepted types of array elements, 0 = any */
+} fmField;
+
+/* Formula flags, see fmDescriptor. Formulas without a descriptor may export
+ *
+ *   int gsh_formula_<name>_flags = FM_DETERMINISTIC;
+ *
+ * FM_DETERMINISTIC: the reply only depends on "data", the same request
+ * always gets the same reply. Identical requests waiting at the same time
+ * share a call, and only such formulas can have their results cached (see
+ * the formula-cache directive).
+ * FM_RAW: the formula reads ctx->raw itself. The schema, if any, is still
+ * checked but no cJSON view is built: ctx->data and ctx->fields are NULL
+ * unless the formula calls fmContextData(). */
+#define FM_DETERMINISTIC    (1<<0)
+#define FM_RAW              (1<<2)
+
+/* ABI v3: a formula describes itself with a single exported descriptor
+ *
+ *   fmDescriptor gsh_formula_descriptor = {
+ *       .abi = FM_ABI_VERSION,
+ *       .flags = FM_DETERMINISTIC,
+ *       .init = init,
+ *       .run = run,
+ *       .destroy = destroy,
+ *       .schema = fields,
+ *   };
+ *
+ * Only abi and run are required. A library without a descriptor is loaded
+ * the old way, from its gsh_formula_<name>_init/_run/_exec/_schema/_flags
+ * symbols.
+ *
+ * v3 grew struct cJSON (common/cJSON.h) by the fields of the container
+ * index and the arena owning the node: formulas built for v2 are refused.
+ * Old style formulas are checked through the cJSON_layout every library
+ * including cJSON.h now carries: a different one is refused, and one built
+ * before it existed is loaded with a warning, it must be rebuilt if it
+ * allocates cJSON nodes itself.
+ *
+ * init is called once when the formula is loaded and destroy when the
+ * server shuts down. run returns 1 on success, the reply being in ctx->out
+ * or ctx->ret, 0 on failure.
+ *
+ * batch, when set, is called instead of run with the n requests read in the
+ * same event loop iteration; ok[i] is the result of ctx[i]. Identical
+ * requests share one ctx only for FM_DETERMINISTIC formulas, without it
+ * every request is an entry of its own and nothing is coalesced. The
+ * replies go to ctx[i]->out, ctx[i]->ret is NULL: a successful request with
+ * nothing written to its out gets an empty reply.
+ *
+ * async, when set, is called instead of run with a request the formula
+ * answers later: it returns 1 once it has taken it, 0 if it failed right
+ * away, and when done calls fmComplete() from any thread. ctx stays valid
+ * until then, ctx->data is parsed before the call (unless FM_RAW) and the
+ * reply goes to ctx->out, ctx->ret is NULL as for batch. fmContextData()
+ * must not be called from another thread. */
+#define FM_ABI_VERSION      3
+
+typedef struct fmDescriptor {
+    int abi;                /* FM_ABI_VERSION the formula was built for */
+    int flags;              /* FM_DETERMINISTIC | FM_RAW */
+    int (*init)(void);
+    int (*run)(fmContext *ctx);
+    void (*destroy)(void);
+    int (*batch)(fmContext **ctx, int *ok, int n);
+    int (*async)(fmContext *ctx);
+    fmField *schema;        /* optional request schema, see above */
+} fmDescriptor;
+
+/* Hand back the request of an async call, ok as run would return it. */
+void fmComplete(fmContext *ctx, int ok);
+
 #endif
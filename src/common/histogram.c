@@ -0,0 +1,74 @@
+/* Log-linear histograms. See histogram.h.
+ *
+ * Values under HIST_SUB have a bucket each. Above, a value whose highest
+ * set bit is b goes to the range of buckets of b, HIST_SUB of them, picked
+ * by the HIST_SUB_BITS bits under b: finding the bucket is a count of
+ * leading zeros and a shift, recording a value never loops. */
+
+#include <string.h>
+#include <math.h>
+#include "histogram.h"
+
+static int histIndex(uint64_t v) {
+    int msb, shift;
+
+    if (v < HIST_SUB) return (int)v;
+    if (v >> HIST_MAX_BITS) return HIST_BUCKETS-1;
+    msb = 63-__builtin_clzll(v);
+    shift = msb-HIST_SUB_BITS;
+    return (shift+1)*HIST_SUB+(int)((v >> shift)-HIST_SUB);
+}
+
+/* The highest value counted in bucket idx. */
+static uint64_t histBucketMax(int idx) {
+    int shift;
+
+    if (idx < HIST_SUB) return (uint64_t)idx;
+    shift = idx/HIST_SUB-1;
+    return (((uint64_t)(HIST_SUB+idx%HIST_SUB)+1) << shift)-1;
+}
+
+void histReset(histogram *h) {
+    memset(h,0,sizeof(*h));
+}
+
+void histRecord(histogram *h, uint64_t value) {
+    if (!h->count || value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+    h->count++;
+    h->sum += value;
+    h->buckets[histIndex(value)]++;
+}
+
+void histMerge(histogram *dst, const histogram *src) {
+    int j;
+
+    if (!src->count) return;
+    if (!dst->count || src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    for (j = 0; j < HIST_BUCKETS; j++) dst->buckets[j] += src->buckets[j];
+}
+
+/* The value under which p percent of the values are, as the highest value
+ * of its bucket but never over the largest value recorded. 0 when empty. */
+uint64_t histPercentile(const histogram *h, double p) {
+    uint64_t rank, seen = 0, v;
+    int j;
+
+    if (!h->count) return 0;
+    if (p >= 100) return h->max;
+    rank = (uint64_t)ceil(p/100*h->count);
+    if (rank < 1) rank = 1;
+    for (j = 0; j < HIST_BUCKETS; j++) {
+        seen += h->buckets[j];
+        if (seen >= rank) break;
+    }
+    v = histBucketMax(j);
+    return v > h->max ? h->max : v;
+}
+
+double histMean(const histogram *h) {
+    return h->count ? (double)h->sum/h->count : 0;
+}
@@ -0,0 +1,30 @@
+#ifndef __HISTOGRAM_H
+#define __HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Log-linear histogram in the style of HdrHistogram: every power of two
+ * range is split in HIST_SUB linear buckets, so any value is counted with
+ * a relative error under 1/HIST_SUB whatever its magnitude, in a fixed
+ * amount of memory. Values at or over 2^HIST_MAX_BITS go to the last
+ * bucket, with microseconds that is over 12 days. */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1<<HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS-HIST_SUB_BITS+1)*HIST_SUB)
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+void histReset(histogram *h);
+void histRecord(histogram *h, uint64_t value);
+void histMerge(histogram *dst, const histogram *src);
+uint64_t histPercentile(const histogram *h, double p);
+double histMean(const histogram *h);
+
+#endif
@@ -0,0 +1,345 @@
+/* Streaming JSON writer. See jsonw.h for the API.
+ *
+ * Every value is written once, at its final place: the writer only keeps
+ * one state byte per open container to know whether a comma, a colon or
+ * nothing goes before the next token. Strings are copied in runs between
+ * the bytes that need escaping and numbers are printed by numconv straight
+ * into the output. When a chunk is full the next one is started, a string
+ * may span two chunks. */
+
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include "jsonw.h"
+#include "numconv.h"
+#include "zmalloc.h"
+
+#define JW_ITEMS    1   /* something was written at this level */
+#define JW_OBJECT   2   /* the level is an object */
+#define JW_KEY      4   /* a key was written, its value is expected */
+
+/* What follows the backslash for the bytes a string must escape. */
+static const char jsonwEscape[256] = {
+    'u','u','u','u','u','u','u','u','b','t','n','u','f','r','u','u',
+    'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+    0,0,'"',0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,'\\',0,0,0,
+};
+
+jsonw *jsonwNew(void) {
+    int tag = zmalloc_set_tag(ZMALLOC_TAG_JSON);
+    jsonw *w = zcalloc(sizeof(*w));
+
+    w->chunks = listCreate();
+    zmalloc_set_tag(tag);
+    return w;
+}
+
+static void jsonwDropChunks(jsonw *w) {
+    listNode *ln;
+
+    while ((ln = listFirst(w->chunks)) != NULL) {
+        sdsfree(listNodeValue(ln));
+        listDelNode(w->chunks,ln);
+    }
+}
+
+/* Free a writer created with jsonwNew(). */
+void jsonwFree(jsonw *w) {
+    jsonwDropChunks(w);
+    listRelease(w->chunks);
+    if (w->chunk) sdsfree(w->chunk);
+    zfree(w);
+}
+
+/* Write to the len bytes at buf, nothing is ever allocated. */
+void jsonwInitBuffer(jsonw *w, char *buf, size_t len) {
+    memset(w,0,sizeof(*w));
+    w->buf = w->pos = buf;
+    w->end = buf+len;
+}
+
+/* Start a new document, the output of the previous one is dropped. */
+void jsonwReset(jsonw *w) {
+    if (w->chunks) jsonwDropChunks(w);
+    w->pos = w->buf;
+    w->flushed = 0;
+    w->depth = 0;
+    w->err = 0;
+    w->state[0] = 0;
+}
+
+/* Bytes written since the last reset. */
+size_t jsonwLength(jsonw *w) {
+    return w->flushed + (w->pos-w->buf);
+}
+
+/* Return 1 if a complete document was written without errors. */
+int jsonwDone(jsonw *w) {
+    return !w->err && w->depth == 0 && (w->state[0] & JW_ITEMS);
+}
+
+/* Pop the output, oldest chunk first, the caller owns the returned sds.
+ * Returns NULL once everything was handed over. */
+sds jsonwNextChunk(jsonw *w) {
+    listNode *ln;
+    sds s;
+
+    if (!w->chunks) return NULL;
+    if ((ln = listFirst(w->chunks)) != NULL) {
+        s = listNodeValue(ln);
+        listDelNode(w->chunks,ln);
+        return s;
+    }
+    if (!w->chunk || w->pos == w->buf) return NULL;
+    s = w->chunk;
+    sdsIncrLen(s,(int)(w->pos-w->buf));
+    w->flushed += sdslen(s);
+    w->chunk = NULL;
+    w->buf = w->pos = w->end = NULL;
+    return s;
+}
+
+static void jsonwFail(jsonw *w) {
+    w->err = 1;
+}
+
+/* Make sure the current buffer has room for need bytes, return 0 when it
+ * can not be done. */
+static int jsonwGrow(jsonw *w, size_t need) {
+    int tag;
+
+    if (w->err) return 0;
+    if (!w->chunks) {
+        jsonwFail(w);
+        return 0;
+    }
+    tag = zmalloc_set_tag(ZMALLOC_TAG_JSON);
+    if (w->chunk) {
+        if (w->pos == w->buf) {
+            sdsfree(w->chunk);
+        } else {
+            sdsIncrLen(w->chunk,(int)(w->pos-w->buf));
+            w->flushed += sdslen(w->chunk);
+            listAddNodeTail(w->chunks,w->chunk);
+        }
+    }
+    w->chunk = sdsMakeRoomFor(sdsempty(),need > JSONW_CHUNK ? need : JSONW_CHUNK);
+    w->buf = w->pos = w->chunk;
+    w->end = w->chunk+sdsavail(w->chunk);
+    zmalloc_set_tag(tag);
+    return 1;
+}
+
+#define jsonwReserve(w,n) ((size_t)((w)->end-(w)->pos) >= (n) || jsonwGrow(w,n))
+
+static void jsonwPutRaw(jsonw *w, const char *s, size_t len) {
+    size_t n;
+
+    while (len) {
+        if (w->pos == w->end && !jsonwGrow(w,1)) return;
+        n = w->end-w->pos;
+        if (n > len) n = len;
+        memcpy(w->pos,s,n);
+        w->pos += n;
+        s += n;
+        len -= n;
+    }
+}
+
+static void jsonwPutString(jsonw *w, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char*)s, *end = p+len, *run;
+
+    if (!jsonwReserve(w,1)) return;
+    *w->pos++ = '"';
+    while (p < end) {
+        for (run = p; p < end && !jsonwEscape[*p]; p++);
+        jsonwPutRaw(w,(const char*)run,p-run);
+        if (p == end) break;
+        if (!jsonwReserve(w,6)) return;
+        *w->pos++ = '\\';
+        *w->pos++ = jsonwEscape[*p];
+        if (jsonwEscape[*p] == 'u') {
+            *w->pos++ = '0';
+            *w->pos++ = '0';
+            *w->pos++ = hex[*p >> 4];
+            *w->pos++ = hex[*p & 15];
+        }
+        p++;
+    }
+    if (!jsonwReserve(w,1)) return;
+    *w->pos++ = '"';
+}
+
+/* Emit what goes before a value at the current level, return 0 if a value
+ * is not allowed there. */
+static int jsonwBeforeValue(jsonw *w) {
+    unsigned char *st = &w->state[w->depth];
+
+    if (w->err) return 0;
+    if (*st & JW_OBJECT) {
+        if (!(*st & JW_KEY)) {
+            jsonwFail(w);
+            return 0;
+        }
+        *st &= ~JW_KEY;
+        return 1;
+    }
+    if (*st & JW_ITEMS) {
+        /* A single value at the top level. */
+        if (w->depth == 0) {
+            jsonwFail(w);
+            return 0;
+        }
+        if (!jsonwReserve(w,1)) return 0;
+        *w->pos++ = ',';
+    }
+    *st |= JW_ITEMS;
+    return 1;
+}
+
+static void jsonwBegin(jsonw *w, int object) {
+    if (!jsonwBeforeValue(w)) return;
+    if (w->depth == JSONW_MAX_DEPTH) {
+        jsonwFail(w);
+        return;
+    }
+    if (!jsonwReserve(w,1)) return;
+    *w->pos++ = object ? '{' : '[';
+    w->state[++w->depth] = object ? JW_OBJECT : 0;
+}
+
+static void jsonwEnd(jsonw *w, int object) {
+    unsigned char st = w->state[w->depth];
+
+    if (w->err) return;
+    if (w->depth == 0 || (st & JW_KEY) || !(st & JW_OBJECT) != !object) {
+        jsonwFail(w);
+        return;
+    }
+    if (!jsonwReserve(w,1)) return;
+    *w->pos++ = object ? '}' : ']';
+    w->depth--;
+}
+
+void jsonwBeginObject(jsonw *w) {
+    jsonwBegin(w,1);
+}
+
+void jsonwEndObject(jsonw *w) {
+    jsonwEnd(w,1);
+}
+
+void jsonwBeginArray(jsonw *w) {
+    jsonwBegin(w,0);
+}
+
+void jsonwEndArray(jsonw *w) {
+    jsonwEnd(w,0);
+}
+
+void jsonwKeyLen(jsonw *w, const char *key, size_t len) {
+    unsigned char *st = &w->state[w->depth];
+
+    if (w->err) return;
+    if (!(*st & JW_OBJECT) || (*st & JW_KEY)) {
+        jsonwFail(w);
+        return;
+    }
+    if (*st & JW_ITEMS) {
+        if (!jsonwReserve(w,1)) return;
+        *w->pos++ = ',';
+    }
+    jsonwPutString(w,key,len);
+    if (!jsonwReserve(w,1)) return;
+    *w->pos++ = ':';
+    *st |= JW_ITEMS|JW_KEY;
+}
+
+void jsonwKey(jsonw *w, const char *key) {
+    jsonwKeyLen(w,key,strlen(key));
+}
+
+void jsonwStringLen(jsonw *w, const char *s, size_t len) {
+    if (!jsonwBeforeValue(w)) return;
+    jsonwPutString(w,s,len);
+}
+
+void jsonwString(jsonw *w, const char *s) {
+    jsonwStringLen(w,s,strlen(s));
+}
+
+void jsonwInt(jsonw *w, long long value) {
+    if (!jsonwBeforeValue(w) || !jsonwReserve(w,NUM_BUFLEN)) return;
+    w->pos += numPrintInt64(w->pos,value);
+}
+
+/* Non finite values are written as null, JSON has no inf or nan. */
+void jsonwDouble(jsonw *w, double value) {
+    if (!jsonwBeforeValue(w) || !jsonwReserve(w,NUM_BUFLEN)) return;
+    if (isfinite(value))
+        w->pos += numPrintDouble(w->pos,value);
+    else
+        jsonwPutRaw(w,"null",4);
+}
+
+void jsonwBool(jsonw *w, int value) {
+    if (!jsonwBeforeValue(w)) return;
+    if (value)
+        jsonwPutRaw(w,"true",4);
+    else
+        jsonwPutRaw(w,"false",5);
+}
+
+void jsonwNull(jsonw *w) {
+    if (!jsonwBeforeValue(w)) return;
+    jsonwPutRaw(w,"null",4);
+}
+
+/* Append an already serialized value, e.g. a span of the request. The
+ * bytes are not checked. */
+void jsonwRaw(jsonw *w, const char *json, size_t len) {
+    if (!jsonwBeforeValue(w)) return;
+    jsonwPutRaw(w,json,len);
+}
+
+/* Write a cJSON tree, the same text cJSON_PrintUnformatted() would make
+ * but without building it in temporary strings first. */
+void jsonwCJSON(jsonw *w, cJSON *item) {
+    cJSON *c;
+    double d;
+
+    switch (item->type & 255) {
+    case cJSON_False: jsonwBool(w,0); break;
+    case cJSON_True: jsonwBool(w,1); break;
+    case cJSON_NULL: jsonwNull(w); break;
+    case cJSON_Number:
+        d = item->valuedouble;
+        if (fabs((double)item->valueint-d) <= DBL_EPSILON && d <= INT_MAX && d >= INT_MIN)
+            jsonwInt(w,item->valueint);
+        else
+            jsonwDouble(w,d);
+        break;
+    case cJSON_String:
+        jsonwString(w,item->valuestring ? item->valuestring : "");
+        break;
+    case cJSON_Array:
+        jsonwBeginArray(w);
+        for (c = item->child; c && !w->err; c = c->next) jsonwCJSON(w,c);
+        jsonwEndArray(w);
+        break;
+    case cJSON_Object:
+        jsonwBeginObject(w);
+        for (c = item->child; c && !w->err; c = c->next) {
+            jsonwKey(w,c->string ? c->string : "");
+            jsonwCJSON(w,c);
+        }
+        jsonwEndObject(w);
+        break;
+    default:
+        jsonwFail(w);
+        break;
+    }
+}
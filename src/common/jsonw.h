@@ -0,0 +1,64 @@
+#ifndef __JSONW_H
+#define __JSONW_H
+
+#include <stddef.h>
+#include "sds.h"
+#include "adlist.h"
+#include "cJSON.h"
+
+#define JSONW_MAX_DEPTH     256
+#define JSONW_CHUNK         (1024*16)   /* minimum size of a new chunk */
+
+/* Streaming JSON writer. Values are appended in document order, commas and
+ * colons are added by the writer, so the output needs no second pass:
+ *
+ *   jsonwBeginObject(w);
+ *   jsonwKey(w,"words");
+ *   jsonwBeginArray(w);
+ *   for (...) jsonwString(w,word);
+ *   jsonwEndArray(w);
+ *   jsonwEndObject(w);
+ *
+ * The output goes either to a fixed buffer (jsonwInitBuffer(), nothing is
+ * ever allocated and running out of space is an error) or to a list of sds
+ * chunks (jsonwNew()) that can be handed over one by one with
+ * jsonwNextChunk(), e.g. to become reply list nodes without being copied.
+ *
+ * Errors (full buffer, a value where a key is expected, unbalanced ends...)
+ * are sticky: the calls return nothing, jsonwDone() tells at the end if a
+ * complete document was written. */
+typedef struct jsonw {
+    char *buf;                  /* start of the current buffer */
+    char *pos, *end;            /* free space in it */
+    sds chunk;                  /* buf as an sds, NULL for a fixed buffer */
+    list *chunks;               /* full chunks, oldest first */
+    size_t flushed;             /* bytes in chunks */
+    int depth;
+    int err;
+    unsigned char state[JSONW_MAX_DEPTH+1];
+} jsonw;
+
+jsonw *jsonwNew(void);
+void jsonwFree(jsonw *w);
+void jsonwInitBuffer(jsonw *w, char *buf, size_t len);
+void jsonwReset(jsonw *w);
+size_t jsonwLength(jsonw *w);
+int jsonwDone(jsonw *w);
+sds jsonwNextChunk(jsonw *w);
+
+void jsonwBeginObject(jsonw *w);
+void jsonwEndObject(jsonw *w);
+void jsonwBeginArray(jsonw *w);
+void jsonwEndArray(jsonw *w);
+void jsonwKey(jsonw *w, const char *key);
+void jsonwKeyLen(jsonw *w, const char *key, size_t len);
+void jsonwString(jsonw *w, const char *s);
+void jsonwStringLen(jsonw *w, const char *s, size_t len);
+void jsonwInt(jsonw *w, long long value);
+void jsonwDouble(jsonw *w, double value);
+void jsonwBool(jsonw *w, int value);
+void jsonwNull(jsonw *w);
+void jsonwRaw(jsonw *w, const char *json, size_t len);
+void jsonwCJSON(jsonw *w, cJSON *item);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef __MSGPACK_H
+#define __MSGPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sds.h"
+#include "cJSON.h"
+
+/* MessagePack types as reported by mpReadHead(). */
+#define MP_NIL      1
+#define MP_BOOL     2
+#define MP_INT      3   /* h->i */
+#define MP_UINT     4   /* h->u, larger than INT64_MAX */
+#define MP_DOUBLE   5   /* h->d, float 32 and 64 */
+#define MP_STR      6   /* h->str, h->len bytes */
+#define MP_BIN      7   /* h->str, h->len bytes */
+#define MP_ARRAY    8   /* h->len elements follow */
+#define MP_MAP      9   /* h->len key/value pairs follow */
+#define MP_EXT      10  /* h->str, h->len bytes */
+
+/* True if c starts a map, e.g. the first byte of a msgpack envelope. JSON
+ * text never starts with one of these bytes. */
+#define mpIsMap(c) (((unsigned char)(c) & 0xf0) == 0x80 || \
+                    (unsigned char)(c) == 0xde || (unsigned char)(c) == 0xdf)
+
+typedef struct mpHead {
+    int type;
+    int b;                      /* MP_BOOL */
+    int64_t i;
+    uint64_t u;
+    double d;
+    const char *str;
+    uint32_t len;
+} mpHead;
+
+size_t mpReadHead(const char *buf, size_t len, mpHead *h);
+size_t mpSkip(const char *buf, size_t len);
+
+/* Encoding, the value is appended to s. */
+sds mpAppendNil(sds s);
+sds mpAppendBool(sds s, int b);
+sds mpAppendInt(sds s, long long v);
+sds mpAppendDouble(sds s, double d);
+sds mpAppendStr(sds s, const char *str, size_t len);
+sds mpAppendArrayHead(sds s, uint32_t n);
+sds mpAppendMapHead(sds s, uint32_t n);
+sds mpAppendCJSON(sds s, cJSON *item);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __NUMCONV_H
+#define __NUMCONV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Enough for any numPrintDouble() / numPrintInt64() output and the nul. */
+#define NUM_BUFLEN 32
+
+/* A decimal number as scanned from text: mantissa * 10^exp10. At most 19
+ * significant digits are kept, when non zero digits had to be dropped the
+ * mantissa is rounded down and truncated is set. */
+typedef struct numDecimal {
+    uint64_t mantissa;
+    int exp10;
+    int neg;
+    int truncated;
+    int integer;                /* no fraction and no exponent part */
+} numDecimal;
+
+size_t numScanDecimal(const char *s, size_t len, numDecimal *dec);
+int numMakeDouble(uint64_t mantissa, int exp10, int neg, double *value);
+int numDecimalToDouble(const numDecimal *dec, double *value);
+double numStrtod(const char *s, size_t len);
+size_t numParseDouble(const char *s, size_t len, double *value);
+int numPrintDouble(char *buf, double value);
+int numPrintInt64(char *buf, long long value);
+
+#endif
@@ -0,0 +1,949 @@
+/* sjson, a two stage JSON parser in the spirit of simdjson.
+ *
+ * Stage 1 classifies the input 64 bytes at a time with vector compares
+ * (AVX2 when the CPU has it, SSE2 otherwise, plain C on other targets) and
+ * turns the resulting bitmaps into the list of offsets of every structural
+ * character and scalar start outside strings. The string state is tracked
+ * without branches: escaped quotes are found with the odd-backslash-sequence
+ * trick and the inside-of-strings mask is the prefix xor of the quote mask.
+ *
+ * Stage 2 only visits those offsets, checks the grammar and writes the tape
+ * described in sjson.h. Strings are unescaped 16 bytes at a time into a
+ * single buffer and numbers are converted by numconv without strtod(), so a
+ * parse does no allocation at all once the parser buffers are large enough. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <ctype.h>
+#include "sjson.h"
+#include "numconv.h"
+#include "msgpack.h"
+#include "zmalloc.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define SJSON_X86
+#include <immintrin.h>
+#endif
+
+#define TAPE_TYPE(w)    ((int)((w) >> 56))
+#define TAPE_VALUE(w)   ((w) & 0x00ffffffffffffffULL)
+#define TAPE_WORD(t,v)  (((uint64_t)(t) << 56) | (uint64_t)(v))
+#define SJSON_MAX_COUNT 0xffffff
+
+/* ----------------------------- Stage 1 ------------------------------------ */
+
+typedef struct sjsonBlock {
+    uint64_t quote;         /* " */
+    uint64_t backslash;     /* \ */
+    uint64_t op;            /* { } [ ] : , */
+    uint64_t ws;            /* anything <= 32, like cJSON skip() */
+} sjsonBlock;
+
+#if !defined(SJSON_X86) || defined(SJSON_BENCHMARK_MAIN)
+static void classifyScalar(const unsigned char *b, sjsonBlock *m) {
+    int j;
+
+    memset(m,0,sizeof(*m));
+    for (j = 0; j < 64; j++) {
+        uint64_t bit = 1ULL << j;
+
+        switch (b[j]) {
+        case '"': m->quote |= bit; break;
+        case '\\': m->backslash |= bit; break;
+        case '{': case '}': case '[': case ']': case ':': case ',':
+            m->op |= bit; break;
+        default:
+            if (b[j] <= 32) m->ws |= bit;
+            break;
+        }
+    }
+}
+#endif
+
+#ifdef SJSON_X86
+/* '[' and '{' as well as ']' and '}' only differ in bit 5, so or-ing 0x20
+ * matches both brackets of a kind with a single compare. */
+static void classifySSE2(const unsigned char *b, sjsonBlock *m) {
+    const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\');
+    const __m128i open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+    const __m128i colon = _mm_set1_epi8(':'), comma = _mm_set1_epi8(',');
+    const __m128i bit5 = _mm_set1_epi8(0x20), space = _mm_set1_epi8(' ');
+    int j;
+
+    memset(m,0,sizeof(*m));
+    for (j = 0; j < 4; j++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(b+j*16));
+        __m128i lower = _mm_or_si128(v,bit5);
+        __m128i op = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(lower,open),_mm_cmpeq_epi8(lower,close)),
+            _mm_or_si128(_mm_cmpeq_epi8(v,colon),_mm_cmpeq_epi8(v,comma)));
+        __m128i ws = _mm_cmpeq_epi8(_mm_min_epu8(v,space),v);
+
+        m->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v,quote)) << (j*16);
+        m->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v,bslash)) << (j*16);
+        m->op |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << (j*16);
+        m->ws |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << (j*16);
+    }
+}
+
+__attribute__((target("avx2")))
+static void classifyAVX2(const unsigned char *b, sjsonBlock *m) {
+    const __m256i quote = _mm256_set1_epi8('"'), bslash = _mm256_set1_epi8('\\');
+    const __m256i open = _mm256_set1_epi8('{'), close = _mm256_set1_epi8('}');
+    const __m256i colon = _mm256_set1_epi8(':'), comma = _mm256_set1_epi8(',');
+    const __m256i bit5 = _mm256_set1_epi8(0x20), space = _mm256_set1_epi8(' ');
+    int j;
+
+    memset(m,0,sizeof(*m));
+    for (j = 0; j < 2; j++) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(b+j*32));
+        __m256i lower = _mm256_or_si256(v,bit5);
+        __m256i op = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(lower,open),_mm256_cmpeq_epi8(lower,close)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v,colon),_mm256_cmpeq_epi8(v,comma)));
+        __m256i ws = _mm256_cmpeq_epi8(_mm256_min_epu8(v,space),v);
+
+        m->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,quote)) << (j*32);
+        m->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,bslash)) << (j*32);
+        m->op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << (j*32);
+        m->ws |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ws) << (j*32);
+    }
+}
+#endif
+
+static void (*classify)(const unsigned char *b, sjsonBlock *m);
+
+static void sjsonSelectClassifier(void) {
+#ifdef SJSON_X86
+    __builtin_cpu_init();
+    classify = __builtin_cpu_supports("avx2") ? classifyAVX2 : classifySSE2;
+#else
+    classify = classifyScalar;
+#endif
+}
+
+/* Return the mask of the characters escaped by a backslash. A character is
+ * escaped when it follows an odd length run of backslashes, runs are allowed
+ * to span blocks through *prev. */
+static uint64_t findEscaped(uint64_t backslash, uint64_t *prev) {
+    const uint64_t even = 0x5555555555555555ULL;
+    uint64_t follows, odd_starts, even_seq;
+
+    backslash &= ~*prev;
+    follows = (backslash << 1) | *prev;
+    odd_starts = backslash & ~even & ~follows;
+    *prev = __builtin_add_overflow(odd_starts,backslash,&even_seq);
+    return (even ^ (even_seq << 1)) & follows;
+}
+
+/* Bit i of the result is the parity of bits 0..i of x. */
+static uint64_t prefixXor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static int sjsonFail(sjsonParser *p, const char *err, size_t pos) {
+    p->err = err;
+    p->errpos = pos;
+    return SJSON_ERR;
+}
+
+static void *sjsonReserve(void *ptr, size_t *cap, size_t need, size_t size) {
+    size_t newcap;
+    int tag;
+
+    if (*cap >= need) return ptr;
+    newcap = (*cap*2 > need) ? *cap*2 : need;
+    *cap = newcap;
+    tag = zmalloc_set_tag(ZMALLOC_TAG_JSON);
+    ptr = zrealloc(ptr,newcap*size);
+    zmalloc_set_tag(tag);
+    return ptr;
+}
+
+static int stage1(sjsonParser *p, const char *buf, size_t len) {
+    uint64_t prev_escaped = 0, prev_in_string = 0, prev_scalar = 0;
+    unsigned char tail[64];
+    uint32_t *idx;
+    size_t i, n = 0;
+    sjsonBlock b;
+
+    p->index = sjsonReserve(p->index,&p->indexcap,len+1,sizeof(uint32_t));
+    idx = p->index;
+    for (i = 0; i < len; i += 64) {
+        const unsigned char *src = (const unsigned char*)buf+i;
+        uint64_t escaped, in_string, scalar, nonquote, structurals;
+
+        if (len-i < 64) {
+            memset(tail,' ',sizeof(tail));
+            memcpy(tail,src,len-i);
+            src = tail;
+        }
+        classify(src,&b);
+
+        escaped = findEscaped(b.backslash,&prev_escaped);
+        b.quote &= ~escaped;
+        /* Set from the opening quote up to the byte before the closing one. */
+        in_string = prefixXor(b.quote) ^ prev_in_string;
+        prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+        /* A scalar starts at every non blank, non operator byte that does
+         * not follow another such byte. Opening quotes are scalar starts,
+         * everything else inside a string and the closing quote is not. */
+        scalar = ~(b.op | b.ws);
+        nonquote = scalar & ~b.quote;
+        structurals = (b.op | (scalar & ~((nonquote << 1) | prev_scalar))) &
+                      ~(in_string ^ b.quote);
+        prev_scalar = nonquote >> 63;
+
+        while (structurals) {
+            idx[n++] = (uint32_t)(i + __builtin_ctzll(structurals));
+            structurals &= structurals-1;
+        }
+    }
+    p->nindex = n;
+    if (prev_in_string) return sjsonFail(p,"unterminated string",len);
+    return SJSON_OK;
+}
+
+/* ----------------------------- Stage 2 ------------------------------------ */
+
+static int isTerminator(const char *s, const char *end) {
+    return s == end || (unsigned char)*s <= 32 || *s == ',' || *s == ']' || *s == '}';
+}
+
+/* Convert the number at s. Integers that fit are stored as int64, the rest
+ * as double, correctly rounded by numconv (strtod() only in the rare cases
+ * it can not decide quickly). */
+static const char *parseNumber(const char *s, const char *end, int *type, uint64_t *word) {
+    numDecimal dec;
+    size_t n = numScanDecimal(s,end-s,&dec);
+    double d;
+
+    if (!n || !isTerminator(s+n,end)) return NULL;
+
+    if (dec.integer && !dec.truncated && dec.exp10 == 0 &&
+        dec.mantissa <= (uint64_t)LLONG_MAX + dec.neg)
+    {
+        int64_t v = dec.neg ? (int64_t)(0-dec.mantissa) : (int64_t)dec.mantissa;
+
+        *type = SJSON_INT64;
+        memcpy(word,&v,sizeof(v));
+        return s+n;
+    }
+    if (!numDecimalToDouble(&dec,&d)) d = numStrtod(s,n);
+    *type = SJSON_DOUBLE;
+    memcpy(word,&d,sizeof(d));
+    return s+n;
+}
+
+static int hexValue(const char *s) {
+    int j, v = 0;
+
+    for (j = 0; j < 4; j++) {
+        char c = s[j];
+
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c-'0';
+        else if (c >= 'a' && c <= 'f') v |= c-'a'+10;
+        else if (c >= 'A' && c <= 'F') v |= c-'A'+10;
+        else return -1;
+    }
+    return v;
+}
+
+/* Unescape the string whose opening quote is at s into the strings buffer.
+ * limit is the next structural offset, the closing quote is before it. */
+static const char *parseString(sjsonParser *p, const char *s, const char *limit, uint64_t *word) {
+    const char *src = s+1;
+    char *start, *dst;
+    uint32_t len;
+
+    p->strings = sjsonReserve(p->strings,&p->stringscap,
+                              p->nstrings+sizeof(uint32_t)+(limit-s)+1,1);
+    start = p->strings+p->nstrings;
+    dst = start+sizeof(uint32_t);
+
+    while (1) {
+#ifdef SJSON_X86
+        const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\');
+
+        /* dst never runs ahead of src, so the 16 byte store stays inside
+         * the room reserved above. */
+        while (limit-src >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)src);
+            int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v,quote),
+                                                      _mm_cmpeq_epi8(v,bslash)));
+
+            _mm_storeu_si128((__m128i*)dst,v);
+            if (mask) {
+                int k = __builtin_ctz(mask);
+
+                src += k;
+                dst += k;
+                break;
+            }
+            src += 16;
+            dst += 16;
+        }
+#endif
+        while (src < limit && *src != '"' && *src != '\\') *dst++ = *src++;
+        if (src >= limit) return NULL;
+        if (*src == '"') break;
+
+        if (++src >= limit) return NULL;
+        switch (*src++) {
+        case '"': *dst++ = '"'; break;
+        case '\\': *dst++ = '\\'; break;
+        case '/': *dst++ = '/'; break;
+        case 'b': *dst++ = '\b'; break;
+        case 'f': *dst++ = '\f'; break;
+        case 'n': *dst++ = '\n'; break;
+        case 'r': *dst++ = '\r'; break;
+        case 't': *dst++ = '\t'; break;
+        case 'u': {
+            int hi, lo;
+            unsigned uc;
+
+            if (limit-src < 4 || (hi = hexValue(src)) < 0) return NULL;
+            src += 4;
+            uc = hi;
+            if (hi >= 0xDC00 && hi <= 0xDFFF) return NULL;
+            if (hi >= 0xD800 && hi <= 0xDBFF) {
+                if (limit-src < 6 || src[0] != '\\' || src[1] != 'u' ||
+                    (lo = hexValue(src+2)) < 0xDC00 || lo > 0xDFFF) return NULL;
+                src += 6;
+                uc = 0x10000 + ((hi-0xD800) << 10) + (lo-0xDC00);
+            }
+            if (uc < 0x80) {
+                *dst++ = uc;
+            } else if (uc < 0x800) {
+                *dst++ = 0xC0 | (uc >> 6);
+                *dst++ = 0x80 | (uc & 0x3F);
+            } else if (uc < 0x10000) {
+                *dst++ = 0xE0 | (uc >> 12);
+                *dst++ = 0x80 | ((uc >> 6) & 0x3F);
+                *dst++ = 0x80 | (uc & 0x3F);
+            } else {
+                *dst++ = 0xF0 | (uc >> 18);
+                *dst++ = 0x80 | ((uc >> 12) & 0x3F);
+                *dst++ = 0x80 | ((uc >> 6) & 0x3F);
+                *dst++ = 0x80 | (uc & 0x3F);
+            }
+            break;
+        }
+        default:
+            return NULL;
+        }
+    }
+
+    len = dst-start-sizeof(uint32_t);
+    memcpy(start,&len,sizeof(len));
+    *dst = '\0';
+    *word = TAPE_WORD(SJSON_STRING,p->nstrings);
+    p->nstrings += sizeof(uint32_t)+len+1;
+    return src+1;
+}
+
+static int parseLiteral(const char *s, const char *end, const char *lit, size_t len) {
+    return (size_t)(end-s) >= len && !memcmp(s,lit,len) && isTerminator(s+len,end);
+}
+
+static int stage2(sjsonParser *p, const char *buf, size_t len) {
+    const char *end = buf+len, *s, *limit;
+    uint32_t *idx = p->index, *stack = p->stack;
+    uint64_t *tape;
+    size_t n = p->nindex, i = 0, t = 1;
+    int depth = 0, type;
+    char c;
+
+    /* Every structural makes at most two tape words, plus the root ones. */
+    p->tape = sjsonReserve(p->tape,&p->tapecap,n*2+2,sizeof(uint64_t));
+    tape = p->tape;
+    p->nstrings = 0;
+    if (n == 0) return sjsonFail(p,"empty document",0);
+
+value:
+    if (i >= n) goto premature;
+    s = buf+idx[i];
+    switch (*s) {
+    case '{':
+    case '[':
+        if (depth == SJSON_MAX_DEPTH) return sjsonFail(p,"too deep",s-buf);
+        stack[depth*2] = t;
+        stack[depth*2+1] = 0;
+        depth++;
+        tape[t++] = TAPE_WORD(*s,0);
+        if (++i < n && buf[idx[i]] == (*s == '{' ? '}' : ']')) {
+            i++;
+            goto close;
+        }
+        if (*s == '{') goto key;
+        goto value;
+    case '"':
+        limit = (i+1 < n) ? buf+idx[i+1] : end;
+        if (!parseString(p,s,limit,&tape[t++]))
+            return sjsonFail(p,"bad string",s-buf);
+        break;
+    case 't':
+        if (!parseLiteral(s,end,"true",4)) return sjsonFail(p,"bad literal",s-buf);
+        tape[t++] = TAPE_WORD(SJSON_TRUE,0);
+        break;
+    case 'f':
+        if (!parseLiteral(s,end,"false",5)) return sjsonFail(p,"bad literal",s-buf);
+        tape[t++] = TAPE_WORD(SJSON_FALSE,0);
+        break;
+    case 'n':
+        if (!parseLiteral(s,end,"null",4)) return sjsonFail(p,"bad literal",s-buf);
+        tape[t++] = TAPE_WORD(SJSON_NULL,0);
+        break;
+    default:
+        if (*s != '-' && !isdigit((unsigned char)*s))
+            return sjsonFail(p,"unexpected character",s-buf);
+        if (!parseNumber(s,end,&type,&tape[t+1]))
+            return sjsonFail(p,"bad number",s-buf);
+        tape[t] = TAPE_WORD(type,0);
+        t += 2;
+        break;
+    }
+    i++;
+
+next:
+    if (depth == 0) goto done;
+    stack[depth*2-1]++;
+    if (i >= n) goto premature;
+    c = buf[idx[i]];
+    if (TAPE_TYPE(tape[stack[depth*2-2]]) == SJSON_OBJECT) {
+        if (c == ',') { i++; goto key; }
+        if (c == '}') { i++; goto close; }
+    } else {
+        if (c == ',') { i++; goto value; }
+        if (c == ']') { i++; goto close; }
+    }
+    return sjsonFail(p,"expected ',' or end of container",idx[i]);
+
+key:
+    if (i >= n) goto premature;
+    s = buf+idx[i];
+    if (*s != '"') return sjsonFail(p,"expected key",s-buf);
+    limit = (i+1 < n) ? buf+idx[i+1] : end;
+    if (!parseString(p,s,limit,&tape[t++])) return sjsonFail(p,"bad string",s-buf);
+    if (++i >= n || buf[idx[i]] != ':') goto premature_colon;
+    i++;
+    goto value;
+
+close: {
+        uint64_t open, count;
+
+        depth--;
+        open = stack[depth*2];
+        count = stack[depth*2+1];
+        if (count > SJSON_MAX_COUNT) count = SJSON_MAX_COUNT;
+        type = TAPE_TYPE(tape[open]);
+        tape[open] = TAPE_WORD(type,(count << 32) | t);
+        tape[t++] = TAPE_WORD(type == SJSON_OBJECT ? SJSON_OBJECT_END : SJSON_ARRAY_END,open);
+        goto next;
+    }
+
+done:
+    if (i != n) return sjsonFail(p,"trailing characters",idx[i]);
+    tape[0] = TAPE_WORD(SJSON_ROOT,t);
+    tape[t++] = TAPE_WORD(SJSON_ROOT,0);
+    p->ntape = t;
+    return SJSON_OK;
+
+premature_colon:
+    if (i < n) return sjsonFail(p,"expected ':'",idx[i]);
+premature:
+    return sjsonFail(p,"unexpected end of document",len);
+}
+
+/* ----------------------------- MessagePack -------------------------------- */
+
+static uint64_t msgpackString(sjsonParser *p, const char *str, uint32_t len) {
+    uint64_t word;
+    char *dst;
+
+    p->strings = sjsonReserve(p->strings,&p->stringscap,
+                              p->nstrings+sizeof(uint32_t)+len+1,1);
+    dst = p->strings+p->nstrings;
+    memcpy(dst,&len,sizeof(len));
+    memcpy(dst+sizeof(len),str,len);
+    dst[sizeof(len)+len] = '\0';
+    word = TAPE_WORD(SJSON_STRING,p->nstrings);
+    p->nstrings += sizeof(uint32_t)+len+1;
+    return word;
+}
+
+/* Decode a MessagePack document into the tape, so everything built on top
+ * of sjsonParse() works the same on it. Map keys must be strings, binaries
+ * are taken as strings, extensions are rejected. Containers are tracked on
+ * the stack as the tape index of their start and the values still to come
+ * (keys included), so they are closed as soon as their last value is in. */
+int sjsonParseMsgpack(sjsonParser *p, const char *buf, size_t len) {
+    uint32_t *stack = p->stack;
+    uint64_t *tape, open, values;
+    size_t pos = 0, t = 1, n;
+    int depth = 0, type;
+    mpHead h;
+    double d;
+
+    p->err = NULL;
+    p->errpos = 0;
+    p->ntape = 0;
+    p->nstrings = 0;
+    if (len >= UINT32_MAX) return sjsonFail(p,"document too large",0);
+    if (len == 0) return sjsonFail(p,"empty document",0);
+
+    /* Every value takes a byte at least and two tape words at most. */
+    p->tape = sjsonReserve(p->tape,&p->tapecap,len*2+2,sizeof(uint64_t));
+    tape = p->tape;
+
+    while (1) {
+        if (!(n = mpReadHead(buf+pos,len-pos,&h)))
+            return sjsonFail(p,"bad or truncated value",pos);
+        if (depth) {
+            /* In a map the values alternate key, value: keys come when an
+             * even number of values is left. */
+            if (TAPE_TYPE(tape[stack[depth*2-2]]) == SJSON_OBJECT &&
+                !(stack[depth*2-1] & 1) && h.type != MP_STR && h.type != MP_BIN)
+                return sjsonFail(p,"map key is not a string",pos);
+            stack[depth*2-1]--;
+        }
+        pos += n;
+
+        switch (h.type) {
+        case MP_NIL:
+            tape[t++] = TAPE_WORD(SJSON_NULL,0);
+            break;
+        case MP_BOOL:
+            tape[t++] = TAPE_WORD(h.b ? SJSON_TRUE : SJSON_FALSE,0);
+            break;
+        case MP_INT:
+            tape[t++] = TAPE_WORD(SJSON_INT64,0);
+            memcpy(&tape[t++],&h.i,sizeof(h.i));
+            break;
+        case MP_UINT:
+        case MP_DOUBLE:
+            d = (h.type == MP_UINT) ? (double)h.u : h.d;
+            tape[t++] = TAPE_WORD(SJSON_DOUBLE,0);
+            memcpy(&tape[t++],&d,sizeof(d));
+            break;
+        case MP_STR:
+        case MP_BIN:
+            tape[t++] = msgpackString(p,h.str,h.len);
+            break;
+        case MP_ARRAY:
+        case MP_MAP:
+            values = (h.type == MP_MAP) ? (uint64_t)h.len*2 : h.len;
+            if (values > len-pos) return sjsonFail(p,"truncated container",pos);
+            if (depth == SJSON_MAX_DEPTH) return sjsonFail(p,"too deep",pos);
+            type = (h.type == MP_MAP) ? SJSON_OBJECT : SJSON_ARRAY;
+            stack[depth*2] = t;
+            stack[depth*2+1] = (uint32_t)values;
+            depth++;
+            tape[t++] = TAPE_WORD(type,(uint64_t)(h.len > SJSON_MAX_COUNT ?
+                                                  SJSON_MAX_COUNT : h.len) << 32);
+            break;
+        default:
+            return sjsonFail(p,"unsupported type",pos-n);
+        }
+
+        /* Close every container whose last value this was. */
+        while (depth && stack[depth*2-1] == 0) {
+            depth--;
+            open = stack[depth*2];
+            type = TAPE_TYPE(tape[open]);
+            tape[open] |= t;
+            tape[t++] = TAPE_WORD(type == SJSON_OBJECT ? SJSON_OBJECT_END : SJSON_ARRAY_END,open);
+        }
+        if (depth == 0) break;
+    }
+    if (pos != len) return sjsonFail(p,"trailing bytes",pos);
+    tape[0] = TAPE_WORD(SJSON_ROOT,t);
+    tape[t++] = TAPE_WORD(SJSON_ROOT,0);
+    p->ntape = t;
+    return SJSON_OK;
+}
+
+/* ----------------------------- API ---------------------------------------- */
+
+sjsonParser *sjsonNew(void) {
+    int tag = zmalloc_set_tag(ZMALLOC_TAG_JSON);
+    sjsonParser *p = zcalloc(sizeof(*p));
+
+    if (!classify) sjsonSelectClassifier();
+    p->stack = zmalloc(sizeof(uint32_t)*2*SJSON_MAX_DEPTH);
+    zmalloc_set_tag(tag);
+    return p;
+}
+
+void sjsonFree(sjsonParser *p) {
+    if (!p) return;
+    zfree(p->index);
+    zfree(p->tape);
+    zfree(p->strings);
+    zfree(p->stack);
+    zfree(p);
+}
+
+/* Parse len bytes of buf, which need not be nul terminated. On error
+ * SJSON_ERR is returned and p->err / p->errpos tell what went wrong. */
+int sjsonParse(sjsonParser *p, const char *buf, size_t len) {
+    p->err = NULL;
+    p->errpos = 0;
+    p->ntape = 0;
+    if (len >= UINT32_MAX) return sjsonFail(p,"document too large",0);
+    if (stage1(p,buf,len) == SJSON_ERR || stage2(p,buf,len) == SJSON_ERR) {
+        p->ntape = 0;
+        return SJSON_ERR;
+    }
+    return SJSON_OK;
+}
+
+size_t sjsonRoot(sjsonParser *p) {
+    return p->ntape ? 1 : 0;
+}
+
+int sjsonType(sjsonParser *p, size_t v) {
+    return TAPE_TYPE(p->tape[v]);
+}
+
+/* Number of elements of an array or members of an object. */
+size_t sjsonSize(sjsonParser *p, size_t v) {
+    return (size_t)((TAPE_VALUE(p->tape[v]) >> 32) & SJSON_MAX_COUNT);
+}
+
+static int isEnd(int type) {
+    return type == SJSON_OBJECT_END || type == SJSON_ARRAY_END || type == SJSON_ROOT;
+}
+
+size_t sjsonFirst(sjsonParser *p, size_t v) {
+    int type = sjsonType(p,v);
+
+    if (type != SJSON_OBJECT && type != SJSON_ARRAY) return 0;
+    return isEnd(sjsonType(p,v+1)) ? 0 : v+1;
+}
+
+size_t sjsonNext(sjsonParser *p, size_t v) {
+    size_t next;
+
+    switch (sjsonType(p,v)) {
+    case SJSON_OBJECT:
+    case SJSON_ARRAY:
+        next = (p->tape[v] & 0xffffffff)+1;
+        break;
+    case SJSON_INT64:
+    case SJSON_DOUBLE:
+        next = v+2;
+        break;
+    default:
+        next = v+1;
+        break;
+    }
+    return isEnd(sjsonType(p,next)) ? 0 : next;
+}
+
+const char *sjsonString(sjsonParser *p, size_t v, size_t *len) {
+    const char *s = p->strings+TAPE_VALUE(p->tape[v]);
+    uint32_t l;
+
+    memcpy(&l,s,sizeof(l));
+    if (len) *len = l;
+    return s+sizeof(l);
+}
+
+/* Value of the member named key, compared case insensitively like
+ * cJSON_GetObjectItem() does. */
+size_t sjsonObjectGet(sjsonParser *p, size_t v, const char *key) {
+    size_t k;
+
+    if (sjsonType(p,v) != SJSON_OBJECT) return 0;
+    for (k = sjsonFirst(p,v); k; k = sjsonNext(p,k+1))
+        if (!strcasecmp(sjsonString(p,k,NULL),key)) return k+1;
+    return 0;
+}
+
+long long sjsonInt(sjsonParser *p, size_t v) {
+    int64_t i;
+    double d;
+
+    switch (sjsonType(p,v)) {
+    case SJSON_INT64:
+        memcpy(&i,&p->tape[v+1],sizeof(i));
+        return i;
+    case SJSON_DOUBLE:
+        memcpy(&d,&p->tape[v+1],sizeof(d));
+        return (long long)d;
+    default:
+        return 0;
+    }
+}
+
+double sjsonDouble(sjsonParser *p, size_t v) {
+    int64_t i;
+    double d;
+
+    switch (sjsonType(p,v)) {
+    case SJSON_INT64:
+        memcpy(&i,&p->tape[v+1],sizeof(i));
+        return (double)i;
+    case SJSON_DOUBLE:
+        memcpy(&d,&p->tape[v+1],sizeof(d));
+        return d;
+    default:
+        return 0;
+    }
+}
+
+/* ----------------------------- cJSON view --------------------------------- */
+
+/* The view is allocated in the arena a, or with the cJSON hooks if NULL. */
+static void *viewAlloc(arena *a, size_t size) {
+    return a ? arenaAlloc(a,size) : cJSON_Malloc(size);
+}
+
+static char *viewString(sjsonParser *p, arena *a, size_t v) {
+    size_t len;
+    const char *s = sjsonString(p,v,&len);
+    char *copy = viewAlloc(a,len+1);
+
+    if (copy) memcpy(copy,s,len+1);
+    return copy;
+}
+
+static cJSON *viewItem(sjsonParser *p, arena *a, size_t v) {
+    cJSON *item = viewAlloc(a,sizeof(cJSON)), *child;
+    int type = sjsonType(p,v);
+    size_t k;
+    double d;
+
+    if (!item) return NULL;
+    memset(item,0,sizeof(*item));
+    item->arena = a;
+    switch (type) {
+    case SJSON_OBJECT:
+    case SJSON_ARRAY:
+        item->type = (type == SJSON_OBJECT) ? cJSON_Object : cJSON_Array;
+        for (k = sjsonFirst(p,v); k; k = sjsonNext(p,k)) {
+            size_t key = 0;
+
+            if (type == SJSON_OBJECT) key = k++;
+            if (!(child = viewItem(p,a,k))) goto err;
+            if (key && !(child->string = viewString(p,a,key))) {
+                cJSON_Delete(child);
+                goto err;
+            }
+            /* Append through the tail, not walking the chain. */
+            if (item->tail) {
+                item->tail->next = child;
+                child->prev = item->tail;
+            } else {
+                item->child = child;
+            }
+            item->tail = child;
+            item->count++;
+        }
+        break;
+    case SJSON_STRING:
+        item->type = cJSON_String;
+        if (!(item->valuestring = viewString(p,a,v))) goto err;
+        break;
+    case SJSON_INT64:
+    case SJSON_DOUBLE:
+        d = sjsonDouble(p,v);
+        item->type = cJSON_Number;
+        item->valuedouble = d;
+        item->valueint = (d >= INT_MAX) ? INT_MAX : (d <= INT_MIN) ? INT_MIN : (int)d;
+        break;
+    case SJSON_TRUE: item->type = cJSON_True; break;
+    case SJSON_FALSE: item->type = cJSON_False; break;
+    default: item->type = cJSON_NULL; break;
+    }
+    return item;
+
+err:
+    cJSON_Delete(item);
+    return NULL;
+}
+
+cJSON *sjsonToCJSON(sjsonParser *p) {
+    cJSON *root;
+    int tag;
+
+    if (!p->ntape) return NULL;
+    tag = zmalloc_set_tag(ZMALLOC_TAG_JSON);
+    root = viewItem(p,NULL,sjsonRoot(p));
+    zmalloc_set_tag(tag);
+    return root;
+}
+
+/* The chunks the arena grows by carry its own tag, see arenaCreate(). */
+cJSON *sjsonToCJSONArena(sjsonParser *p, arena *a) {
+    if (!p->ntape) return NULL;
+    return viewItem(p,a,sjsonRoot(p));
+}
+
+#ifdef SJSON_BENCHMARK_MAIN
+#include <sys/time.h>
+
+/* The "data" of a suggest_predict request, as sent by cli/predict.c. */
+static const char *sample =
+    "{\"blogid\":\"5f56a4640100md37\",\"blog_pubdate\":\"1282028281\",\"classid\":\"15\","
+    "\"body\":\"-\",\"keyWords\":[{\"word\":\"\xe5\x8f\x91\xe5\xb0\x84\xe7\xb3\xbb\xe7\xbb\x9f\","
+    "\"count\":19,\"tfidf\":0.7192128244436503},{\"word\":\"\xe5\xaf\xbc\xe5\xbc\xb9\","
+    "\"count\":47,\"tfidf\":0.27454768431526294}]}";
+
+static long long benchUstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* The same document with its keyWords array grown to n entries. */
+static char *bigSample(int n) {
+    size_t cap = 256+n*96, len;
+    char *s = malloc(cap);
+    int j;
+
+    len = sprintf(s,"{\"blogid\":\"5f56a4640100md37\",\"blog_pubdate\":\"1282028281\","
+                    "\"classid\":\"15\",\"body\":\"-\",\"keyWords\":[");
+    for (j = 0; j < n; j++)
+        len += sprintf(s+len,"%s{\"word\":\"\\u5bfc\\u5f39%d\",\"count\":%d,\"tfidf\":%.17g}",
+                       j ? "," : "",j,j*7%113,(double)j/(n+1));
+    strcpy(s+len,"]}");
+    return s;
+}
+
+static void bench(const char *name, const char *doc) {
+    size_t len = strlen(doc);
+    long long iter = 50*1024*1024/len+1, j, start;
+    sjsonParser *p = sjsonNew();
+    arena *a = arenaCreate(64*1024,8*1024*1024);
+    void (*best)(const unsigned char *, sjsonBlock *) = classify;
+    cJSON *c;
+    sds mp;
+    struct {
+        const char *name;
+        void (*fn)(const unsigned char *, sjsonBlock *);
+    } impl[] = {
+        {"scalar", classifyScalar},
+#ifdef SJSON_X86
+        {"sse2", classifySSE2},
+        {"avx2", __builtin_cpu_supports("avx2") ? classifyAVX2 : NULL},
+#endif
+    };
+    unsigned k;
+
+#define REPORT(what) do { \
+    long long us = benchUstime()-start; \
+    printf("  %-30s %10.1f ns/doc %8.1f MB/s\n",what, \
+           (double)us*1000/iter,(double)len*iter/us); \
+} while(0)
+
+    printf("%s: %zu bytes, %lld iterations\n",name,len,iter);
+    if (sjsonParse(p,doc,len) != SJSON_OK) {
+        printf("  sjson error: %s at %zu\n",p->err,p->errpos);
+        sjsonFree(p);
+        arenaRelease(a);
+        return;
+    }
+    c = cJSON_Parse(doc);
+    mp = mpAppendCJSON(sdsempty(),c);
+    cJSON_Delete(c);
+
+    start = benchUstime();
+    for (j = 0; j < iter; j++) cJSON_Delete(cJSON_Parse(doc));
+    REPORT("cJSON_Parse");
+
+    for (k = 0; k < sizeof(impl)/sizeof(impl[0]); k++) {
+        char what[64];
+
+        if (!impl[k].fn) continue;
+        classify = impl[k].fn;
+        start = benchUstime();
+        for (j = 0; j < iter; j++) sjsonParse(p,doc,len);
+        snprintf(what,sizeof(what),"sjsonParse (%s)",impl[k].name);
+        REPORT(what);
+    }
+    classify = best;
+
+    start = benchUstime();
+    for (j = 0; j < iter; j++) {
+        sjsonParse(p,doc,len);
+        c = sjsonToCJSON(p);
+        cJSON_Delete(c);
+    }
+    REPORT("sjsonParse + cJSON view");
+
+    start = benchUstime();
+    for (j = 0; j < iter; j++) {
+        sjsonParse(p,doc,len);
+        sjsonToCJSONArena(p,a);
+        arenaReset(a);
+    }
+    REPORT("sjsonParse + arena view");
+
+    /* The same document as MessagePack, MB/s are still of the JSON text. */
+    printf("  msgpack: %zu bytes\n",sdslen(mp));
+    start = benchUstime();
+    for (j = 0; j < iter; j++) sjsonParseMsgpack(p,mp,sdslen(mp));
+    REPORT("sjsonParseMsgpack");
+
+    start = benchUstime();
+    for (j = 0; j < iter; j++) {
+        sjsonParseMsgpack(p,mp,sdslen(mp));
+        sjsonToCJSONArena(p,a);
+        arenaReset(a);
+    }
+    REPORT("sjsonParseMsgpack + arena view");
+    sdsfree(mp);
+    sjsonFree(p);
+    arenaRelease(a);
+}
+
+/* Usage: sjson-benchmark [file ...], every line of the files is benchmarked
+ * as one document, e.g. a dump of real "data" values. */
+int main(int argc, char **argv) {
+    char *big;
+    int j;
+
+    sjsonSelectClassifier();
+    bench("suggest_predict",sample);
+    big = bigSample(1000);
+    bench("suggest_predict, 1000 keyWords",big);
+    free(big);
+
+    for (j = 1; j < argc; j++) {
+        FILE *fp = fopen(argv[j],"r");
+        char *line = NULL, name[256];
+        size_t cap = 0;
+        ssize_t len;
+        int lineno = 0;
+
+        if (!fp) {
+            perror(argv[j]);
+            return 1;
+        }
+        while ((len = getline(&line,&cap,fp)) > 0) {
+            lineno++;
+            while (len && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+            if (!len) continue;
+            snprintf(name,sizeof(name),"%s:%d",argv[j],lineno);
+            bench(name,line);
+        }
+        free(line);
+        fclose(fp);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,85 @@
+#ifndef __SJSON_H
+#define __SJSON_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cJSON.h"
+#include "arena.h"
+
+#define SJSON_OK 0
+#define SJSON_ERR -1
+
+/* Tape entry types, kept in the top byte of every tape word. */
+#define SJSON_ROOT          'r'
+#define SJSON_OBJECT        '{'
+#define SJSON_OBJECT_END    '}'
+#define SJSON_ARRAY         '['
+#define SJSON_ARRAY_END     ']'
+#define SJSON_STRING        '"'
+#define SJSON_INT64         'l'
+#define SJSON_DOUBLE        'd'
+#define SJSON_TRUE          't'
+#define SJSON_FALSE         'f'
+#define SJSON_NULL          'n'
+
+#define SJSON_MAX_DEPTH     1024
+
+/* A parser owns the buffers of both stages and keeps them between calls, so
+ * parsing a document of a size already seen does not allocate at all.
+ *
+ * Stage 1 finds the offset of every structural character and of the first
+ * byte of every scalar outside strings (index). Stage 2 walks those offsets
+ * validating the grammar and writes the document to the tape, one 64 bit
+ * word per value (two for numbers):
+ *
+ *   { [          type | count<<32 | tape index of the matching } ]
+ *   } ]          type | tape index of the matching { [
+ *   "            type | offset of the string in strings
+ *   l d          type, then the int64_t / double itself in the next word
+ *   t f n        type
+ *
+ * The tape starts and ends with a SJSON_ROOT word, object members are stored
+ * as key string followed by the value. Strings are unescaped into strings as
+ * a 32 bit length followed by the bytes and a nul terminator.
+ *
+ * sjsonParseMsgpack() writes the same tape from a MessagePack document, so
+ * everything below works on both. */
+typedef struct sjsonParser {
+    uint32_t *index;
+    size_t nindex, indexcap;
+    uint64_t *tape;
+    size_t ntape, tapecap;
+    char *strings;
+    size_t nstrings, stringscap;
+    uint32_t *stack;            /* open containers during stage 2 */
+    const char *err;            /* why the last parse failed */
+    size_t errpos;              /* and near which input offset */
+} sjsonParser;
+
+sjsonParser *sjsonNew(void);
+void sjsonFree(sjsonParser *p);
+int sjsonParse(sjsonParser *p, const char *buf, size_t len);
+int sjsonParseMsgpack(sjsonParser *p, const char *buf, size_t len);
+
+/* Tape navigation. Values are referenced by their tape index, 0 means none.
+ * Object members are visited as key, value, key, value... */
+size_t sjsonRoot(sjsonParser *p);
+int sjsonType(sjsonParser *p, size_t v);
+size_t sjsonSize(sjsonParser *p, size_t v);
+size_t sjsonFirst(sjsonParser *p, size_t v);
+size_t sjsonNext(sjsonParser *p, size_t v);
+size_t sjsonObjectGet(sjsonParser *p, size_t v, const char *key);
+const char *sjsonString(sjsonParser *p, size_t v, size_t *len);
+long long sjsonInt(sjsonParser *p, size_t v);
+double sjsonDouble(sjsonParser *p, size_t v);
+
+/* Build a regular cJSON tree from the last parsed document, so formulas
+ * written against cJSON keep working. Free it with cJSON_Delete(). */
+cJSON *sjsonToCJSON(sjsonParser *p);
+
+/* Same, but the tree is allocated in the arena a and goes away with
+ * arenaReset(). Every node records a in its arena field, so deleting parts
+ * of the tree is harmless and what cJSON adds to it is allocated in a. */
+cJSON *sjsonToCJSONArena(sjsonParser *p, arena *a);
+
+#endif
@@ -5,9 +5,12 @@
 #include <ctype.h>
 #include <limits.h>
 #include <math.h>
+#include <float.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "util.h"
+#include "numconv.h"
 
 /* Glob-style pattern matching. */
 int stringmatchlen(const char *pattern, int patternLen,
@@ -318,11 +321,18 @@ int d2string(char *buf, size_t len, double value) {
          * integer printing function that is much faster. */
         double min = -4503599627370495; /* (2^52)-1 */
         double max = 4503599627370496; /* -(2^52) */
-        if (val > min && val < max && value == ((double)((long long)value)))
+        if (value > min && value < max && value == ((double)((long long)value)))
             len = ll2string(buf,len,(long long)value);
         else
 #endif
-            len = snprintf(buf,len,"%.17g",value);
+        {
+            /* Shortest representation that reads back as the same double,
+             * "%.17g" would turn 0.1 into 0.10000000000000001. */
+            char tmp[NUM_BUFLEN];
+
+            numPrintDouble(tmp,value);
+            len = snprintf(buf,len,"%s",tmp);
+        }
     }
 
     return len;
@@ -344,6 +354,75 @@ long long mstime(void) {
     return ustime()/1000;
 }
 
+/* Return the CPU time used by the calling thread in microseconds */
+long long threadustime(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts) == -1) return 0;
+    return ((long long)ts.tv_sec)*1000000+ts.tv_nsec/1000;
+}
+
+/* MurmurHash2, 64-bit versions, by Austin Appleby. The key is read one
+ * byte at a time for the tail and with memcpy() for the 8 byte blocks, so
+ * it works on any alignment and gives the same result on every host. */
+uint64_t MurmurHash64A(const void *key, size_t len, uint64_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const unsigned char *data = key, *end = data+(len & ~(size_t)7);
+    uint64_t h = seed ^ (len * m), k;
+
+    while (data != end) {
+        memcpy(&k,data,sizeof(k));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        k = __builtin_bswap64(k);
+#endif
+        data += 8;
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (len & 7) {
+    case 7: h ^= (uint64_t)data[6] << 48; /* fall through */
+    case 6: h ^= (uint64_t)data[5] << 40; /* fall through */
+    case 5: h ^= (uint64_t)data[4] << 32; /* fall through */
+    case 4: h ^= (uint64_t)data[3] << 24; /* fall through */
+    case 3: h ^= (uint64_t)data[2] << 16; /* fall through */
+    case 2: h ^= (uint64_t)data[1] << 8; /* fall through */
+    case 1: h ^= (uint64_t)data[0];
+            h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+/* CRC-32 (IEEE 802.3, the one of zlib and cksum -a crc32b). Pass 0 as crc
+ * the first time, then the previous result to go on with the next bytes. */
+uint32_t crc32(uint32_t crc, const void *buf, size_t len) {
+    static uint32_t table[256];
+    const unsigned char *p = buf;
+    uint32_t c;
+    int j, k;
+
+    if (!table[1]) {
+        for (j = 0; j < 256; j++) {
+            for (c = j, k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[j] = c;
+        }
+    }
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
 #ifdef UTIL_TEST_MAIN
 #include <assert.h>
 
@@ -451,9 +530,48 @@ void test_string2l(void) {
 #endif
 }
 
+void test_d2string(void) {
+    char buf[128];
+
+    assert(d2string(buf,sizeof(buf),0.1) == 3 && !strcmp(buf,"0.1"));
+    assert(d2string(buf,sizeof(buf),-1.5) == 4 && !strcmp(buf,"-1.5"));
+    assert(d2string(buf,sizeof(buf),42) == 2 && !strcmp(buf,"42"));
+    assert(d2string(buf,sizeof(buf),-0.0) == 2 && !strcmp(buf,"-0"));
+    assert(d2string(buf,sizeof(buf),1e300) == 5 && !strcmp(buf,"1e300"));
+    assert(d2string(buf,sizeof(buf),5e-324) == 6 && !strcmp(buf,"5e-324"));
+    assert(d2string(buf,sizeof(buf),1.0/3) == 18 && strtod(buf,NULL) == 1.0/3);
+}
+
+void test_murmur(void) {
+    char buf[64];
+    int j;
+
+    assert(MurmurHash64A("",0,0) == 0);
+    assert(MurmurHash64A("abc",3,0) != MurmurHash64A("abc",3,1));
+    assert(MurmurHash64A("abcdefgh",8,0) != MurmurHash64A("abcdefgi",8,0));
+    /* The same bytes hash the same whatever their alignment. */
+    for (j = 1; j < 8; j++) {
+        memcpy(buf+j,"the quick brown fox",19);
+        assert(MurmurHash64A(buf+j,19,7) == MurmurHash64A("the quick brown fox",19,7));
+    }
+}
+
+void test_crc32(void) {
+    uint32_t crc;
+
+    assert(crc32(0,"",0) == 0);
+    assert(crc32(0,"123456789",9) == 0xcbf43926);
+    /* In pieces it is the same. */
+    crc = crc32(0,"1234",4);
+    assert(crc32(crc,"56789",5) == 0xcbf43926);
+}
+
 int main(int argc, char **argv) {
     test_string2ll();
     test_string2l();
+    test_d2string();
+    test_murmur();
+    test_crc32();
     return 0;
 }
 #endif
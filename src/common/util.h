@@ -1,6 +1,9 @@
 #ifndef __REDIS_UTIL_H
 #define __REDIS_UTIL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 int stringmatchlen(const char *p, int plen, const char *s, int slen, int nocase);
 int stringmatch(const char *p, const char *s, int nocase);
 long long memtoll(const char *p, int *err);
@@ -10,5 +13,8 @@ int string2l(char *s, size_t slen, long *value);
 int d2string(char *buf, size_t len, double value);
 long long ustime(void);
 long long mstime(void);
+long long threadustime(void);
+uint64_t MurmurHash64A(const void *key, size_t len, uint64_t seed);
+uint32_t crc32(uint32_t crc, const void *buf, size_t len);
 
 #endif
@@ -58,34 +58,42 @@
 #define free(ptr) je_free(ptr)
 #endif
 
-#define update_zmalloc_stat_alloc(__n,__size) do { \
+/* Memory is counted per thread and per tag, see zmalloc_set_tag(): every
+ * thread adds what it allocates and takes off what it frees (even when
+ * another thread allocated it) to counters of its own, without a lock, and
+ * zmalloc_used_memory() sums the counters of all the threads when asked.
+ * Without a malloc_size() the tag of an allocation is kept in the high bits
+ * of its size prefix so that freeing it takes it off the right tag. With
+ * one there is no prefix and everything is counted as ZMALLOC_TAG_OTHER,
+ * only the scopes see the tag in use when memory is allocated or freed. */
+#ifdef HAVE_MALLOC_SIZE
+#define counter_tag(tag) ZMALLOC_TAG_OTHER
+#else
+#define counter_tag(tag) (tag)
+#define PREFIX_TAG_SHIFT (sizeof(size_t)*8-4)
+#define PREFIX_SIZE_MASK (((size_t)1<<PREFIX_TAG_SHIFT)-1)
+#define prefix_make(size,tag) ((size)|((size_t)(tag)<<PREFIX_TAG_SHIFT))
+#define prefix_size(p) ((p)&PREFIX_SIZE_MASK)
+#define prefix_tag(p) ((int)((p)>>PREFIX_TAG_SHIFT))
+#endif
+
+#define update_zmalloc_stat_alloc(__n,__tag) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    if (zmalloc_thread_safe) { \
-        pthread_mutex_lock(&used_memory_mutex);  \
-        used_memory += _n; \
-        pthread_mutex_unlock(&used_memory_mutex); \
-    } else { \
-        used_memory += _n; \
+    zmalloc_count(counter_tag(__tag),(long long)_n); \
+    if ((__tag) == scope_tag) { \
+        scope_used += _n; \
+        if (scope_used > scope_peak) scope_peak = scope_used; \
     } \
 } while(0)
 
-#define update_zmalloc_stat_free(__n) do { \
+#define update_zmalloc_stat_free(__n,__tag) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    if (zmalloc_thread_safe) { \
-        pthread_mutex_lock(&used_memory_mutex);  \
-        used_memory -= _n; \
-        pthread_mutex_unlock(&used_memory_mutex); \
-    } else { \
-        used_memory -= _n; \
-    } \
+    zmalloc_count(counter_tag(__tag),-(long long)_n); \
+    if ((__tag) == scope_tag) scope_used -= _n; \
 } while(0)
 
-static size_t used_memory = 0;
-static int zmalloc_thread_safe = 0;
-pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 static void zmalloc_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",
         size);
@@ -93,16 +101,89 @@ static void zmalloc_oom(size_t size) {
     abort();
 }
 
+/* The counters of a thread. They are never freed: the counters of a thread
+ * that exits are handed to the next one created, counts and all, so that
+ * what it left allocated is still counted. */
+typedef struct zmalloc_counters {
+    long long used[ZMALLOC_TAGS];
+    struct zmalloc_counters *next;      /* in counters_all, set once */
+    struct zmalloc_counters *next_free; /* in counters_free */
+} zmalloc_counters;
+
+static zmalloc_counters *counters_all = NULL;
+static zmalloc_counters *counters_free = NULL;
+static pthread_mutex_t counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t counters_key;
+static pthread_once_t counters_once = PTHREAD_ONCE_INIT;
+
+static __thread zmalloc_counters *thread_counters = NULL;
+static __thread int thread_tag = ZMALLOC_TAG_OTHER;
+
+/* The tag of the scope of the calling thread, -1 when it has none, the
+ * bytes allocated under it and not yet freed since zmalloc_scope_begin()
+ * (negative when it frees memory allocated before) and the most it had. */
+static __thread int scope_tag = -1;
+static __thread long long scope_used = 0;
+static __thread long long scope_peak = 0;
+
+static char *zmalloc_tag_names[ZMALLOC_TAGS] = {
+    "other", "client", "reply", "argv", "dict", "formula", "json"
+};
+
+static void zmalloc_thread_exit(void *ptr) {
+    zmalloc_counters *c = ptr;
+
+    pthread_mutex_lock(&counters_mutex);
+    c->next_free = counters_free;
+    counters_free = c;
+    pthread_mutex_unlock(&counters_mutex);
+    thread_counters = NULL;
+}
+
+static void zmalloc_counters_init(void) {
+    pthread_key_create(&counters_key,zmalloc_thread_exit);
+}
+
+/* First allocation of a thread: take the counters of a thread gone or new
+ * ones, published at the head of counters_all for the readers. */
+static zmalloc_counters *zmalloc_thread_counters(void) {
+    zmalloc_counters *c;
+
+    pthread_once(&counters_once,zmalloc_counters_init);
+    pthread_mutex_lock(&counters_mutex);
+    if ((c = counters_free) != NULL) {
+        counters_free = c->next_free;
+    } else {
+        if (!(c = calloc(1,sizeof(*c)))) {
+            pthread_mutex_unlock(&counters_mutex);
+            zmalloc_oom(sizeof(*c));
+        }
+        c->next = counters_all;
+        __atomic_store_n(&counters_all,c,__ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&counters_mutex);
+    pthread_setspecific(counters_key,c);
+    thread_counters = c;
+    return c;
+}
+
+static inline void zmalloc_count(int tag, long long n) {
+    zmalloc_counters *c = thread_counters;
+
+    if (!c) c = zmalloc_thread_counters();
+    __atomic_store_n(&c->used[tag],c->used[tag]+n,__ATOMIC_RELAXED);
+}
+
 void *zmalloc(size_t size) {
     void *ptr = malloc(size+PREFIX_SIZE);
 
     if (!ptr) zmalloc_oom(size);
 #ifdef HAVE_MALLOC_SIZE
-    update_zmalloc_stat_alloc(zmalloc_size(ptr),size);
+    update_zmalloc_stat_alloc(zmalloc_size(ptr),thread_tag);
     return ptr;
 #else
-    *((size_t*)ptr) = size;
-    update_zmalloc_stat_alloc(size+PREFIX_SIZE,size);
+    *((size_t*)ptr) = prefix_make(size,thread_tag);
+    update_zmalloc_stat_alloc(size+PREFIX_SIZE,thread_tag);
     return (char*)ptr+PREFIX_SIZE;
 #endif
 }
@@ -112,18 +193,20 @@ void *zcalloc(size_t size) {
 
     if (!ptr) zmalloc_oom(size);
 #ifdef HAVE_MALLOC_SIZE
-    update_zmalloc_stat_alloc(zmalloc_size(ptr),size);
+    update_zmalloc_stat_alloc(zmalloc_size(ptr),thread_tag);
     return ptr;
 #else
-    *((size_t*)ptr) = size;
-    update_zmalloc_stat_alloc(size+PREFIX_SIZE,size);
+    *((size_t*)ptr) = prefix_make(size,thread_tag);
+    update_zmalloc_stat_alloc(size+PREFIX_SIZE,thread_tag);
     return (char*)ptr+PREFIX_SIZE;
 #endif
 }
 
+/* A reallocation keeps the tag the memory was first allocated with. */
 void *zrealloc(void *ptr, size_t size) {
 #ifndef HAVE_MALLOC_SIZE
     void *realptr;
+    int tag;
 #endif
     size_t oldsize;
     void *newptr;
@@ -134,18 +217,19 @@ void *zrealloc(void *ptr, size_t size) {
     newptr = realloc(ptr,size);
     if (!newptr) zmalloc_oom(size);
 
-    update_zmalloc_stat_free(oldsize);
-    update_zmalloc_stat_alloc(zmalloc_size(newptr),size);
+    update_zmalloc_stat_free(oldsize,thread_tag);
+    update_zmalloc_stat_alloc(zmalloc_size(newptr),thread_tag);
     return newptr;
 #else
     realptr = (char*)ptr-PREFIX_SIZE;
-    oldsize = *((size_t*)realptr);
+    oldsize = prefix_size(*((size_t*)realptr));
+    tag = prefix_tag(*((size_t*)realptr));
     newptr = realloc(realptr,size+PREFIX_SIZE);
     if (!newptr) zmalloc_oom(size);
 
-    *((size_t*)newptr) = size;
-    update_zmalloc_stat_free(oldsize);
-    update_zmalloc_stat_alloc(size,size);
+    *((size_t*)newptr) = prefix_make(size,tag);
+    update_zmalloc_stat_free(oldsize,tag);
+    update_zmalloc_stat_alloc(size,tag);
     return (char*)newptr+PREFIX_SIZE;
 #endif
 }
@@ -156,7 +240,7 @@ void *zrealloc(void *ptr, size_t size) {
 #ifndef HAVE_MALLOC_SIZE
 size_t zmalloc_size(void *ptr) {
     void *realptr = (char*)ptr-PREFIX_SIZE;
-    size_t size = *((size_t*)realptr);
+    size_t size = prefix_size(*((size_t*)realptr));
     /* Assume at least that all the allocations are padded at sizeof(long) by
      * the underlying allocator. */
     if (size&(sizeof(long)-1)) size += sizeof(long)-(size&(sizeof(long)-1));
@@ -172,12 +256,12 @@ void zfree(void *ptr) {
 
     if (ptr == NULL) return;
 #ifdef HAVE_MALLOC_SIZE
-    update_zmalloc_stat_free(zmalloc_size(ptr));
+    update_zmalloc_stat_free(zmalloc_size(ptr),thread_tag);
     free(ptr);
 #else
     realptr = (char*)ptr-PREFIX_SIZE;
     oldsize = *((size_t*)realptr);
-    update_zmalloc_stat_free(oldsize+PREFIX_SIZE);
+    update_zmalloc_stat_free(prefix_size(oldsize)+PREFIX_SIZE,prefix_tag(oldsize));
     free(realptr);
 #endif
 }
@@ -190,17 +274,65 @@ char *zstrdup(const char *s) {
     return p;
 }
 
+/* Fill used with the bytes allocated under every tag, by all the threads.
+ * The counters are read as they are, while the other threads go on. */
+void zmalloc_used_by_tag(size_t *used) {
+    zmalloc_counters *c = __atomic_load_n(&counters_all,__ATOMIC_ACQUIRE);
+    long long sum[ZMALLOC_TAGS] = {0};
+    int j;
+
+    for (; c; c = c->next)
+        for (j = 0; j < ZMALLOC_TAGS; j++)
+            sum[j] += __atomic_load_n(&c->used[j],__ATOMIC_RELAXED);
+    for (j = 0; j < ZMALLOC_TAGS; j++)
+        used[j] = sum[j] > 0 ? (size_t)sum[j] : 0;
+}
+
 size_t zmalloc_used_memory(void) {
-    size_t um;
+    size_t used[ZMALLOC_TAGS], um = 0;
+    int j;
 
-    if (zmalloc_thread_safe) pthread_mutex_lock(&used_memory_mutex);
-    um = used_memory;
-    if (zmalloc_thread_safe) pthread_mutex_unlock(&used_memory_mutex);
+    zmalloc_used_by_tag(used);
+    for (j = 0; j < ZMALLOC_TAGS; j++) um += used[j];
     return um;
 }
 
-void zmalloc_enable_thread_safeness(void) {
-    zmalloc_thread_safe = 1;
+/* Allocations of the calling thread are tagged tag (ZMALLOC_TAG_*) from
+ * now on. Returns the tag in use until now, to be set back when done.
+ * Regions nest and the innermost one wins: the parser or the reply writer
+ * called from formula code tag what they allocate ZMALLOC_TAG_JSON, so
+ * ZMALLOC_TAG_FORMULA is only what the formula allocates itself. */
+int zmalloc_set_tag(int tag) {
+    int old = thread_tag;
+
+    thread_tag = tag;
+    return old;
+}
+
+int zmalloc_get_tag(void) {
+    return thread_tag;
+}
+
+const char *zmalloc_tag_name(int tag) {
+    return zmalloc_tag_names[tag];
+}
+
+/* Measure what the calling thread allocates under tag between
+ * zmalloc_scope_begin() and zmalloc_scope_end(): the bytes it left
+ * allocated (net, negative if it freed more than it allocated) and the most
+ * it had allocated at once in between (peak). What is allocated under
+ * another tag in between, by a nested zmalloc_set_tag(), is not counted.
+ * Scopes do not nest. */
+void zmalloc_scope_begin(zmalloc_scope *s, int tag) {
+    s->net = s->peak = 0;
+    scope_tag = tag;
+    scope_used = scope_peak = 0;
+}
+
+void zmalloc_scope_end(zmalloc_scope *s) {
+    s->net = scope_used;
+    s->peak = scope_peak;
+    scope_tag = -1;
 }
 
 /* Get the RSS information in an OS-specific way.
@@ -66,15 +66,36 @@
 #define ZMALLOC_LIB "libc"
 #endif
 
+/* Allocation tags, see zmalloc_set_tag() */
+#define ZMALLOC_TAG_OTHER   0
+#define ZMALLOC_TAG_CLIENT  1   /* clients and their query buffers */
+#define ZMALLOC_TAG_REPLY   2   /* reply lists */
+#define ZMALLOC_TAG_ARGV    3   /* arguments of the commands parsed */
+#define ZMALLOC_TAG_DICT    4   /* hash tables and their entries */
+#define ZMALLOC_TAG_FORMULA 5   /* formula code and its reply buffer */
+#define ZMALLOC_TAG_JSON    6   /* parsers, "data" DOMs and arena, reply writers */
+#define ZMALLOC_TAGS        7   /* at most 16 */
+
+/* See zmalloc_scope_begin() */
+typedef struct zmalloc_scope {
+    long long net;
+    long long peak;
+} zmalloc_scope;
+
 void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
 void zfree(void *ptr);
 char *zstrdup(const char *s);
 size_t zmalloc_used_memory(void);
-void zmalloc_enable_thread_safeness(void);
+void zmalloc_used_by_tag(size_t *used);
+int zmalloc_set_tag(int tag);
+int zmalloc_get_tag(void);
+const char *zmalloc_tag_name(int tag);
 float zmalloc_get_fragmentation_ratio(void);
 size_t zmalloc_get_rss(void);
+void zmalloc_scope_begin(zmalloc_scope *s, int tag);
+void zmalloc_scope_end(zmalloc_scope *s);
 
 #ifndef HAVE_MALLOC_SIZE
 size_t zmalloc_size(void *ptr);
@@ -15,7 +15,7 @@ int yesnotoi(char *s) {
    will improve later if the config gets more complex */
 void loadServerConfig(char *filename) {
 		FILE *fp;
-		char buf[REDIS_CONFIGLINE_MAX+1], *err = NULL;
+		char buf[REDIS_CONFIGLINE_MAX+1], fmerr[256], *err = NULL;
 		int linenum = 0;
 		sds line = NULL;
 
@@ -60,10 +60,11 @@ void loadServerConfig(char *filename) {
 				} else if (!strcasecmp(argv[0],"bind") && argc == 2) {
 						server.bindaddr = zstrdup(argv[1]);
 				} else if (!strcasecmp(argv[0],"formula") && argc == 2) {
-						void *val = loadfm(argv[1]);
-						if(!val) goto loaderr;
-						int retval = dictAdd(server.fms, sdsnew(argv[1]), val);
-						if(retval != DICT_OK) goto loaderr;
+						void *val = loadfm(argv[1],1,fmerr,sizeof(fmerr));
+						if(!val) {
+								err = fmerr; goto loaderr;
+						}
+						if(addfm(argv[1],val) != REDIS_OK) goto loaderr;
 				} else if (!strcasecmp(argv[0],"dir") && argc == 2) {
 						if (chdir(argv[1]) == -1) {
 								redisLog(REDIS_WARNING,"Can't chdir to '%s': %s",
@@ -105,6 +106,71 @@ void loadServerConfig(char *filename) {
 						}
 				} else if (!strcasecmp(argv[0],"maxclients") && argc == 2) {
 						server.maxclients = atoi(argv[1]);
+				} else if (!strcasecmp(argv[0],"admission-target") && argc == 2) {
+						server.admission_target = strtoll(argv[1],NULL,10);
+						if (server.admission_target < 0) {
+								err = "Invalid admission target"; goto loaderr;
+						}
+				} else if (!strcasecmp(argv[0],"admission-percentile") && argc == 2) {
+						server.admission_percentile = atoi(argv[1]);
+						if (server.admission_percentile < 1 || server.admission_percentile > 100) {
+								err = "Invalid admission percentile"; goto loaderr;
+						}
+				} else if (!strcasecmp(argv[0],"admission-interval") && argc == 2) {
+						server.admission_interval = atoi(argv[1]);
+						if (server.admission_interval < 1) {
+								err = "Invalid admission interval"; goto loaderr;
+						}
+				} else if (!strcasecmp(argv[0],"slowlog-log-slower-than") && argc == 2) {
+						server.slowlog_log_slower_than = strtoll(argv[1],NULL,10);
+				} else if (!strcasecmp(argv[0],"slowlog-max-len") && argc == 2) {
+						server.slowlog_max_len = strtoul(argv[1],NULL,10);
+				} else if (!strcasecmp(argv[0],"latency-monitor-threshold") && argc == 2) {
+						server.latency_monitor_threshold = strtoll(argv[1],NULL,10);
+						if (server.latency_monitor_threshold < 0) {
+								err = "Invalid latency monitor threshold"; goto loaderr;
+						}
+				} else if (!strcasecmp(argv[0],"trace-file") && argc == 2) {
+						zfree(server.trace_file);
+						server.trace_file = zstrdup(argv[1]);
+				} else if (!strcasecmp(argv[0],"trace-sample-rate") && argc == 2) {
+						server.trace_sample_rate = strtoll(argv[1],NULL,10);
+						if (server.trace_sample_rate < 0) {
+								err = "Invalid trace sample rate"; goto loaderr;
+						}
+				} else if (!strcasecmp(argv[0],"admission-exempt") && argc == 2) {
+						FMITEM *fm = dictFetchValue(server.fms,argv[1]);
+						if (!fm) {
+								err = "admission-exempt must follow the formula it names"; goto loaderr;
+						}
+						fm->noadmission = 1;
+				} else if (!strcasecmp(argv[0],"formula-cache") && argc == 4) {
+						FMITEM *fm = dictFetchValue(server.fms,argv[1]);
+						long long ttl = strtoll(argv[2],NULL,10);
+						long long maxmemory;
+						int memerr;
+
+						if (!fm) {
+								err = "formula-cache must follow the formula it names"; goto loaderr;
+						}
+						if (!(fm->desc.flags & FM_DETERMINISTIC)) {
+								err = "formula-cache needs a formula flagged FM_DETERMINISTIC"; goto loaderr;
+						}
+						maxmemory = memtoll(argv[3],&memerr);
+						if (ttl < 0 || memerr || maxmemory <= 0) {
+								err = "Invalid formula-cache ttl or memory"; goto loaderr;
+						}
+						fm->cache = fmCacheCreate((time_t)ttl,(size_t)maxmemory);
+				} else if (!strcasecmp(argv[0],"formula-workers") && argc == 3) {
+						FMITEM *fm = dictFetchValue(server.fms,argv[1]);
+
+						if (!fm) {
+								err = "formula-workers must follow the formula it names"; goto loaderr;
+						}
+						fm->nworkers = atoi(argv[2]);
+						if (fm->nworkers < 0 || fm->nworkers > FM_WORKERS_MAX) {
+								err = "Invalid number of formula workers"; goto loaderr;
+						}
 				} else if (!strcasecmp(argv[0],"daemonize") && argc == 2) {
 						if ((server.daemonize = yesnotoi(argv[1])) == -1) {
 								err = "argument must be 'yes' or 'no'"; goto loaderr;
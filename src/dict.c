@@ -71,6 +71,17 @@ unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len) {
 
 /* ----------------------------- API implementation ------------------------- */
 
+/* The tables, their entries and iterators are tagged ZMALLOC_TAG_DICT, the
+ * keys and values belong to their owners. */
+static void *_dictAlloc(size_t size, int zero)
+{
+		int tag = zmalloc_set_tag(ZMALLOC_TAG_DICT);
+		void *p = zero ? zcalloc(size) : zmalloc(size);
+
+		zmalloc_set_tag(tag);
+		return p;
+}
+
 /* Reset an hashtable already initialized with ht_init().
  * NOTE: This function should only called by ht_destroy(). */
 static void _dictReset(dictht *ht)
@@ -85,7 +96,7 @@ static void _dictReset(dictht *ht)
 dict *dictCreate(dictType *type,
 				void *privDataPtr)
 {
-		dict *d = zmalloc(sizeof(*d));
+		dict *d = _dictAlloc(sizeof(*d),0);
 
 		_dictInit(d,type,privDataPtr);
 		return d;
@@ -119,7 +130,7 @@ int dictExpand(dict *d, unsigned long size)
 		/* Allocate the new hashtable and initialize all pointers to NULL */
 		n.size = realsize;
 		n.sizemask = realsize-1;
-		n.table = zcalloc(realsize*sizeof(dictEntry*));
+		n.table = _dictAlloc(realsize*sizeof(dictEntry*),1);
 		n.used = 0;
 
 		/* Is this the first initialization? If so it's not really a rehashing
@@ -206,7 +217,7 @@ int dictAdd(dict *d, void *key, void *val)
 
 		/* Allocates the memory and stores key */
 		ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-		entry = zmalloc(sizeof(*entry));
+		entry = _dictAlloc(sizeof(*entry),0);
 		entry->next = ht->table[index];
 		ht->table[index] = entry;
 		ht->used++;
@@ -245,9 +256,128 @@ void *dictFetchValue(dict *d, const void *key) {
 		return he ? dictGetEntryVal(he) : NULL;
 }
 
+/* Search and remove an element */
+static int dictGenericDelete(dict *d, const void *key, int nofree)
+{
+		unsigned int h, idx;
+		dictEntry *he, *prevHe;
+		int table;
+
+		if (d->ht[0].size == 0) return DICT_ERR; /* d->ht[0].table is NULL */
+		if (dictIsRehashing(d)) _dictRehashStep(d);
+		h = dictHashKey(d, key);
+
+		for (table = 0; table <= 1; table++) {
+				idx = h & d->ht[table].sizemask;
+				he = d->ht[table].table[idx];
+				prevHe = NULL;
+				while(he) {
+						if (dictCompareHashKeys(d, key, he->key)) {
+								/* Unlink the element from the list */
+								if (prevHe)
+										prevHe->next = he->next;
+								else
+										d->ht[table].table[idx] = he->next;
+								if (!nofree) {
+										dictFreeEntryKey(d, he);
+										dictFreeEntryVal(d, he);
+								}
+								zfree(he);
+								d->ht[table].used--;
+								return DICT_OK;
+						}
+						prevHe = he;
+						he = he->next;
+				}
+				if (!dictIsRehashing(d)) break;
+		}
+		return DICT_ERR; /* not found */
+}
+
+int dictDelete(dict *ht, const void *key) {
+		return dictGenericDelete(ht,key,0);
+}
+
+int dictDeleteNoFree(dict *ht, const void *key) {
+		return dictGenericDelete(ht,key,1);
+}
+
+/* Destroy an entire dictionary */
+static int _dictClear(dict *d, dictht *ht)
+{
+		unsigned long i;
+
+		/* Free all the elements */
+		for (i = 0; i < ht->size && ht->used > 0; i++) {
+				dictEntry *he, *nextHe;
+
+				if ((he = ht->table[i]) == NULL) continue;
+				while(he) {
+						nextHe = he->next;
+						dictFreeEntryKey(d, he);
+						dictFreeEntryVal(d, he);
+						zfree(he);
+						ht->used--;
+						he = nextHe;
+				}
+		}
+		/* Free the table and the allocated cache structure */
+		zfree(ht->table);
+		/* Re-initialize the table */
+		_dictReset(ht);
+		return DICT_OK; /* never fails */
+}
+
+/* Clear & Release the hash table */
+void dictRelease(dict *d)
+{
+		_dictClear(d,&d->ht[0]);
+		_dictClear(d,&d->ht[1]);
+		zfree(d);
+}
+
+/* Return a random entry from the hash table. Useful to
+ * implement randomized algorithms */
+dictEntry *dictGetRandomKey(dict *d)
+{
+		dictEntry *he, *orighe;
+		unsigned int h;
+		int listlen, listele;
+
+		if (dictSize(d) == 0) return NULL;
+		if (dictIsRehashing(d)) _dictRehashStep(d);
+		if (dictIsRehashing(d)) {
+				do {
+						h = random() % (d->ht[0].size+d->ht[1].size);
+						he = (h >= d->ht[0].size) ? d->ht[1].table[h - d->ht[0].size] :
+								d->ht[0].table[h];
+				} while(he == NULL);
+		} else {
+				do {
+						h = random() & d->ht[0].sizemask;
+						he = d->ht[0].table[h];
+				} while(he == NULL);
+		}
+
+		/* Now we found a non empty bucket, but it is a linked
+		 * list and we need to get a random element from the list.
+		 * The only sane way to do so is counting the elements and
+		 * select a random index. */
+		listlen = 0;
+		orighe = he;
+		while(he) {
+				he = he->next;
+				listlen++;
+		}
+		listele = random() % listlen;
+		he = orighe;
+		while(listele--) he = he->next;
+		return he;
+}
+
 dictIterator *dictGetIterator(dict *d)
 {
-    dictIterator *iter = zmalloc(sizeof(*iter));
+    dictIterator *iter = _dictAlloc(sizeof(*iter),0);
 
     iter->d = d;
     iter->table = 0;
@@ -0,0 +1,297 @@
+#include "gsh.h"
+#include "common/cJSON.h"
+#include "common/msgpack.h"
+#include <ctype.h>
+
+/*-----------------------------------------------------------------------------
+ * grun envelope scanner
+ *
+ * The envelope is validated in a single pass over the request bytes without
+ * building a DOM: keys are matched against kw_list in place and only the
+ * position of the values we need is recorded. The "data" value is skipped
+ * structurally and kept as a byte span, formulas that want a DOM get it
+ * parsed on demand (see fmContextData()), the others take the bytes.
+ *
+ * An envelope starting with a MessagePack map byte is a MessagePack one: the
+ * same keys with the same value types, "data" then is a msgpack map and the
+ * formula gets it in that encoding (see ctx->encoding).
+ *----------------------------------------------------------------------------*/
+
+#define ENVELOPE_MAX_DEPTH 512
+
+typedef struct kwit {
+		char *kw;
+		int  type;
+} KWIT;
+
+KWIT kw_list[] = {
+		{"time",		cJSON_Number},
+		{"ip",			cJSON_String},
+		{"script",		cJSON_String},
+		{"programmer",	cJSON_String},
+		{"formula",		cJSON_String},
+		{"data",		cJSON_Object}
+};
+
+#define KW_COUNT ((int)(sizeof(kw_list)/sizeof(struct kwit)))
+#define KW_FORMULA 4
+#define KW_DATA 5
+
+/*optional deadline fields: "deadline_ms" is an absolute unix time in
+  milliseconds, "timeout" a budget in milliseconds counted from the
+  moment the server received the request. 0 or less means no limit.*/
+#define DEADLINE_KW		"deadline_ms"
+#define TIMEOUT_KW		"timeout"
+
+/*"trace":true asks for the request to be traced, see trace.c.*/
+#define TRACE_KW		"trace"
+
+static const char *skipSpace(const char *p, const char *end) {
+		while (p < end && (unsigned char)*p <= 32) p++;
+		return p;
+}
+
+/* Skip a string starting at the opening quote, return the byte after the
+ * closing quote or NULL if it is not terminated. */
+static const char *skipString(const char *p, const char *end) {
+		for (p++; p < end; p++) {
+				if (*p == '\\') p++;
+				else if (*p == '"') return p+1;
+		}
+		return NULL;
+}
+
+static const char *skipLiteral(const char *p, const char *end, const char *lit, size_t len) {
+		if ((size_t)(end-p) < len || memcmp(p,lit,len)) return NULL;
+		return p+len;
+}
+
+static const char *skipNumber(const char *p, const char *end) {
+		const char *start = p;
+
+		if (p < end && *p == '-') p++;
+		while (p < end && (isdigit((unsigned char)*p) || *p == '.' || *p == 'e' ||
+								*p == 'E' || *p == '+' || *p == '-')) p++;
+		return p == start ? NULL : p;
+}
+
+/* Skip any JSON value, checking its structure but allocating nothing.
+ * Returns the byte after the value or NULL if it is malformed. */
+static const char *skipValue(const char *p, const char *end, int depth) {
+		if (p >= end || depth > ENVELOPE_MAX_DEPTH) return NULL;
+
+		switch (*p) {
+				case '"': return skipString(p,end);
+				case 't': return skipLiteral(p,end,"true",4);
+				case 'f': return skipLiteral(p,end,"false",5);
+				case 'n': return skipLiteral(p,end,"null",4);
+				case '[':
+				case '{': {
+						char close = (*p == '[') ? ']' : '}';
+						int object = (*p == '{');
+
+						p = skipSpace(p+1,end);
+						if (p < end && *p == close) return p+1;
+						while (p < end) {
+								if (object) {
+										if (*p != '"' || !(p = skipString(p,end))) return NULL;
+										p = skipSpace(p,end);
+										if (p >= end || *p != ':') return NULL;
+										p = skipSpace(p+1,end);
+								}
+								if (!(p = skipValue(p,end,depth+1))) return NULL;
+								p = skipSpace(p,end);
+								if (p >= end) return NULL;
+								if (*p == close) return p+1;
+								if (*p != ',') return NULL;
+								p = skipSpace(p+1,end);
+						}
+						return NULL;
+				}
+				default:
+						if (*p == '-' || isdigit((unsigned char)*p)) return skipNumber(p,end);
+						return NULL;
+		}
+}
+
+static int valueType(char ch) {
+		switch (ch) {
+				case '"': return cJSON_String;
+				case '{': return cJSON_Object;
+				case '[': return cJSON_Array;
+				case 't': return cJSON_True;
+				case 'f': return cJSON_False;
+				case 'n': return cJSON_NULL;
+				default: return cJSON_Number;
+		}
+}
+
+static int keyIs(const char *key, size_t keylen, const char *kw) {
+		return strlen(kw) == keylen && !strncasecmp(key,kw,keylen);
+}
+
+static int mpValueType(mpHead *h) {
+		switch (h->type) {
+				case MP_STR:
+				case MP_BIN: return cJSON_String;
+				case MP_MAP: return cJSON_Object;
+				case MP_ARRAY: return cJSON_Array;
+				case MP_BOOL: return h->b ? cJSON_True : cJSON_False;
+				case MP_NIL: return cJSON_NULL;
+				case MP_EXT: return -1;
+				default: return cJSON_Number;
+		}
+}
+
+static double mpNumber(mpHead *h) {
+		switch (h->type) {
+				case MP_INT: return (double)h->i;
+				case MP_UINT: return (double)h->u;
+				default: return h->d;
+		}
+}
+
+/* The MessagePack twin of the JSON scanner below. */
+static int parseMsgpackEnvelope(const char *buf, size_t len, envelope *env) {
+		size_t pos, n, keylen;
+		uint32_t members, m;
+		const char *key;
+		int seen = 0, i, type;
+		mpHead h;
+
+		env->encoding = ENVELOPE_MSGPACK;
+		env->err = "not MessagePack";
+		if (!(pos = mpReadHead(buf,len,&h)) || h.type != MP_MAP) return REDIS_ERR;
+		members = h.len;
+
+		for (m = 0; m < members; m++) {
+				/*key.*/
+				if (!(n = mpReadHead(buf+pos,len-pos,&h)) || h.type != MP_STR) return REDIS_ERR;
+				key = h.str;
+				keylen = h.len;
+				pos += n;
+
+				/*value, only its head is decoded before skipping it.*/
+				if (!mpReadHead(buf+pos,len-pos,&h) || !(n = mpSkip(buf+pos,len-pos)))
+						return REDIS_ERR;
+				type = mpValueType(&h);
+
+				for (i = 0; i < KW_COUNT; i++) {
+						if (seen & (1<<i) || !keyIs(key,keylen,kw_list[i].kw)) continue;
+						if (type != kw_list[i].type) {
+								env->err = kw_list[i].kw;
+								return REDIS_ERR;
+						}
+						seen |= 1<<i;
+						if (i == KW_FORMULA) {
+								env->formula = h.str;
+								env->formulalen = h.len;
+						} else if (i == KW_DATA) {
+								env->data = buf+pos;
+								env->datalen = n;
+						}
+						break;
+				}
+				if (i == KW_COUNT && type == cJSON_Number) {
+						if (!(env->flags & ENVELOPE_DEADLINE) && keyIs(key,keylen,DEADLINE_KW)) {
+								env->deadline_ms = mpNumber(&h);
+								env->flags |= ENVELOPE_DEADLINE;
+						} else if (!(env->flags & ENVELOPE_TIMEOUT) && keyIs(key,keylen,TIMEOUT_KW)) {
+								env->timeout = mpNumber(&h);
+								env->flags |= ENVELOPE_TIMEOUT;
+						}
+				} else if (i == KW_COUNT && type == cJSON_True && keyIs(key,keylen,TRACE_KW)) {
+						env->flags |= ENVELOPE_TRACE;
+				}
+				pos += n;
+		}
+
+		for (i = 0; i < KW_COUNT; i++) {
+				if (!(seen & (1<<i))) {
+						env->err = kw_list[i].kw;
+						return REDIS_ERR;
+				}
+		}
+		env->err = NULL;
+		return REDIS_OK;
+}
+
+/* Validate the envelope in buf and fill env. On error REDIS_ERR is returned
+ * and env->err names what is wrong. */
+int parseEnvelope(const char *buf, size_t len, envelope *env) {
+		const char *p = buf, *end = buf+len, *key, *val;
+		size_t keylen;
+		int seen = 0, i;
+
+		memset(env,0,sizeof(*env));
+		if (len && mpIsMap(buf[0])) return parseMsgpackEnvelope(buf,len,env);
+		env->err = "not JSON";
+		p = skipSpace(p,end);
+		if (p >= end || *p != '{') return REDIS_ERR;
+		p = skipSpace(p+1,end);
+
+		while (p < end && *p != '}') {
+				/*key.*/
+				if (*p != '"' || !(val = skipString(p,end))) return REDIS_ERR;
+				key = p+1;
+				keylen = val-key-1;
+				p = skipSpace(val,end);
+				if (p >= end || *p != ':') return REDIS_ERR;
+
+				/*value.*/
+				val = skipSpace(p+1,end);
+				if (!(p = skipValue(val,end,0))) return REDIS_ERR;
+
+				for (i = 0; i < KW_COUNT; i++) {
+						if (seen & (1<<i) || !keyIs(key,keylen,kw_list[i].kw)) continue;
+						if (valueType(*val) != kw_list[i].type) {
+								env->err = kw_list[i].kw;
+								return REDIS_ERR;
+						}
+						seen |= 1<<i;
+						if (i == KW_FORMULA) {
+								/*the name is used as it is written: formula names
+								  never need an escape, refuse one rather than
+								  look up the escaped bytes.*/
+								env->formula = val+1;
+								env->formulalen = p-val-2;
+								if (memchr(env->formula,'\\',env->formulalen)) {
+										env->err = "formula name must not contain escapes";
+										return REDIS_ERR;
+								}
+						} else if (i == KW_DATA) {
+								env->data = val;
+								env->datalen = p-val;
+						}
+						break;
+				}
+				if (i == KW_COUNT && valueType(*val) == cJSON_Number) {
+						if (!(env->flags & ENVELOPE_DEADLINE) && keyIs(key,keylen,DEADLINE_KW)) {
+								env->deadline_ms = strtod(val,NULL);
+								env->flags |= ENVELOPE_DEADLINE;
+						} else if (!(env->flags & ENVELOPE_TIMEOUT) && keyIs(key,keylen,TIMEOUT_KW)) {
+								env->timeout = strtod(val,NULL);
+								env->flags |= ENVELOPE_TIMEOUT;
+						}
+				} else if (i == KW_COUNT && valueType(*val) == cJSON_True && keyIs(key,keylen,TRACE_KW)) {
+						env->flags |= ENVELOPE_TRACE;
+				}
+
+				p = skipSpace(p,end);
+				if (p >= end) return REDIS_ERR;
+				if (*p == '}') break;
+				if (*p != ',') return REDIS_ERR;
+				p = skipSpace(p+1,end);
+				if (p >= end || *p != '"') return REDIS_ERR;
+		}
+		if (p >= end) return REDIS_ERR;
+
+		for (i = 0; i < KW_COUNT; i++) {
+				if (!(seen & (1<<i))) {
+						env->err = kw_list[i].kw;
+						return REDIS_ERR;
+				}
+		}
+		env->err = NULL;
+		return REDIS_OK;
+}
@@ -0,0 +1,289 @@
+#include "gsh.h"
+
+/*-----------------------------------------------------------------------------
+ * Single flight for deterministic formulas
+ *
+ * A request to a formula flagged FM_DETERMINISTIC that is not answered from
+ * its cache joins the flight of the identical request (same encoding and
+ * "data" bytes) when one is waiting to run or running, and the client is
+ * blocked until it lands. With no such flight a plain formula is simply
+ * called inline: a run on the main thread ends before the next request is
+ * read, so there is nothing to share it with, and its reply is cached.
+ *
+ * Formulas with a batch entry point always start or join a flight: before
+ * the event loop goes to sleep every pending flight is run and the pending
+ * flights of a formula are handed to it in one call. Unblocked clients then
+ * go on with the commands they pipelined meanwhile, which may start new
+ * flights: they run in the same pass.
+ *
+ * Formulas with an async entry point go through flights too, shared only
+ * when they are deterministic: the flight stays open while the formula
+ * works, so identical requests coming meanwhile join it, and lands when the
+ * formula calls fmComplete(), which wakes the event loop through a pipe.
+ * Formulas run by worker processes work the same way, see worker.c.
+ *
+ * A waiter whose request carries a timeout or deadline is answered -TIMEOUT
+ * if that passes before the flight runs, and a flight all its waiters gave
+ * up on is dropped without running. Once running it is seen through.
+ *----------------------------------------------------------------------------*/
+
+/* What fmComplete() writes to the pipe. */
+typedef struct fmCompletion {
+		fmContext *ctx;
+		int ok;
+} fmCompletion;
+
+static dictType flightDictType = {
+		fmCacheHashKey,             /* hash function */
+		NULL,                       /* key dup */
+		NULL,                       /* val dup */
+		fmCacheKeyCompare,          /* key compare */
+		NULL,                       /* key destructor */
+		NULL                        /* val destructor */
+};
+
+/* The flight of the request described by key, if one is waiting to run or
+ * running. */
+fmFlight *flightFind(FMITEM *fm, fmCacheEntry *key) {
+		dictEntry *de;
+
+		if (!fm->flights || (de = dictFind(fm->flights,key)) == NULL) return NULL;
+		return dictGetEntryKey(de);
+}
+
+/* Block c until the flight of the request described by key has run, or
+ * until deadline (0 for none) if it has not started by then. The request
+ * bytes are copied, the client arguments can go. */
+void flightJoin(redisClient *c, FMITEM *fm, fmCacheEntry *key, long long deadline) {
+		dictEntry *de;
+		fmFlight *f;
+		fmWaiter *w;
+
+		int coalesce = fm->desc.flags & FM_DETERMINISTIC;
+
+		if (coalesce && !fm->flights) fm->flights = dictCreate(&flightDictType,NULL);
+		if (coalesce && (de = dictFind(fm->flights,key)) != NULL) {
+				f = dictGetEntryKey(de);
+				fm->stat_coalesced++;
+				server.stat_coalesced_requests++;
+		} else {
+				f = zcalloc(sizeof(*f));
+				f->key = *key;
+				f->key.data = zmalloc(key->datalen ? key->datalen : 1);
+				memcpy(f->key.data,key->data,key->datalen);
+				f->fm = fm;
+				f->waiters = listCreate();
+				if (coalesce) dictAdd(fm->flights,&f->key,NULL);
+				listAddNodeTail(server.flights,f);
+				fm->stat_flights++;
+				fm->refcount++;     /* reload drains this version first */
+		}
+
+		admissionQueued(fm,1);
+		w = zmalloc(sizeof(*w));
+		w->client = c;
+		w->querytime = c->querytime;
+		w->deadline = deadline;
+		listAddNodeTail(f->waiters,w);
+		c->flags |= REDIS_BLOCKED;
+		c->flight = f;
+}
+
+/* Called when a blocked client is freed: the flight still runs, its result
+ * may be cached, but nobody gets it for this client. */
+void flightLeave(redisClient *c) {
+		fmFlight *f = c->flight;
+		listNode *ln;
+		listIter li;
+
+		listRewind(f->waiters,&li);
+		while ((ln = listNext(&li)) != NULL) {
+				fmWaiter *w = listNodeValue(ln);
+
+				if (w->client == c) {
+						admissionQueued(f->fm,-1);
+						zfree(w);
+						listDelNode(f->waiters,ln);
+						break;
+				}
+		}
+		c->flags &= ~REDIS_BLOCKED;
+		c->flight = NULL;
+}
+
+static void flightLand(fmFlight *f, robj *reply) {
+		listNode *ln;
+
+		while ((ln = listFirst(f->waiters)) != NULL) {
+				fmWaiter *w = listNodeValue(ln);
+				redisClient *c = w->client;
+
+				addReply(c,reply);
+				if (c->trace) {
+						c->trace->ts[TRACE_FM_START] = f->start;
+						c->trace->ts[TRACE_FM_END] = f->end;
+						c->trace->parse_us = f->parse_us;
+						c->trace->run_us = f->run_us;
+						traceQueued(c);
+				}
+				admissionQueued(f->fm,-1);
+				admissionRecord(f->fm,ustime()-w->querytime);
+				fmStatsReplyObject(f->fm,ustime()-w->querytime,reply);
+				c->flags &= ~REDIS_BLOCKED;
+				c->flight = NULL;
+				zfree(w);
+				listDelNode(f->waiters,ln);
+
+				/* Go on with what the client pipelined while blocked. */
+				if (sdslen(c->querybuf)) processInputBuffer(c);
+		}
+}
+
+/* Free a flight nobody can join anymore. */
+static void flightFree(fmFlight *f) {
+		FMITEM *fm = f->fm;
+
+		listRelease(f->waiters);
+		zfree(f->key.data);
+		zfree(f);
+		releasefm(fm);
+}
+
+/* Hand the reply to the waiters and drop the flight. */
+void flightFinish(fmFlight *f, robj *reply) {
+		if (f->fm->desc.flags & FM_DETERMINISTIC)
+				dictDelete(f->fm->flights,&f->key);
+		f->end = ustime();
+		slowlogPushFlight(f);
+		flightLand(f,reply);
+		decrRefCount(reply);
+		flightFree(f);
+}
+
+/* Answer -TIMEOUT to the waiters of f whose deadline passed while it was
+ * pending, called right before it runs. Returns 1 when nobody is left: the
+ * flight is then dropped without running. */
+int flightExpire(fmFlight *f) {
+		long long now = ustime();
+		listNode *ln;
+		listIter li;
+
+		listRewind(f->waiters,&li);
+		while ((ln = listNext(&li)) != NULL) {
+				fmWaiter *w = listNodeValue(ln);
+				redisClient *c = w->client;
+
+				if (!w->deadline || now <= w->deadline) continue;
+				server.stat_timedout_requests++;
+				addReply(c,shared.timeouterr);
+				if (c->trace) traceQueued(c);
+				admissionQueued(f->fm,-1);
+				admissionRecord(f->fm,now-w->querytime);
+				fmStatsReplyObject(f->fm,now-w->querytime,shared.timeouterr);
+				c->flags &= ~REDIS_BLOCKED;
+				c->flight = NULL;
+				zfree(w);
+				listDelNode(f->waiters,ln);
+
+				/* May join f again, it then runs for that request. */
+				if (sdslen(c->querybuf)) processInputBuffer(c);
+		}
+		if (listLength(f->waiters)) return 0;
+
+		if (f->fm->desc.flags & FM_DETERMINISTIC)
+				dictDelete(f->fm->flights,&f->key);
+		flightFree(f);
+		return 1;
+}
+
+/* Run every pending flight, called before sleeping. */
+void flightRunPending(void) {
+		fmFlight *batch[FM_BATCH_MAX];
+		robj *replies[FM_BATCH_MAX];
+		listNode *ln;
+		listIter li;
+		fmFlight *f;
+		robj *reply;
+		int n, j;
+
+		while ((ln = listFirst(server.flights)) != NULL) {
+				f = listNodeValue(ln);
+				listDelNode(server.flights,ln);
+				if (flightExpire(f)) continue;
+				f->start = ustime();
+
+				if (f->fm->pool) {
+						/* Lands from the reply handler of the worker. */
+						if (!workerSubmit(f,&reply)) flightFinish(f,reply);
+				} else if (f->fm->desc.async) {
+						/* Lands from flightAsyncHandler() once taken. */
+						if (!grunAsync(f,&reply)) flightFinish(f,reply);
+				} else if (f->fm->desc.batch) {
+						/* The other pending flights of the formula go along. */
+						batch[0] = f;
+						n = 1;
+						listRewind(server.flights,&li);
+						while (n < FM_BATCH_MAX && (ln = listNext(&li)) != NULL) {
+								fmFlight *other = listNodeValue(ln);
+
+								if (other->fm != f->fm) continue;
+								listDelNode(server.flights,ln);
+								if (flightExpire(other)) continue;
+								other->start = f->start;
+								batch[n++] = other;
+						}
+						grunBatch(batch,replies,n);
+						for (j = 0; j < n; j++) flightFinish(batch[j],replies[j]);
+				} else {
+						flightFinish(f,grunFlight(f));
+				}
+		}
+}
+
+void fmComplete(fmContext *ctx, int ok) {
+		fmCompletion done;
+		ssize_t nwritten;
+
+		done.ctx = ctx;
+		done.ok = ok;
+		/* Writes this small are atomic, completions are never split. */
+		do {
+				nwritten = write(server.async_pipe[1],&done,sizeof(done));
+		} while (nwritten == -1 && errno == EINTR);
+}
+
+static void flightAsyncHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+		fmCompletion done[64];
+		ssize_t nread;
+		fmFlight *f;
+		int j;
+		REDIS_NOTUSED(el);
+		REDIS_NOTUSED(privdata);
+		REDIS_NOTUSED(mask);
+
+		while ((nread = read(fd,done,sizeof(done))) > 0) {
+				for (j = 0; j < nread/(ssize_t)sizeof(done[0]); j++) {
+						f = (fmFlight*)((char*)done[j].ctx-offsetof(fmFlight,ctx));
+						flightFinish(f,grunAsyncDone(f,done[j].ok));
+				}
+		}
+}
+
+void flightInit(void) {
+		if (pipe(server.async_pipe) == -1) {
+				redisLog(REDIS_WARNING,"Can't create the async pipe: %s",strerror(errno));
+				exit(1);
+		}
+		anetNonBlock(NULL,server.async_pipe[0]);
+		if (aeCreateFileEvent(server.el,server.async_pipe[0],AE_READABLE,
+				flightAsyncHandler,NULL) == AE_ERR) {
+				redisLog(REDIS_WARNING,"Can't watch the async pipe");
+				exit(1);
+		}
+}
+
+sds flightInfoString(sds info, char *name, FMITEM *fm) {
+		if (!(fm->desc.flags & FM_DETERMINISTIC)) return info;
+		return sdscatprintf(info,"flights[%s]=runs:%lld,coalesced:%lld\r\n",
+						name,fm->stat_flights,fm->stat_coalesced);
+}
@@ -0,0 +1,192 @@
+#include "gsh.h"
+
+/*-----------------------------------------------------------------------------
+ * Formula result cache
+ *
+ * A formula flagged FM_DETERMINISTIC gives the same reply to the same
+ * "data", so when the formula-cache directive names it the replies are kept
+ * and repeats are answered without calling it. Entries are keyed by a 64 bit
+ * MurmurHash of the request encoding and "data" bytes as sent; the bytes are
+ * kept too and compared on a hit, so a hash collision is only a slower
+ * lookup. The reply is kept as a shared object holding the whole bulk reply,
+ * a hit is a refcount on the client reply list or a copy to its buffer.
+ *
+ * Every cache has a TTL and a memory budget. Expired entries are dropped
+ * when they are looked up and by sampling from serverCron(). When storing a
+ * result would go over the budget, entries are evicted with the approximated
+ * LRU Redis uses for maxmemory: a few random entries are sampled and the one
+ * idle for longer (by the lru field of the reply object) goes.
+ *----------------------------------------------------------------------------*/
+
+#define FMCACHE_EVICTION_SAMPLES 5
+#define FMCACHE_EXPIRE_SAMPLES 20   /* per cache and cron run */
+
+unsigned int fmCacheHashKey(const void *key) {
+		return (unsigned int)((const fmCacheEntry*)key)->hash;
+}
+
+int fmCacheKeyCompare(void *privdata, const void *key1, const void *key2) {
+		const fmCacheEntry *a = key1, *b = key2;
+
+		DICT_NOTUSED(privdata);
+		return a->hash == b->hash && a->encoding == b->encoding &&
+				a->datalen == b->datalen && !memcmp(a->data,b->data,a->datalen);
+}
+
+static void fmCacheEntryFree(void *privdata, void *key) {
+		fmCacheEntry *e = key;
+
+		DICT_NOTUSED(privdata);
+		zfree(e->data);
+		decrRefCount(e->reply);
+		zfree(e);
+}
+
+static dictType fmCacheDictType = {
+		fmCacheHashKey,             /* hash function */
+		NULL,                       /* key dup */
+		NULL,                       /* val dup */
+		fmCacheKeyCompare,          /* key compare */
+		fmCacheEntryFree,           /* key destructor */
+		NULL                        /* val destructor */
+};
+
+fmCache *fmCacheCreate(time_t ttl, size_t maxmemory) {
+		fmCache *fc = zcalloc(sizeof(*fc));
+
+		fc->entries = dictCreate(&fmCacheDictType,NULL);
+		fc->ttl = ttl;
+		fc->maxmemory = maxmemory;
+		return fc;
+}
+
+void fmCacheFree(fmCache *fc) {
+		dictRelease(fc->entries);
+		zfree(fc);
+}
+
+/* Fill key for the lookup of a request, the data is not copied. */
+void fmCacheKey(fmCacheEntry *key, int encoding, const char *data, size_t len) {
+		key->hash = MurmurHash64A(data,len,(uint64_t)encoding);
+		key->encoding = encoding;
+		key->data = (char*)data;
+		key->datalen = len;
+}
+
+/* Memory an entry takes, as counted against the budget. */
+static size_t fmCacheEntrySize(size_t datalen, robj *reply) {
+		return sizeof(fmCacheEntry)+sizeof(dictEntry)+sizeof(robj)+
+				datalen+zmalloc_size_sds(reply->ptr);
+}
+
+static void fmCacheDelete(fmCache *fc, fmCacheEntry *e) {
+		fc->used -= fmCacheEntrySize(e->datalen,e->reply);
+		dictDelete(fc->entries,e);
+}
+
+static int fmCacheExpired(fmCacheEntry *e) {
+		return e->expire && e->expire <= server.unixtime;
+}
+
+/* Return the cached reply of the request, or NULL. The object belongs to
+ * the cache, use it right away with addReply(). */
+robj *fmCacheLookup(fmCache *fc, fmCacheEntry *key) {
+		dictEntry *de = dictFind(fc->entries,key);
+		fmCacheEntry *e;
+
+		if (de) {
+				e = dictGetEntryKey(de);
+				if (!fmCacheExpired(e)) {
+						e->reply->lru = server.lruclock;
+						fc->stat_hits++;
+						server.stat_cache_hits++;
+						return e->reply;
+				}
+				fmCacheDelete(fc,e);
+		}
+		fc->stat_misses++;
+		server.stat_cache_misses++;
+		return NULL;
+}
+
+/* Evict one entry: an expired one if sampled, else the least recently used
+ * among the samples. */
+static void fmCacheEvict(fmCache *fc) {
+		fmCacheEntry *e, *best = NULL;
+		unsigned long idle, bestidle = 0;
+		int j;
+
+		for (j = 0; j < FMCACHE_EVICTION_SAMPLES; j++) {
+				e = dictGetEntryKey(dictGetRandomKey(fc->entries));
+				if (fmCacheExpired(e)) {
+						fmCacheDelete(fc,e);
+						return;
+				}
+				idle = estimateObjectIdleTime(e->reply);
+				if (!best || idle > bestidle) {
+						best = e;
+						bestidle = idle;
+				}
+		}
+		fmCacheDelete(fc,best);
+		fc->stat_evictions++;
+		server.stat_cache_evictions++;
+}
+
+/* Keep reply as the result of the request whose lookup missed with key.
+ * The cache takes its own reference to reply. */
+void fmCacheStore(fmCache *fc, fmCacheEntry *key, robj *reply) {
+		size_t size = fmCacheEntrySize(key->datalen,reply);
+		fmCacheEntry *e;
+
+		if (size > fc->maxmemory) return;
+		while (fc->used+size > fc->maxmemory && dictSize(fc->entries))
+				fmCacheEvict(fc);
+
+		e = zmalloc(sizeof(*e));
+		*e = *key;
+		e->data = zmalloc(key->datalen ? key->datalen : 1);
+		memcpy(e->data,key->data,key->datalen);
+		e->reply = reply;
+		e->expire = fc->ttl ? server.unixtime+fc->ttl : 0;
+		if (dictAdd(fc->entries,e,NULL) != DICT_OK) {
+				zfree(e->data);
+				zfree(e);
+				return;
+		}
+		incrRefCount(reply);
+		reply->lru = server.lruclock;
+		fc->used += size;
+}
+
+/* Drop some of the expired entries of every cache, so the memory of the
+ * results nobody asks for again is given back without waiting for the
+ * budget to fill up. */
+void fmCacheCron(void) {
+		dictIterator *di = dictGetSafeIterator(server.fms);
+		dictEntry *de;
+		FMITEM *fm;
+		int j;
+
+		while ((de = dictNext(di)) != NULL) {
+				fm = dictGetEntryVal(de);
+				if (!fm->cache || !fm->cache->ttl) continue;
+				for (j = 0; j < FMCACHE_EXPIRE_SAMPLES && dictSize(fm->cache->entries); j++) {
+						fmCacheEntry *e = dictGetEntryKey(dictGetRandomKey(fm->cache->entries));
+
+						if (fmCacheExpired(e)) fmCacheDelete(fm->cache,e);
+				}
+		}
+		dictReleaseIterator(di);
+}
+
+sds fmCacheInfoString(sds info, char *name, FMITEM *fm) {
+		fmCache *fc = fm->cache;
+
+		if (!fc) return info;
+		return sdscatprintf(info,
+						"cache[%s]=entries:%lu,memory:%zu,maxmemory:%zu,ttl:%ld,"
+						"hits:%lld,misses:%lld,evictions:%lld\r\n",
+						name,dictSize(fc->entries),fc->used,fc->maxmemory,(long)fc->ttl,
+						fc->stat_hits,fc->stat_misses,fc->stat_evictions);
+}
@@ -0,0 +1,194 @@
+#include "gsh.h"
+
+/*-----------------------------------------------------------------------------
+ * Formula statistics
+ *
+ * Every formula counts the requests it got, the errors it answered, the
+ * requests shed by admission control or failing its schema and the bytes in
+ * and out, and keeps log-linear histograms (see common/histogram.h) of the
+ * latency of its requests, from the first byte read to the reply, of the
+ * time spent parsing "data" and of the time the formula itself ran. The
+ * statistics belong to the formula name: a reload keeps them, shared by the
+ * new version and the old one while it drains.
+ *
+ * The runs of a formula are also charged the CPU time of the thread running
+ * them and the memory they allocate through zmalloc: what they left
+ * allocated and the most they had at once. Like run_usec, this leaves out
+ * parsing "data", and the reply being written, which the client frees. The
+ * memory a formula gets with malloc() is not seen. A batch is charged as a whole, shared by its calls,
+ * an async call only for handing the request to the formula, and a call
+ * run by a worker in the worker.
+ *
+ *   fmstats                    all the formulas
+ *   fmstats <name>             one of them
+ *   fmstats [<name>] reset     start over
+ *
+ * INFO has a line per formula with the counts and latency percentiles.
+ *----------------------------------------------------------------------------*/
+
+fmStats *fmStatsCreate(void) {
+		fmStats *st = zcalloc(sizeof(*st));
+
+		st->refcount = 1;
+		st->since = time(NULL);
+		return st;
+}
+
+/* Drop the reference of a formula version unloaded. */
+void fmStatsRelease(fmStats *st) {
+		if (--st->refcount == 0) zfree(st);
+}
+
+static void fmStatsReset(fmStats *st) {
+		int refcount = st->refcount;
+
+		memset(st,0,sizeof(*st));
+		st->refcount = refcount;
+		st->since = time(NULL);
+}
+
+void fmStatsRequest(FMITEM *fm, size_t bytes) {
+		fm->stats->calls++;
+		fm->stats->bytes_in += bytes;
+}
+
+void fmStatsReply(FMITEM *fm, long long latency, size_t bytes, int error) {
+		fmStats *st = fm->stats;
+
+		if (error) st->errors++;
+		st->bytes_out += bytes;
+		histRecord(&st->latency,latency < 0 ? 0 : latency);
+}
+
+/* Usage of a run of calls requests, see fmUsage. */
+void fmStatsUsage(FMITEM *fm, fmUsage *u, int calls) {
+		fmStats *st = fm->stats;
+
+		if (u->cpu_us < 0) return;
+		st->runs += calls;
+		st->cpu_us += u->cpu_us;
+		st->mem_net += u->mem_net;
+		st->mem_peak_sum += u->mem_peak;
+		if (u->mem_peak > st->mem_peak) st->mem_peak = u->mem_peak;
+}
+
+/* A reply kept as an object: a bulk reply or an error. */
+void fmStatsReplyObject(FMITEM *fm, long long latency, robj *reply) {
+		char *p = reply->ptr;
+
+		fmStatsReply(fm,latency,p[0] == '$' ? strtoul(p+1,NULL,10) : 0,p[0] == '-');
+}
+
+/* Parsing and running times of a call, -1 for the part it did not have. */
+void fmStatsTimes(FMITEM *fm, long long parse, long long run) {
+		if (parse >= 0) histRecord(&fm->stats->parse,parse);
+		if (run >= 0) histRecord(&fm->stats->run,run);
+}
+
+static sds fmStatsHistogram(sds s, char *name, histogram *h) {
+		return sdscatprintf(s,"%s:count=%llu,mean=%.2f,p50=%llu,p90=%llu,p99=%llu,p999=%llu,max=%llu\r\n",
+						name,(unsigned long long)h->count,histMean(h),
+						(unsigned long long)histPercentile(h,50),
+						(unsigned long long)histPercentile(h,90),
+						(unsigned long long)histPercentile(h,99),
+						(unsigned long long)histPercentile(h,99.9),
+						(unsigned long long)h->max);
+}
+
+static double fmStatsPerCall(fmStats *st, long long total) {
+		return st->runs ? (double)total/st->runs : 0;
+}
+
+static sds fmStatsString(sds s, char *name, fmStats *st) {
+		s = sdscatprintf(s,
+						"formula:%s\r\n"
+						"calls:%lld\r\n"
+						"errors:%lld\r\n"
+						"rejected:%lld\r\n"
+						"invalid:%lld\r\n"
+						"bytes_in:%lld\r\n"
+						"bytes_out:%lld\r\n"
+						"since:%ld\r\n",
+						name,st->calls,st->errors,st->rejected,st->invalid,
+						st->bytes_in,st->bytes_out,(long)st->since);
+		s = fmStatsHistogram(s,"latency_usec",&st->latency);
+		s = fmStatsHistogram(s,"parse_usec",&st->parse);
+		s = fmStatsHistogram(s,"run_usec",&st->run);
+		s = sdscatprintf(s,
+						"runs:%lld\r\n"
+						"cpu_usec:%lld\r\n"
+						"cpu_usec_per_call:%.2f\r\n"
+						"mem_net_bytes:%lld\r\n"
+						"mem_net_bytes_per_call:%.2f\r\n"
+						"mem_peak_bytes:%lld\r\n"
+						"mem_peak_bytes_per_call:%.2f\r\n",
+						st->runs,st->cpu_us,fmStatsPerCall(st,st->cpu_us),
+						st->mem_net,fmStatsPerCall(st,st->mem_net),
+						st->mem_peak,fmStatsPerCall(st,st->mem_peak_sum));
+		return s;
+}
+
+/* fmstats [<name>] [reset] */
+void fmstatsCommand(redisClient *c) {
+		FMITEM *fm = NULL;
+		int reset = 0;
+		dictIterator *di;
+		dictEntry *de;
+		sds s;
+
+		if (c->argc > 3 || (c->argc == 3 && strcasecmp(c->argv[2]->ptr,"reset"))) {
+				addReply(c,shared.syntaxerr);
+				return;
+		}
+		if (c->argc > 1) {
+				fm = dictFetchValue(server.fms,c->argv[1]->ptr);
+				if (!fm && (c->argc == 3 || strcasecmp(c->argv[1]->ptr,"reset"))) {
+						addReplyErrorFormat(c,"formula [%s] is not loaded",(char*)c->argv[1]->ptr);
+						return;
+				}
+				reset = c->argc == 3 || !fm;
+		}
+
+		if (fm && reset) {
+				fmStatsReset(fm->stats);
+				addReply(c,shared.ok);
+		} else if (fm) {
+				s = fmStatsString(sdsempty(),c->argv[1]->ptr,fm->stats);
+				addReplyBulkCString(c,s);
+				sdsfree(s);
+		} else {
+				s = sdsempty();
+				di = dictGetSafeIterator(server.fms);
+				while ((de = dictNext(di)) != NULL) {
+						fm = dictGetEntryVal(de);
+						if (reset) {
+								fmStatsReset(fm->stats);
+								continue;
+						}
+						if (sdslen(s)) s = sdscatlen(s,"\r\n",2);
+						s = fmStatsString(s,dictGetEntryKey(de),fm->stats);
+				}
+				dictReleaseIterator(di);
+				if (reset) addReply(c,shared.ok);
+				else addReplyBulkCString(c,s);
+				sdsfree(s);
+		}
+}
+
+sds fmStatsInfoString(sds info, char *name, FMITEM *fm) {
+		fmStats *st = fm->stats;
+
+		return sdscatprintf(info,
+						"stats[%s]=calls:%lld,errors:%lld,rejected:%lld,invalid:%lld,"
+						"p50:%llu,p99:%llu,p999:%llu,run_p99:%llu,parse_p99:%llu,"
+						"cpu_us:%lld,cpu_us_per_call:%.2f,mem_net:%lld,mem_peak:%lld,"
+						"mem_peak_per_call:%.2f\r\n",
+						name,st->calls,st->errors,st->rejected,st->invalid,
+						(unsigned long long)histPercentile(&st->latency,50),
+						(unsigned long long)histPercentile(&st->latency,99),
+						(unsigned long long)histPercentile(&st->latency,99.9),
+						(unsigned long long)histPercentile(&st->run,99),
+						(unsigned long long)histPercentile(&st->parse,99),
+						st->cpu_us,fmStatsPerCall(st,st->cpu_us),st->mem_net,st->mem_peak,
+						fmStatsPerCall(st,st->mem_peak_sum));
+}
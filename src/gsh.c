@@ -45,6 +45,13 @@ struct redisCommand readonlyCommandTable[] = {
 		{"hget",grunCommand,3,0},
 		{"grun",grunCommand,3,0},
 		{"load",loadCommand,3,0},
+		{"reload",reloadCommand,2,0},
+		{"fmstatus",fmstatusCommand,2,0},
+		{"fmupload",fmuploadCommand,-2,0},
+		{"fmstats",fmstatsCommand,-1,0},
+		{"slowlog",slowlogCommand,-2,0},
+		{"latency",latencyCommand,-2,0},
+		{"profile",profileCommand,-2,0},
 		{"info",infoCommand,1,0}
 };
 
@@ -150,7 +157,7 @@ dictType dbDictType = {
 		dictRedisObjectDestructor   /* val destructor */
 };
 
-/* Command table. sds string -> command struct pointer. */
+/* Formula table. sds string -> formula item pointer. */
 dictType commandTableDictType = {
 		dictSdsCaseHash,           /* hash function */
 		NULL,                      /* key dup */
@@ -166,8 +173,20 @@ void updateLRUClock(void) {
 				REDIS_LRU_CLOCK_MAX;
 }
 
+/* This function gets called every time Redis is entering the
+ * main loop of the event driven library, that is, before to sleep
+ * for ready file descriptors. */
+void beforeSleep(struct aeEventLoop *eventLoop) {
+		REDIS_NOTUSED(eventLoop);
+
+		/* Run the formulas the requests read in this iteration wait for */
+		flightRunPending();
+		latencyEndIteration();
+}
+
 int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 		int j, loops = server.cronloops;
+		int phase = latencyEnterPhase(LATENCY_PHASE_TIMERS);
 		REDIS_NOTUSED(eventLoop);
 		REDIS_NOTUSED(id);
 		REDIS_NOTUSED(clientData);
@@ -222,11 +241,21 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 		 * a lot of memory movements in the parent will cause a lot of pages
 		 * copied. */
 
+		/* Give back the memory of expired formula results */
+		fmCacheCron();
+
+		/* Publish the formulas loaded in the background */
+		fmLoadCron();
+
+		/* Restart the formula workers that died */
+		workerCron();
+
 		/* Close connections of timedout clients */
 		if ((server.maxidletime && !(loops % 100)))
 				closeTimedoutClients();
 
 		server.cronloops++;
+		latencyEnterPhase(phase);
 		return 100;
 }
 
@@ -258,7 +287,11 @@ void createSharedObjects(void) {
 		shared.outofrangeerr = createObject(REDIS_STRING,sdsnew(
 								"-ERR index out of range\r\n"));
 		shared.loadingerr = createObject(REDIS_STRING,sdsnew(
-								"-LOADING Redis is loading the dataset in memory\r\n"));
+								"-LOADING formula is loading, retry later\r\n"));
+		shared.timeouterr = createObject(REDIS_STRING,sdsnew(
+								"-TIMEOUT request deadline exceeded\r\n"));
+		shared.busyerr = createObject(REDIS_STRING,sdsnew(
+								"-BUSY server overloaded, retry later\r\n"));
 		shared.space = createObject(REDIS_STRING,sdsnew(" "));
 		shared.colon = createObject(REDIS_STRING,sdsnew(":"));
 		shared.plus = createObject(REDIS_STRING,sdsnew("+"));
@@ -297,6 +330,15 @@ void initServerConfig() {
 		server.daemonize = 0;
 		server.pidfile = zstrdup("/var/run/redis.pid");
 		server.maxclients = 0;
+		server.admission_target = 0;
+		server.admission_percentile = 99;
+		server.admission_interval = 100;
+		server.slowlog_log_slower_than = REDIS_SLOWLOG_LOG_SLOWER_THAN;
+		server.slowlog_max_len = REDIS_SLOWLOG_MAX_LEN;
+		server.latency_monitor_threshold = 0;
+		server.fm_running = -1;
+		server.trace_file = NULL;
+		server.trace_sample_rate = 0;
 		server.shutdown_asap = 0;
 
 		updateLRUClock();
@@ -307,10 +349,8 @@ void initServerConfig() {
 		R_NegInf = -1.0/R_Zero;
 		R_Nan = R_Zero/R_Zero;
 
-		/* Command table -- we intiialize it here as it is part of the
-		 * initial configuration, since command names may be changed via
-		 * redis.conf using the rename-command directive. */
-		server.commands = dictCreate(&commandTableDictType,NULL);
+		/* Command table -- the slots are filled once here, commands can't be
+		 * renamed from the configuration. */
 		populateCommandTable();
 		server.delCommand = lookupCommandByCString("del");
 		server.multiCommand = lookupCommandByCString("multi");
@@ -325,10 +365,13 @@ void initServerConfig() {
 		//server.formulas = 0;
 		//server.fmnum = 0;
 		server.fms = dictCreate(&commandTableDictType,NULL);
+		server.fmtable = NULL;
+		server.fmcount = 0;
+		server.fmloads = dictCreate(&fmLoadDictType,NULL);
 }
 
 void initServer() {
-		int j;
+		int j, tag;
 
 		signal(SIGHUP, SIG_IGN);
 		signal(SIGPIPE, SIG_IGN);
@@ -342,6 +385,8 @@ void initServer() {
 		server.mainthread = pthread_self();
 		server.current_client = NULL;
 		server.clients = listCreate();
+		server.flights = listCreate();
+		server.pools = listCreate();
 		createSharedObjects();
 		server.el = aeCreateEventLoop();
 		server.db = zmalloc(sizeof(redisDb)*server.dbnum);
@@ -364,12 +409,21 @@ void initServer() {
 		server.dirty = 0;
 		server.stat_numcommands = 0;
 		server.stat_numconnections = 0;
+		server.stat_timedout_requests = 0;
+		server.stat_rejected_requests = 0;
+		server.stat_invalid_requests = 0;
+		server.stat_cache_hits = 0;
+		server.stat_cache_misses = 0;
+		server.stat_cache_evictions = 0;
+		server.stat_coalesced_requests = 0;
 		server.stat_starttime = time(NULL);
 		server.stat_peak_memory = 0;
 		server.unixtime = time(NULL);
 		aeCreateTimeEvent(server.el, 1, serverCron, NULL, NULL);
 		if (server.ipfd > 0 && aeCreateFileEvent(server.el,server.ipfd,AE_READABLE,
 								acceptTcpHandler,NULL) == AE_ERR) oom("creating file event");
+		flightInit();
+		slowlogInit();
 
 		/* 32 bit instances are limited to 4GB of address space, so if there is
 		 * no explicit limit in the user provided configuration we set a limit
@@ -377,7 +431,27 @@ void initServer() {
 		 * useless crashes of the Redis instance. */
 
 		srand(time(NULL)^getpid());
+		tag = zmalloc_set_tag(ZMALLOC_TAG_JSON);
+		server.reqarena = arenaCreate(REDIS_ARENA_CHUNK,REDIS_ARENA_RETAIN);
+		zmalloc_set_tag(tag);
 		gsh_init();
+
+		/* Workers start from the state of the server, formulas included. */
+		workerInit();
+		traceInit();
+}
+
+/* The command table is fixed, so instead of a dict lookup the commands are
+ * placed in a table by a hash of their name and a seed chosen here so that
+ * no two of them share a slot: a lookup is one hash and one compare. */
+static struct redisCommand *commandSlots[REDIS_COMMAND_SLOTS];
+static unsigned int commandSeed;
+
+static unsigned int commandSlot(const char *name, size_t len, unsigned int seed) {
+		unsigned int h = seed;
+
+		while (len--) h = h*33+tolower((unsigned char)*name++);
+		return (h^(h>>7)) & (REDIS_COMMAND_SLOTS-1);
 }
 
 /* Populates the Redis Command Table starting from the hard coded list
@@ -385,29 +459,37 @@ void initServer() {
 void populateCommandTable(void) {
 		int j;
 		int numcommands = sizeof(readonlyCommandTable)/sizeof(struct redisCommand);
+		unsigned int seed;
 
-		for (j = 0; j < numcommands; j++) {
-				struct redisCommand *c = readonlyCommandTable+j;
-				int retval;
+		for (seed = 1; seed; seed++) {
+				memset(commandSlots,0,sizeof(commandSlots));
+				for (j = 0; j < numcommands; j++) {
+						struct redisCommand *c = readonlyCommandTable+j;
+						unsigned int slot = commandSlot(c->name,strlen(c->name),seed);
 
-				retval = dictAdd(server.commands, sdsnew(c->name), c);
-				assert(retval == DICT_OK);
+						if (commandSlots[slot]) break;
+						commandSlots[slot] = c;
+				}
+				if (j == numcommands) break;
 		}
+		assert(seed != 0);
+		commandSeed = seed;
 }
 
-/* ====================== Commands lookup and execution ===================== */
+static struct redisCommand *lookupCommandLen(const char *name, size_t len) {
+		struct redisCommand *cmd = commandSlots[commandSlot(name,len,commandSeed)];
+
+		if (!cmd || strlen(cmd->name) != len || strncasecmp(cmd->name,name,len))
+				return NULL;
+		return cmd;
+}
 
 struct redisCommand *lookupCommand(sds name) {
-		return dictFetchValue(server.commands, name);
+		return lookupCommandLen(name,sdslen(name));
 }
 
 struct redisCommand *lookupCommandByCString(char *s) {
-		struct redisCommand *cmd;
-		sds name = sdsnew(s);
-
-		cmd = dictFetchValue(server.commands, name);
-		sdsfree(name);
-		return cmd;
+		return lookupCommandLen(s,strlen(s));
 }
 
 /* Call() is the core of Redis execution of a command */
@@ -415,23 +497,28 @@ void call(redisClient *c) {
 		long long dirty, start = ustime(), duration;
 
 		dirty = server.dirty;
+		c->fm = NULL;
+		c->parse_us = c->run_us = -1;
 		c->cmd->proc(c);
+		if (c->trace && !(c->flags & REDIS_BLOCKED)) traceQueued(c);
 		dirty = server.dirty-dirty;
 		duration = ustime()-start;
 		server.stat_numcommands++;
+		if (c->fm) {
+				admissionRecord(c->fm,ustime()-c->querytime);
+				slowlogPushEntryIfNeeded(c,duration);
+		}
 }
 
 int processCommand(redisClient *c) {
-		if (!strcasecmp(c->argv[0]->ptr,"quit")) {
+		/* Lookup the command and check ASAP about trivial error conditions
+		 * such as wrong arity, bad command name and so forth. */
+		c->cmd = c->lastcmd = lookupCommand(c->argv[0]->ptr);
+		if (!c->cmd && !strcasecmp(c->argv[0]->ptr,"quit")) {
 				addReply(c,shared.ok);
 				c->flags |= REDIS_CLOSE_AFTER_REPLY;
 				return REDIS_ERR;
-		}
-
-		/* Now lookup the command and check ASAP about trivial error conditions
-		 * such as wrong arity, bad command name and so forth. */
-		c->cmd = c->lastcmd = lookupCommand(c->argv[0]->ptr);
-		if (!c->cmd) {
+		} else if (!c->cmd) {
 				addReplyErrorFormat(c,"unknown command '%s'",
 								(char*)c->argv[0]->ptr);
 				return REDIS_OK;
@@ -457,6 +544,7 @@ int prepareForShutdown() {
 		}
 		/* Close the listening sockets. Apparently this allows faster restarts. */
 		if (server.ipfd != -1) close(server.ipfd);
+		destroyFormulas();
 
 		redisLog(REDIS_WARNING,"Redis is now ready to exit, bye bye...");
 		return REDIS_OK;
@@ -495,6 +583,8 @@ sds genRedisInfoString(void) {
 		char hmem[64], peak_hmem[64];
 		struct rusage self_ru, c_ru;
 		unsigned long lol, bib;
+		size_t used[ZMALLOC_TAGS];
+		int tag;
 
 		getrusage(RUSAGE_SELF, &self_ru);
 		getrusage(RUSAGE_CHILDREN, &c_ru);
@@ -528,6 +618,17 @@ sds genRedisInfoString(void) {
 						"changes_since_last_save:%lld\r\n"
 						"total_connections_received:%lld\r\n"
 						"total_commands_processed:%lld\r\n"
+						"timedout_requests:%lld\r\n"
+						"rejected_requests:%lld\r\n"
+						"invalid_requests:%lld\r\n"
+						"cache_hits:%lld\r\n"
+						"cache_misses:%lld\r\n"
+						"cache_evictions:%lld\r\n"
+						"coalesced_requests:%lld\r\n"
+						"formula_reloads:%lld\r\n"
+						"formulas_draining:%d\r\n"
+						"request_arena_size:%zu\r\n"
+						"request_arena_peak:%zu\r\n"
 						,REDIS_VERSION,
 				server.arch_bits,
 				aeGetApiName(),
@@ -555,9 +656,26 @@ sds genRedisInfoString(void) {
 				ZMALLOC_LIB,
 				server.dirty,
 				server.stat_numconnections,
-				server.stat_numcommands
+				server.stat_numcommands,
+				server.stat_timedout_requests,
+				server.stat_rejected_requests,
+				server.stat_invalid_requests,
+				server.stat_cache_hits,
+				server.stat_cache_misses,
+				server.stat_cache_evictions,
+				server.stat_coalesced_requests,
+				server.stat_reloads,
+				server.fms_draining,
+				server.reqarena->size,
+				server.reqarena->peak
 						);
 
+		/* used_memory by allocation tag, see zmalloc_set_tag(). */
+		zmalloc_used_by_tag(used);
+		for (tag = 0; tag < ZMALLOC_TAGS; tag++)
+				info = sdscatprintf(info,"used_memory_%s:%zu\r\n",zmalloc_tag_name(tag),used[tag]);
+		info = traceInfoString(info);
+
 		dictIterator *di;
 		dictEntry *de;
 		di = dictGetSafeIterator(server.fms);
@@ -565,7 +683,15 @@ sds genRedisInfoString(void) {
 		while((de = dictNext(di)) != NULL) 
 		{
 				sds key = dictGetEntryKey(de);
+				FMITEM *fm = dictGetEntryVal(de);
 				info = sdscatprintf(info, "formulas[%d]=[%s]\r\n",j++,key);
+				info = sdscatprintf(info, "version[%s]=%d,abi:%d\r\n",
+								key,fm->version,fm->desc.abi);
+				info = admissionInfoString(info,key,dictGetEntryVal(de));
+				info = fmCacheInfoString(info,key,dictGetEntryVal(de));
+				info = flightInfoString(info,key,dictGetEntryVal(de));
+				info = workerInfoString(info,key,dictGetEntryVal(de));
+				info = fmStatsInfoString(info,key,dictGetEntryVal(de));
 		}
 		dictReleaseIterator(di);
 		/*int j;
@@ -678,13 +804,16 @@ int main(int argc, char **argv) {
 		if (server.ipfd > 0)
 				redisLog(REDIS_NOTICE,"The server is now ready to accept connections on port %d", server.port);
 
+		aeSetBeforeSleepProc(server.el,beforeSleep);
+		aeSetAfterSleepProc(server.el,latencyAfterSleep);
+		latencyInit();
 		aeMain(server.el);
 		aeDeleteEventLoop(server.el);
 		return 0;
 }
 
 #ifdef HAVE_BACKTRACE
-static void *getMcontextEip(ucontext_t *uc) {
+void *getMcontextEip(ucontext_t *uc) {
 #if defined(__FreeBSD__)
 		return (void*) uc->uc_mcontext.mc_eip;
 #elif defined(__dietlibc__)
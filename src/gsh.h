@@ -22,6 +22,11 @@
 #include "common/adlist.h" /* Linked lists */
 #include "common/zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "common/util.h"
+#include "common/histogram.h"
+#include "common/arena.h"
+#include "common/jsonw.h"
+#include "common/sjson.h"
+#include "common/formula.h"
 #include <dlfcn.h>
 /* Error codes */
 #define REDIS_OK                0
@@ -41,6 +46,11 @@
 #define REDIS_REPLY_CHUNK_BYTES (5*1500) /* 5 TCP packets with default MTU */
 #define REDIS_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define REDIS_MAX_LOGMSG_LEN    4096 /* Default maximum length of syslog messages */
+#define REDIS_ARENA_CHUNK       (1024*64) /* Request arena chunk size */
+#define REDIS_ARENA_RETAIN      (1024*1024*8) /* Max arena size kept between requests */
+#define REDIS_COMMAND_SLOTS     64 /* Perfect hash of the command table, power of 2 */
+#define REDIS_SLOWLOG_LOG_SLOWER_THAN 10000 /* us */
+#define REDIS_SLOWLOG_MAX_LEN   128
 
 /* Object types */
 #define REDIS_STRING 0
@@ -52,6 +62,7 @@
 #define REDIS_ENCODING_INT 1     /* Encoded as integer */
 
 /* Client flags */
+#define REDIS_BLOCKED 16 /* The client is waiting a single flight */
 #define REDIS_CLOSE_AFTER_REPLY 128 /* Close after writing entire reply. */
 
 /* Client request types */
@@ -73,6 +84,10 @@
 void _redisAssert(char *estr, char *file, int line);
 void _redisPanic(char *msg, char *file, int line);
 void bugReportStart(void);
+#ifdef HAVE_BACKTRACE
+#include <ucontext.h>
+void *getMcontextEip(ucontext_t *uc);
+#endif
 
 /*-----------------------------------------------------------------------------
  * Data types
@@ -127,6 +142,271 @@ typedef struct blockingState {
 								 * for BRPOPLPUSH. */
 } blockingState;
 
+/* A grun envelope as found by parseEnvelope(), see envelope.c. Spans point
+ * inside the request argument and are not nul terminated. */
+#define ENVELOPE_DEADLINE 1
+#define ENVELOPE_TIMEOUT 2
+#define ENVELOPE_TRACE 4            /* "trace":true */
+
+#define ENVELOPE_JSON 0
+#define ENVELOPE_MSGPACK 1
+
+typedef struct envelope {
+		const char *formula;        /* formula name, without the quotes, never escaped */
+		size_t formulalen;
+		const char *data;           /* the whole "data" object */
+		size_t datalen;
+		int flags;                  /* ENVELOPE_* fields present */
+		int encoding;               /* ENVELOPE_JSON or ENVELOPE_MSGPACK */
+		double deadline_ms;
+		double timeout;
+		char *err;                  /* what was wrong, on error */
+} envelope;
+
+/* Latency samples kept per admission interval, see admission.c */
+#define REDIS_ADMISSION_SAMPLES 256
+
+typedef struct admissionState {
+		long long window_end;       /* ustime() the current interval closes */
+		long long seen;             /* requests completed in this interval */
+		int nsamples;
+		long long samples[REDIS_ADMISSION_SAMPLES]; /* sojourn times (us) */
+		long long latency;          /* percentile of the last interval (us) */
+		double reject;              /* probability of answering -BUSY */
+		int queued;                 /* requests waiting on a flight */
+		long long queued_since;     /* ustime() queued last became non zero */
+		long long stat_rejected;
+} admissionState;
+
+/* Counters and latency histograms of a formula, see fmstats.c */
+typedef struct fmStats {
+		long long calls;            /* grun requests to the formula */
+		long long errors;           /* answered with an error */
+		long long rejected;         /* shed by admission control */
+		long long invalid;          /* failing the schema */
+		long long bytes_in;         /* of the grun requests */
+		long long bytes_out;        /* of the replies, payload only */
+		histogram latency;          /* request arrival to reply (us) */
+		histogram parse;            /* parsing "data" (us) */
+		histogram run;              /* the formula itself, parsing aside (us) */
+		long long runs;             /* calls charged their usage, see fmUsage */
+		long long cpu_us;           /* thread CPU time of the runs */
+		long long mem_net;          /* bytes the runs left allocated */
+		long long mem_peak;         /* the largest peak of a run */
+		long long mem_peak_sum;     /* for the average peak */
+		time_t since;               /* of the last reset */
+		int refcount;               /* versions of the formula sharing them */
+} fmStats;
+
+/* What running a formula cost the thread running it: its CPU time and the
+ * bytes it allocated through zmalloc (see zmalloc_scope_begin()). cpu_us is
+ * -1 when the formula did not run. */
+typedef struct fmUsage {
+		long long cpu_us;
+		long long mem_net;          /* left allocated */
+		long long mem_peak;         /* allocated at once, at most */
+} fmUsage;
+
+/* A formula request schema compiled by schemaCompile(), see schema.c */
+typedef struct fmSchemaHit {
+		int member;                 /* position of the member in "data" */
+		int field;                  /* schema field it matched */
+} fmSchemaHit;
+
+typedef struct fmSchema {
+		fmField *fields;
+		int nfields;
+		unsigned long long required; /* bit i set: fields[i] is required */
+		unsigned int mask;          /* slots-1 */
+		unsigned char *slots;       /* name hash -> field index+1, 0 = free */
+		int nhits;                  /* fields found in the current request */
+		fmSchemaHit hits[FM_SCHEMA_MAX_FIELDS];
+		void *resolved[FM_SCHEMA_MAX_FIELDS]; /* ctx->fields */
+		char err[128];              /* why the last request was rejected */
+} fmSchema;
+
+/* Result cache of a deterministic formula, see fmcache.c */
+typedef struct fmCacheEntry {
+		uint64_t hash;              /* of the encoding and the data */
+		int encoding;               /* ENVELOPE_* of the request */
+		char *data;                 /* the "data" of the request */
+		size_t datalen;
+		robj *reply;                /* the whole reply, protocol included */
+		time_t expire;              /* unix time, 0 = never */
+} fmCacheEntry;
+
+typedef struct fmCache {
+		dict *entries;              /* fmCacheEntry -> NULL */
+		time_t ttl;                 /* seconds, 0 = no expiry */
+		size_t maxmemory;           /* budget of the entries */
+		size_t used;                /* memory taken by the entries */
+		long long stat_hits;
+		long long stat_misses;
+		long long stat_evictions;
+} fmCache;
+
+/* A formula run shared by identical requests, see flight.c */
+#define FM_BATCH_MAX 64             /* requests handed to one batch call */
+
+typedef struct fmFlight {
+		fmCacheEntry key;           /* the request, key.data owned by the flight */
+		struct fmitem *fm;
+		list *waiters;              /* fmWaiter, in arrival order */
+		fmContext ctx;              /* of batch and async calls */
+		void *dom;                  /* "data" of an async call, heap cJSON */
+		void **fields;              /* ctx.fields, owned by the flight */
+		long long parse_us;         /* of the run, -1 when not parsed */
+		long long run_us;           /* of the run, -1 when not run */
+		fmUsage usage;              /* of the run */
+		long long start, end;       /* ustime() of the run, for tracing */
+} fmFlight;
+
+typedef struct fmWaiter {
+		struct redisClient *client;
+		long long querytime;        /* of its request, for admission control */
+		long long deadline;         /* ustime() it gives up at, 0 for never */
+} fmWaiter;
+
+/* Worker processes running a formula, see worker.c */
+#define FM_WORKERS_MAX 64           /* per formula */
+
+typedef struct fmWorker {
+		pid_t pid;                  /* 0 when not running */
+		struct fmRing *req;         /* requests, server to worker */
+		struct fmRing *rep;         /* replies, worker to server */
+		list *inflight;             /* fmFlight sent, in order */
+		sds partial;                /* reply records read so far, see worker.c */
+		long long stat_requests;
+} fmWorker;
+
+typedef struct fmWorkerPool {
+		sds name;                   /* of the formula, for the logs */
+		struct fmitem *fm;
+		int n;
+		fmWorker *workers;
+		long long stat_crashes;
+} fmWorkerPool;
+
+/* A loaded formula: the descriptor exported by lib<name>.so, or the one
+ * built from the symbols of an old style formula, and the server side state
+ * kept for it. */
+typedef int formuaProc(void*,void*);
+
+typedef struct fmitem {
+		void *handle;               /* of dlopen() */
+		int id;                     /* index in server.fmtable, see addfm() */
+		sds name;                   /* its key in server.fms, not owned */
+		int version;                /* 1 when loaded, +1 on every reload */
+		int refcount;               /* flights of this version not landed */
+		int retired;                /* replaced by reload, draining */
+		fmDescriptor desc;
+		formuaProc *legacyinit;     /* gsh_formula_<name>_init of old formulas */
+		formuaProc *legacyrun;      /* gsh_formula_<name>_run, desc.run unset */
+		int noadmission;            /* exempt from admission control */
+		admissionState adm;
+		fmSchema *schema;           /* compiled desc.schema */
+		fmStats *stats;             /* kept across reloads, shared while draining */
+		fmCache *cache;             /* results, NULL when not cached */
+		dict *flights;              /* requests in flight, deterministic only */
+		int nworkers;               /* processes to run it in, 0 = inline */
+		fmWorkerPool *pool;         /* its workers when nworkers */
+		long long stat_flights;     /* runs of the formula shared by requests */
+		long long stat_coalesced;   /* requests that joined a run in flight */
+} FMITEM;
+
+/* A formula loading on a background thread, see loader.c */
+#define FM_LOAD_RUNNING 0
+#define FM_LOAD_READY   1
+#define FM_LOAD_FAILED  2
+
+typedef struct fmLoadJob {
+		sds name;
+		int version;
+		int reload;                 /* replaces the version serving */
+		int state;                  /* FM_LOAD_*, of the main thread */
+		int done;                   /* set by the loader thread */
+		FMITEM *it;                 /* the loaded formula, NULL on failure */
+		char err[256];              /* why it failed */
+		long long start, end;       /* ustime() */
+} fmLoadJob;
+
+/* A formula library being uploaded by a client, see upload.c */
+typedef struct fmUpload {
+		sds name;
+		sds tmpfile;                /* written as the chunks come */
+		int fd;
+		size_t size;                /* announced by fmupload begin */
+		size_t written;
+		uint32_t crc;               /* of the bytes written */
+		uint32_t expected;
+} fmUpload;
+
+/* A grun call slower than slowlog-log-slower-than, see slowlog.c */
+#define SLOWLOG_PAYLOAD_MAX 128     /* bytes of the request kept */
+
+typedef struct slowlogEntry {
+		long long id;               /* unique, growing */
+		time_t time;                /* unix time it was logged */
+		long long duration;         /* microseconds */
+		long long parse;            /* parsing "data", -1 when not parsed */
+		long long run;              /* running the formula, -1 when not run */
+		long long reply;            /* the rest, -1 for a flight */
+		sds formula;
+		sds payload;                /* the request, truncated */
+		sds addr;                   /* ip:port of the client */
+} slowlogEntry;
+
+/* Where an iteration of the event loop spends its time, see latency.c */
+#define LATENCY_PHASE_POLL      0   /* waiting in epoll_wait */
+#define LATENCY_PHASE_TIMERS    1   /* time events */
+#define LATENCY_PHASE_READ      2   /* reading and running commands */
+#define LATENCY_PHASE_FORMULA   3   /* inside a formula */
+#define LATENCY_PHASE_WRITE     4   /* writing replies */
+#define LATENCY_PHASE_OTHER     5   /* flights, workers, the rest */
+#define LATENCY_PHASES          6
+#define LATENCY_HISTORY_LEN     160 /* slow iterations kept per phase */
+
+typedef struct latencySample {
+		time_t time;
+		long long duration;         /* us, the poll wait aside */
+		long long phase[LATENCY_PHASES]; /* us in each */
+} latencySample;
+
+/* The slow iterations a phase dominated. */
+typedef struct latencySeries {
+		int idx;                    /* of the next sample */
+		long long count;            /* samples taken, kept or not */
+		long long max;
+		latencySample samples[LATENCY_HISTORY_LEN];
+} latencySeries;
+
+typedef struct latencyMonitor {
+		int phase;                  /* the current one */
+		long long start;            /* ustime() it was entered */
+		long long cur[LATENCY_PHASES];   /* of the current iteration */
+		long long total[LATENCY_PHASES]; /* of all the iterations */
+		long long iterations;
+		latencySeries series[LATENCY_PHASES];
+} latencyMonitor;
+
+/* The stages of a traced grun request, see trace.c */
+#define TRACE_READ      0           /* first byte read */
+#define TRACE_PARSED    1           /* envelope parsed */
+#define TRACE_FM_START  2
+#define TRACE_FM_END    3
+#define TRACE_QUEUED    4           /* reply queued */
+#define TRACE_WRITTEN   5           /* last byte of the reply written */
+#define TRACE_STAGES    6
+
+typedef struct traceRecord {
+		long long id;
+		int fd;                     /* of the client, its lane in the trace */
+		long long ts[TRACE_STAGES]; /* ustime(), 0 for the stages not reached */
+		long long parse_us, run_us; /* -1 when not parsed or not run */
+		unsigned long long mark;    /* bytes queued to the client with the reply */
+		char formula[32];
+} traceRecord;
+
 /* With multiplexing we need to take per-clinet state.
  * Clients are taken in a liked list. */
 typedef struct redisClient {
@@ -137,6 +417,17 @@ typedef struct redisClient {
 		int argc;
 		robj **argv;
 		struct redisCommand *cmd, *lastcmd;
+		FMITEM *fm;             /* formula that served the current command */
+		long long parse_us;     /* of the current grun when inline, -1 when not parsed */
+		long long run_us;       /* of the current grun when inline, -1 when not run */
+		sds fmname;             /* last formula name grun looked up... */
+		int fmid;               /* ...and its id, see lookupFormula() */
+		fmFlight *flight;       /* the flight waited for when REDIS_BLOCKED */
+		fmUpload *upload;       /* fmupload in progress, NULL if none */
+		traceRecord *trace;     /* the current request when traced */
+		list *traces;           /* traced requests whose reply is being written */
+		unsigned long long bytes_queued; /* reply bytes queued so far... */
+		unsigned long long bytes_sent;   /* ...and written */
 		int reqtype;
 		int multibulklen;       /* number of multi bulk arguments left to read */
 		long bulklen;           /* length of bulk argument in multi bulk request */
@@ -144,6 +435,7 @@ typedef struct redisClient {
 		unsigned long reply_bytes; /* Tot bytes of objects in reply list */
 		int sentlen;
 		time_t lastinteraction; /* time of the last interaction, used for timeout */
+		long long querytime;    /* ustime() when parsing the pending command began */
 		int flags;              /* REDIS_SLAVE | REDIS_MONITOR | REDIS_MULTI ... */
 
 		/* Response buffer */
@@ -155,7 +447,7 @@ struct sharedObjectsStruct {
 		robj *crlf, *ok, *err, *emptybulk, *czero, *cone, *cnegone, *pong, *space,
 			 *colon, *nullbulk, *nullmultibulk, *queued,
 			 *emptymultibulk, *wrongtypeerr, *nokeyerr, *syntaxerr, *sameobjecterr,
-			 *outofrangeerr, *loadingerr, *plus,
+			 *outofrangeerr, *loadingerr, *timeouterr, *busyerr, *plus,
 			 *select[REDIS_SHARED_SELECT_CMDS],
 			 *messagebulk, *pmessagebulk, *subscribebulk, *unsubscribebulk, *mbulk3,
 			 *mbulk4, *psubscribebulk, *punsubscribebulk,
@@ -173,11 +465,11 @@ struct redisServer {
 		long long dirty;            /* changes to DB from the last save */
 		long long dirty_before_bgsave; /* used to restore dirty on failed BGSAVE */
 		list *clients;
-		dict *commands;             /* Command table hash table */
 		/* Fast pointers to often looked up command */
 		struct redisCommand *delCommand, *multiCommand;
 		//    list *slaves, *monitors;
 		redisClient *current_client; /* Current client, only used on crash report */
+		volatile int fm_running;     /* id of the formula the main thread runs, -1 if none */
 		char neterr[ANET_ERR_LEN];
 		aeEventLoop *el;
 		int cronloops;              /* number of times the cron function run */
@@ -185,6 +477,14 @@ struct redisServer {
 		time_t stat_starttime;          /* server start time */
 		long long stat_numcommands;     /* number of processed commands */
 		long long stat_numconnections;  /* number of connections received */
+		long long stat_timedout_requests; /* grun requests skipped after their deadline */
+		long long stat_rejected_requests; /* grun requests shed with -BUSY */
+		long long stat_invalid_requests; /* grun requests failing the formula schema */
+		long long stat_cache_hits;      /* grun requests answered from a result cache */
+		long long stat_cache_misses;    /* cacheable grun requests not in the cache */
+		long long stat_cache_evictions; /* results dropped to stay under a budget */
+		long long stat_coalesced_requests; /* grun requests that joined one in flight */
+		long long stat_reloads;         /* formulas replaced by reload */
 		size_t stat_peak_memory;        /* max used memory record */
 		/* Configuration */
 		int verbosity;
@@ -200,6 +500,21 @@ struct redisServer {
 		int syslog_facility;
 		/* Limits */
 		unsigned int maxclients;
+		/* Admission control */
+		long long admission_target;    /* latency target in us, 0 = disabled */
+		int admission_percentile;      /* percentile compared to the target */
+		int admission_interval;        /* control interval in milliseconds */
+		/* Slow log */
+		list *slowlog;                 /* slowlogEntry, newest first */
+		long long slowlog_entry_id;    /* id of the next entry */
+		long long slowlog_log_slower_than; /* in us, negative = disabled */
+		unsigned long slowlog_max_len; /* entries kept */
+		/* Latency monitor */
+		long long latency_monitor_threshold; /* in us, 0 = disabled */
+		latencyMonitor latency;
+		/* Request tracing */
+		char *trace_file;              /* NULL = disabled */
+		long long trace_sample_rate;   /* 1 in n requests, 0 = only asked for */
 		/* Blocked clients */
 		time_t unixtime;    /* Unix time sampled every second. */
 		unsigned lruclock:22;        /* clock incrementing every minute, for LRU */
@@ -210,6 +525,14 @@ struct redisServer {
 		int assert_line;
 		int bug_report_start; /* True if bug report header already logged. */
 		dict *fms;             /* formulas hash table */
+		FMITEM **fmtable;      /* formula serving each id */
+		int fmcount;           /* ids given so far */
+		arena *reqarena;       /* per request memory, reset after the reply */
+		list *flights;         /* flights to run before sleeping */
+		int async_pipe[2];     /* fmComplete() to the event loop */
+		int fms_draining;      /* reloaded formula versions still in use */
+		dict *fmloads;         /* fmLoadJob by formula name, see loader.c */
+		list *pools;           /* fmWorkerPool of every version, see worker.c */
 };
 
 
@@ -232,6 +555,11 @@ extern struct redisServer server;
 extern struct sharedObjectsStruct shared;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 dictType hashDictType;
+unsigned int dictSdsHash(const void *key);
+unsigned int dictSdsCaseHash(const void *key);
+int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
+void dictSdsDestructor(void *privdata, void *val);
+int dictSdsKeyCaseCompare(void *privdata, const void *key1, const void *key2);
 
 /*-----------------------------------------------------------------------------
  * Functions prototypes
@@ -245,8 +573,11 @@ void resetClient(redisClient *c);
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void addReply(redisClient *c, robj *obj);
 void addReplySds(redisClient *c, sds s);
+size_t zmalloc_size_sds(sds s);
 void addReplyBulkCBuffer(redisClient *c, void *p, size_t len);
+void addReplyMultiBulkLen(redisClient *c, long length);
 void addReplyBulkCString(redisClient *c, char *s);
+void addReplyJson(redisClient *c, jsonw *w);
 void processInputBuffer(redisClient *c);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask);
@@ -257,6 +588,7 @@ void getClientsMaxBuffers(unsigned long *longest_output_list,unsigned long *bigg
 sds getClientInfoString(redisClient *client);
 sds getAllClientsInfoString(void);
 void addReplyLongLong(redisClient *c, long long ll);
+void addReplyStatus(redisClient *c, char *status);
 
 #ifdef __GNUC__
 void addReplyErrorFormat(redisClient *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
@@ -275,6 +607,7 @@ robj *createStringObject(char *ptr, size_t len);
 robj *dupStringObject(robj *o);
 robj *getDecodedObject(robj *o);
 int getLongFromObjectOrReply(redisClient *c, robj *o, long *target, const char *msg);
+unsigned long estimateObjectIdleTime(robj *o);
 
 
 /* Core functions */
@@ -289,13 +622,118 @@ void usage();
 void oom(const char *msg);
 void populateCommandTable(void);
 
+/* Admission control */
+int admissionAllow(FMITEM *fm);
+void admissionQueued(FMITEM *fm, int delta);
+void admissionRecord(FMITEM *fm, long long latency);
+sds admissionInfoString(sds info, char *name, FMITEM *fm);
+
+/* Formula result cache */
+fmCache *fmCacheCreate(time_t ttl, size_t maxmemory);
+void fmCacheFree(fmCache *fc);
+unsigned int fmCacheHashKey(const void *key);
+int fmCacheKeyCompare(void *privdata, const void *key1, const void *key2);
+void fmCacheKey(fmCacheEntry *key, int encoding, const char *data, size_t len);
+robj *fmCacheLookup(fmCache *fc, fmCacheEntry *key);
+void fmCacheStore(fmCache *fc, fmCacheEntry *key, robj *reply);
+void fmCacheCron(void);
+sds fmCacheInfoString(sds info, char *name, FMITEM *fm);
+
+/* Single flight */
+fmFlight *flightFind(FMITEM *fm, fmCacheEntry *key);
+void flightJoin(redisClient *c, FMITEM *fm, fmCacheEntry *key, long long deadline);
+void flightLeave(redisClient *c);
+void flightInit(void);
+void flightRunPending(void);
+void flightFinish(fmFlight *f, robj *reply);
+int flightExpire(fmFlight *f);
+sds flightInfoString(sds info, char *name, FMITEM *fm);
+
+/* Formula statistics */
+fmStats *fmStatsCreate(void);
+void fmStatsRelease(fmStats *st);
+void fmStatsRequest(FMITEM *fm, size_t bytes);
+void fmStatsReply(FMITEM *fm, long long latency, size_t bytes, int error);
+void fmStatsReplyObject(FMITEM *fm, long long latency, robj *reply);
+void fmStatsTimes(FMITEM *fm, long long parse, long long run);
+void fmStatsUsage(FMITEM *fm, fmUsage *u, int calls);
+void fmstatsCommand(redisClient *c);
+sds fmStatsInfoString(sds info, char *name, FMITEM *fm);
+
+/* Slow log */
+void slowlogInit(void);
+void slowlogFreeEntry(void *ptr);
+void slowlogPushEntryIfNeeded(redisClient *c, long long duration);
+void slowlogPushFlight(fmFlight *f);
+void slowlogCommand(redisClient *c);
+
+/* Latency monitor */
+void latencyInit(void);
+int latencyEnterPhase(int phase);
+void latencyAfterSleep(struct aeEventLoop *eventLoop);
+void latencyEndIteration(void);
+void latencyCommand(redisClient *c);
+
+/* Sampling profiler */
+void profileCommand(redisClient *c);
+
+/* Request tracing */
+void traceInit(void);
+void traceStart(redisClient *c, envelope *env);
+void traceQueued(redisClient *c);
+void traceWritten(redisClient *c);
+void traceFreeClient(redisClient *c);
+sds traceInfoString(sds info);
+
+/* Background formula loading */
+extern dictType fmLoadDictType;
+void fmLoadStart(redisClient *c, sds name, int version, int reload);
+int fmLoading(sds name);
+int fmLoadRunning(sds name);
+void fmLoadCron(void);
+void fmstatusCommand(redisClient *c);
+
+/* Formula upload */
+int fmValidName(sds name);
+void fmInstall(redisClient *c, sds name, char *tmp, int replace);
+void uploadAbort(redisClient *c);
+void fmuploadCommand(redisClient *c);
+
+/* Formula workers */
+void workerInit(void);
+void workerStart(sds name, FMITEM *fm);
+void workerStop(FMITEM *fm);
+int workerSubmit(fmFlight *f, robj **reply);
+void workerCron(void);
+sds workerInfoString(sds info, char *name, FMITEM *fm);
+
+/* Formula request schemas */
+fmSchema *schemaCompile(fmField *fields, char **err);
+void schemaFree(fmSchema *s);
+int schemaValidate(fmSchema *s, sjsonParser *p);
+void **schemaResolve(fmSchema *s, cJSON *data);
+
+/* grun envelope */
+int parseEnvelope(const char *buf, size_t len, envelope *env);
+
 /* Configuration */
 void loadServerConfig(char *filename);
 int selectDb(redisClient *c, int id);
 
-void* loadfm(char *f_name);
+void* loadfm(char *f_name, int version, char *err, size_t errlen);
+void unloadfm(FMITEM *it);
+void releasefm(FMITEM *it);
+void swapfm(sds name, FMITEM *it);
+int addfm(sds name, FMITEM *it);
+FMITEM *lookupFormula(redisClient *c, const char *name, size_t len);
+void reloadCommand(redisClient *c);
 void setCommand(redisClient *c);
 void grunCommand(redisClient *c);
+robj *grunFlight(fmFlight *f);
+void grunBatch(fmFlight **f, robj **replies, int n);
+int grunAsync(fmFlight *f, robj **reply);
+robj *grunAsyncDone(fmFlight *f, int ok);
+void destroyFormulas(void);
 void loadCommand(redisClient *c);
 void getCommand(redisClient *c);
 void gsh_init();
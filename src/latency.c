@@ -0,0 +1,229 @@
+#include "gsh.h"
+
+/*-----------------------------------------------------------------------------
+ * Latency monitor
+ *
+ * Every iteration of the event loop is split in phases: the wait in
+ * epoll_wait, the time events, reading and running the commands of the
+ * clients, the formulas themselves, writing the replies and the rest
+ * (flights, worker replies, async completions). The code entering a phase
+ * calls latencyEnterPhase(), which charges the time since the last call to
+ * the phase being left, and puts the old phase back when done.
+ *
+ * An iteration ends in beforeSleep(). The wait for events is idle time, so
+ * it is not part of the duration of an iteration: when the rest took
+ * latency-monitor-threshold microseconds or more, the iteration is kept,
+ * with the time of every phase, in the series of the phase that took most
+ * of it.
+ *
+ *   latency latest             the last and the worst iteration of a phase
+ *   latency history <phase>    its slow iterations, the oldest first
+ *   latency reset              forget them
+ *   latency doctor             a report, in plain words
+ *
+ * A sample of latency history is the unix time, the duration and the time
+ * of each phase, in the order of latencyPhaseNames. Times are microseconds.
+ *----------------------------------------------------------------------------*/
+
+static char *latencyPhaseNames[LATENCY_PHASES] = {
+		"poll", "timers", "read", "formula", "write", "other"
+};
+
+void latencyInit(void) {
+		memset(&server.latency,0,sizeof(server.latency));
+		server.latency.phase = LATENCY_PHASE_OTHER;
+		server.latency.start = ustime();
+}
+
+/* Returns the phase left, to be entered again when the new one is done. */
+int latencyEnterPhase(int phase) {
+		latencyMonitor *lm = &server.latency;
+		int old = lm->phase;
+		long long now;
+
+		if (server.latency_monitor_threshold) {
+				now = ustime();
+				lm->cur[old] += now-lm->start;
+				lm->start = now;
+		}
+		lm->phase = phase;
+		return old;
+}
+
+void latencyAfterSleep(struct aeEventLoop *eventLoop) {
+		REDIS_NOTUSED(eventLoop);
+		latencyEnterPhase(LATENCY_PHASE_OTHER);
+}
+
+static void latencyAddSample(latencySeries *ls, long long duration, long long *phase) {
+		latencySample *s = &ls->samples[ls->idx];
+
+		s->time = time(NULL);
+		s->duration = duration;
+		memcpy(s->phase,phase,sizeof(s->phase));
+		ls->idx = (ls->idx+1)%LATENCY_HISTORY_LEN;
+		ls->count++;
+		if (duration > ls->max) ls->max = duration;
+}
+
+/* Called last before waiting for events: the iteration is over. */
+void latencyEndIteration(void) {
+		latencyMonitor *lm = &server.latency;
+		long long busy = 0;
+		int j, top = LATENCY_PHASE_OTHER;
+
+		if (!server.latency_monitor_threshold) return;
+		latencyEnterPhase(LATENCY_PHASE_POLL);
+		for (j = 0; j < LATENCY_PHASES; j++) {
+				lm->total[j] += lm->cur[j];
+				if (j == LATENCY_PHASE_POLL) continue;
+				busy += lm->cur[j];
+				if (lm->cur[j] > lm->cur[top]) top = j;
+		}
+		lm->iterations++;
+		if (busy >= server.latency_monitor_threshold)
+				latencyAddSample(&lm->series[top],busy,lm->cur);
+		memset(lm->cur,0,sizeof(lm->cur));
+}
+
+static int latencyPhaseByName(char *name) {
+		int j;
+
+		for (j = 0; j < LATENCY_PHASES; j++)
+				if (!strcasecmp(name,latencyPhaseNames[j])) return j;
+		return -1;
+}
+
+/* The samples kept, the newest last. */
+static int latencySamples(latencySeries *ls) {
+		return ls->count < LATENCY_HISTORY_LEN ? (int)ls->count : LATENCY_HISTORY_LEN;
+}
+
+static latencySample *latencyGetSample(latencySeries *ls, int j) {
+		return &ls->samples[(ls->idx-latencySamples(ls)+j+LATENCY_HISTORY_LEN)%LATENCY_HISTORY_LEN];
+}
+
+static void latencyLatest(redisClient *c) {
+		latencyMonitor *lm = &server.latency;
+		latencySample *s;
+		int j, n = 0;
+
+		for (j = 0; j < LATENCY_PHASES; j++)
+				if (lm->series[j].count) n++;
+		addReplyMultiBulkLen(c,n);
+		for (j = 0; j < LATENCY_PHASES; j++) {
+				latencySeries *ls = &lm->series[j];
+
+				if (!ls->count) continue;
+				s = latencyGetSample(ls,latencySamples(ls)-1);
+				addReplyMultiBulkLen(c,4);
+				addReplyBulkCString(c,latencyPhaseNames[j]);
+				addReplyLongLong(c,s->time);
+				addReplyLongLong(c,s->duration);
+				addReplyLongLong(c,ls->max);
+		}
+}
+
+static void latencyHistory(redisClient *c, latencySeries *ls) {
+		latencySample *s;
+		int j, k, n = latencySamples(ls);
+
+		addReplyMultiBulkLen(c,n);
+		for (j = 0; j < n; j++) {
+				s = latencyGetSample(ls,j);
+				addReplyMultiBulkLen(c,2+LATENCY_PHASES);
+				addReplyLongLong(c,s->time);
+				addReplyLongLong(c,s->duration);
+				for (k = 0; k < LATENCY_PHASES; k++)
+						addReplyLongLong(c,s->phase[k]);
+		}
+}
+
+static char *latencyAdvice[LATENCY_PHASES] = {
+		NULL,
+		"time events (serverCron: cache expiry, loads, workers) ran long",
+		"reading requests and running commands: large requests, many clients "
+				"in the same iteration, or the kernel slow on read()",
+		"formulas ran long: see SLOWLOG and FMSTATS for which one and which "
+				"request, and think of formula-workers for the slow ones",
+		"writing replies: large replies, or the kernel slow on write()",
+		"flights, worker replies and async completions: many requests "
+				"waiting for the same iteration"
+};
+
+static sds latencyDoctor(void) {
+		latencyMonitor *lm = &server.latency;
+		long long busy = 0, slow = 0;
+		sds s = sdsempty();
+		int j;
+
+		if (!server.latency_monitor_threshold)
+				return sdscat(s,"The latency monitor is disabled, see latency-monitor-threshold.\n");
+
+		for (j = 0; j < LATENCY_PHASES; j++) {
+				if (j != LATENCY_PHASE_POLL) busy += lm->total[j];
+				slow += lm->series[j].count;
+		}
+		s = sdscatprintf(s,"%lld iterations of the event loop, %lld of them over %lld us.\n",
+						lm->iterations,slow,server.latency_monitor_threshold);
+		if (lm->iterations)
+				s = sdscatprintf(s,"An iteration is busy %.2f us and waits %.2f us for events on average.\n",
+								(double)busy/lm->iterations,
+								(double)lm->total[LATENCY_PHASE_POLL]/lm->iterations);
+		if (busy) {
+				s = sdscat(s,"Busy time by phase:");
+				for (j = 0; j < LATENCY_PHASES; j++)
+						if (j != LATENCY_PHASE_POLL)
+								s = sdscatprintf(s," %s %.1f%%",latencyPhaseNames[j],
+												100.0*lm->total[j]/busy);
+				s = sdscat(s,"\n");
+		}
+		if (!slow) return sdscat(s,"No slow iteration, nothing to worry about.\n");
+
+		s = sdscat(s,"\n");
+		for (j = 0; j < LATENCY_PHASES; j++) {
+				latencySeries *ls = &lm->series[j];
+				long long sum = 0;
+				int k, n = latencySamples(ls);
+
+				if (!ls->count) continue;
+				for (k = 0; k < n; k++) sum += latencyGetSample(ls,k)->duration;
+				s = sdscatprintf(s,"%s: %lld slow iterations, latest %lld us, average %lld us, worst %lld us.\n"
+								"  %s.\n",
+								latencyPhaseNames[j],ls->count,
+								latencyGetSample(ls,n-1)->duration,sum/n,ls->max,
+								latencyAdvice[j]);
+		}
+		if (lm->total[LATENCY_PHASE_POLL] < busy/10)
+				s = sdscat(s,"\nThe loop waits for events less than a tenth of the time it works: it is "
+								"saturated, requests queue in the kernel before gsh reads them.\n");
+		return s;
+}
+
+/* latency latest | history <phase> | reset | doctor */
+void latencyCommand(redisClient *c) {
+		char *sub = c->argv[1]->ptr;
+		int phase;
+		sds s;
+
+		if (!strcasecmp(sub,"latest") && c->argc == 2) {
+				latencyLatest(c);
+		} else if (!strcasecmp(sub,"history") && c->argc == 3) {
+				if ((phase = latencyPhaseByName(c->argv[2]->ptr)) == -1) {
+						addReplyErrorFormat(c,"unknown phase '%s'",(char*)c->argv[2]->ptr);
+						return;
+				}
+				latencyHistory(c,&server.latency.series[phase]);
+		} else if (!strcasecmp(sub,"reset") && c->argc == 2) {
+				memset(server.latency.series,0,sizeof(server.latency.series));
+				memset(server.latency.total,0,sizeof(server.latency.total));
+				server.latency.iterations = 0;
+				addReply(c,shared.ok);
+		} else if (!strcasecmp(sub,"doctor") && c->argc == 2) {
+				s = latencyDoctor();
+				addReplyBulkCString(c,s);
+				sdsfree(s);
+		} else {
+				addReplyError(c,"syntax error, try LATENCY LATEST|HISTORY <phase>|RESET|DOCTOR");
+		}
+}
@@ -0,0 +1,176 @@
+#include "gsh.h"
+
+/*-----------------------------------------------------------------------------
+ * Background formula loading
+ *
+ * The init of a formula may take seconds (carsvm reads its training samples),
+ * so load and reload do not run it on the main thread: dlopen() and init run
+ * on a thread of their own and the command is answered +LOADING right away.
+ * serverCron() picks up the finished loads and only then publishes the
+ * formula in server.fms, or switches a reloaded one to the new version.
+ * Meanwhile requests to a formula loaded for the first time get -LOADING,
+ * and a reloaded one keeps serving its old version. fmstatus <name> tells
+ * how the last load of a formula is going.
+ *
+ * What init does with cJSON stays on the loader thread: cJSON keeps no
+ * state of the request being served, a tree built in the request arena
+ * carries its arena in every node (see sjsonToCJSONArena()), so deleting
+ * trees here never looks at server.reqarena.
+ *
+ * The formulas of the configuration file are loaded before the server
+ * listens, nobody waits on them.
+ *----------------------------------------------------------------------------*/
+
+static pthread_mutex_t fmload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void fmLoadJobFree(void *privdata, void *val) {
+		fmLoadJob *j = val;
+
+		DICT_NOTUSED(privdata);
+		sdsfree(j->name);
+		zfree(j);
+}
+
+/* Jobs are keyed by their own name, freed with them. */
+dictType fmLoadDictType = {
+		dictSdsCaseHash,            /* hash function */
+		NULL,                       /* key dup */
+		NULL,                       /* val dup */
+		dictSdsKeyCaseCompare,      /* key compare */
+		NULL,                       /* key destructor */
+		fmLoadJobFree               /* val destructor */
+};
+
+static void *fmLoadThread(void *arg) {
+		fmLoadJob *j = arg;
+		char err[sizeof(j->err)];
+		FMITEM *it;
+
+		it = loadfm(j->name,j->version,err,sizeof(err));
+
+		pthread_mutex_lock(&fmload_mutex);
+		j->it = it;
+		if (!it) memcpy(j->err,err,sizeof(err));
+		j->done = 1;
+		pthread_mutex_unlock(&fmload_mutex);
+		return NULL;
+}
+
+/* Start loading version of the formula name, replacing the version serving
+ * when reload is set, and answer c. */
+void fmLoadStart(redisClient *c, sds name, int version, int reload) {
+		fmLoadJob *j = dictFetchValue(server.fmloads,name);
+		pthread_t tid;
+
+		if (j && j->state == FM_LOAD_RUNNING) {
+				addReplyErrorFormat(c,"formula [%s] is already loading",name);
+				return;
+		}
+
+		j = zcalloc(sizeof(*j));
+		j->name = sdsdup(name);
+		j->version = version;
+		j->reload = reload;
+		j->state = FM_LOAD_RUNNING;
+		j->start = ustime();
+
+		if (pthread_create(&tid,NULL,fmLoadThread,j) != 0) {
+				addReplyErrorFormat(c,"can't start the loader thread: %s",strerror(errno));
+				fmLoadJobFree(NULL,j);
+				return;
+		}
+		pthread_detach(tid);
+
+		dictDelete(server.fmloads,name);
+		dictAdd(server.fmloads,j->name,j);
+		redisLog(REDIS_NOTICE,"formula [%s] version %d is loading.",name,version);
+		addReplyStatus(c,"LOADING");
+}
+
+int fmLoadRunning(sds name) {
+		fmLoadJob *j = dictFetchValue(server.fmloads,name);
+
+		return j && j->state == FM_LOAD_RUNNING;
+}
+
+/* True if requests to name should be told to retry once it is loaded. */
+int fmLoading(sds name) {
+		fmLoadJob *j = dictFetchValue(server.fmloads,name);
+
+		return j && j->state == FM_LOAD_RUNNING && !j->reload;
+}
+
+static void fmLoadPublish(fmLoadJob *j) {
+		FMITEM *it = j->it;
+
+		j->it = NULL;
+		j->end = ustime();
+		if (!it) {
+				j->state = FM_LOAD_FAILED;
+				redisLog(REDIS_WARNING,"formula [%s] version %d failed to load: %s",
+								j->name,j->version,j->err);
+				return;
+		}
+
+		if (j->reload) {
+				swapfm(j->name,it);
+		} else if (addfm(j->name,it) != REDIS_OK) {
+				unloadfm(it);
+				j->state = FM_LOAD_FAILED;
+				snprintf(j->err,sizeof(j->err),"formula [%s] was loaded meanwhile",j->name);
+				return;
+		}
+		j->state = FM_LOAD_READY;
+		redisLog(REDIS_NOTICE,"formula [%s] version %d loaded in %lld ms.",
+						j->name,j->version,(j->end-j->start)/1000);
+}
+
+/* Publish the loads that finished, called from serverCron(). */
+void fmLoadCron(void) {
+		dictIterator *di;
+		dictEntry *de;
+		fmLoadJob *j;
+		int done;
+
+		if (!dictSize(server.fmloads)) return;
+		di = dictGetSafeIterator(server.fmloads);
+		while ((de = dictNext(di)) != NULL) {
+				j = dictGetEntryVal(de);
+				if (j->state != FM_LOAD_RUNNING) continue;
+
+				pthread_mutex_lock(&fmload_mutex);
+				done = j->done;
+				pthread_mutex_unlock(&fmload_mutex);
+				if (done) fmLoadPublish(j);
+		}
+		dictReleaseIterator(di);
+}
+
+/* fmstatus <name> */
+void fmstatusCommand(redisClient *c) {
+		fmLoadJob *j = dictFetchValue(server.fmloads,c->argv[1]->ptr);
+		FMITEM *it = dictFetchValue(server.fms,c->argv[1]->ptr);
+		sds s;
+
+		if (!j && !it) {
+				addReplyErrorFormat(c,"formula [%s] is not loaded",(char*)c->argv[1]->ptr);
+				return;
+		}
+
+		s = sdsempty();
+		if (j && j->state == FM_LOAD_RUNNING) {
+				s = sdscatprintf(s,"state:loading\r\nversion:%d\r\nelapsed_ms:%lld\r\n",
+								j->version,(ustime()-j->start)/1000);
+		} else if (j && j->state == FM_LOAD_FAILED) {
+				s = sdscatprintf(s,"state:failed\r\nversion:%d\r\nerror:%s\r\n",
+								j->version,j->err);
+		} else {
+				s = sdscat(s,"state:ready\r\n");
+		}
+		if (j && j->state == FM_LOAD_READY)
+				s = sdscatprintf(s,"load_ms:%lld\r\n",(j->end-j->start)/1000);
+		if (it)
+				s = sdscatprintf(s,"serving_version:%d\r\n",it->version);
+		addReplyBulkCString(c,s);
+		sdsfree(s);
+}
@@ -18,6 +18,7 @@ void *dupClientReplyValue(void *o) {
 
 
 redisClient *createClient(int fd) {
+		int tag = zmalloc_set_tag(ZMALLOC_TAG_CLIENT);
 		redisClient *c = zmalloc(sizeof(redisClient));
 		c->bufpos = 0;
 
@@ -27,6 +28,7 @@ redisClient *createClient(int fd) {
 		{
 				close(fd);
 				zfree(c);
+				zmalloc_set_tag(tag);
 				return NULL;
 		}
 
@@ -37,16 +39,28 @@ redisClient *createClient(int fd) {
 		c->argc = 0;
 		c->argv = NULL;
 		c->cmd = c->lastcmd = NULL;
+		c->fm = NULL;
+		c->parse_us = c->run_us = -1;
+		c->fmname = NULL;
+		c->fmid = 0;
+		c->flight = NULL;
+		c->upload = NULL;
+		c->trace = NULL;
+		c->traces = NULL;
+		c->bytes_queued = 0;
+		c->bytes_sent = 0;
 		c->multibulklen = 0;
 		c->bulklen = -1;
 		c->sentlen = 0;
 		c->flags = 0;
 		c->lastinteraction = time(NULL);
+		c->querytime = 0;
 		c->reply = listCreate();
 		c->reply_bytes = 0;
 		listSetFreeMethod(c->reply,decrRefCount);
 		listSetDupMethod(c->reply,dupClientReplyValue);
 		listAddNodeTail(server.clients,c);
+		zmalloc_set_tag(tag);
 		return c;
 }
 
@@ -93,14 +107,18 @@ int _addReplyToBuffer(redisClient *c, char *s, size_t len) {
 
 		memcpy(c->buf+c->bufpos,s,len);
 		c->bufpos+=len;
+		c->bytes_queued += len;
 		return REDIS_OK;
 }
 
 void _addReplyObjectToList(redisClient *c, robj *o) {
 		robj *tail;
+		int tag;
 
 		if (c->flags & REDIS_CLOSE_AFTER_REPLY) return;
 
+		tag = zmalloc_set_tag(ZMALLOC_TAG_REPLY);
+		c->bytes_queued += sdslen(o->ptr);
 		if (listLength(c->reply) == 0) {
 				incrRefCount(o);
 				listAddNodeTail(c->reply,o);
@@ -122,14 +140,18 @@ void _addReplyObjectToList(redisClient *c, robj *o) {
 						c->reply_bytes += zmalloc_size_sds(o->ptr);
 				}
 		}
+		zmalloc_set_tag(tag);
 }
 
 
 void _addReplyStringToList(redisClient *c, char *s, size_t len) {
 		robj *tail;
+		int tag;
 
 		if (c->flags & REDIS_CLOSE_AFTER_REPLY) return;
 
+		tag = zmalloc_set_tag(ZMALLOC_TAG_REPLY);
+		c->bytes_queued += len;
 		if (listLength(c->reply) == 0) {
 				robj *o = createStringObject(s,len);
 
@@ -153,6 +175,7 @@ void _addReplyStringToList(redisClient *c, char *s, size_t len) {
 						c->reply_bytes += zmalloc_size_sds(o->ptr);
 				}
 		}
+		zmalloc_set_tag(tag);
 }
 
 /* -----------------------------------------------------------------------------
@@ -201,6 +224,10 @@ void _addReplyLongLong(redisClient *c, long long ll, char prefix) {
 		addReplyString(c,buf,len+3);
 }
 
+void addReplyMultiBulkLen(redisClient *c, long length) {
+		_addReplyLongLong(c,length,'*');
+}
+
 /* Add a C buffer as bulk reply */
 void addReplyBulkCBuffer(redisClient *c, void *p, size_t len) {
 		_addReplyLongLong(c,len,'$');
@@ -209,6 +236,18 @@ void addReplyBulkCBuffer(redisClient *c, void *p, size_t len) {
 }
 
 
+/* Add the document written to w as a bulk reply. Its chunks are handed to
+ * the reply as they are: copied to the static buffer when they fit there,
+ * otherwise queued on the reply list without copying. */
+void addReplyJson(redisClient *c, jsonw *w) {
+		sds chunk;
+
+		_addReplyLongLong(c,jsonwLength(w),'$');
+		while ((chunk = jsonwNextChunk(w)) != NULL)
+				addReplySds(c,chunk);
+		addReply(c,shared.crlf);
+}
+
 /* Add a C nul term string as bulk reply */
 void addReplyBulkCString(redisClient *c, char *s) {
 		if (s == NULL) {
@@ -244,6 +283,10 @@ void _addReplyStatus(redisClient *c, char *s, size_t len) {
 		addReplyString(c,"\r\n",2);
 }
 
+void addReplyStatus(redisClient *c, char *status) {
+		_addReplyStatus(c,status,strlen(status));
+}
+
 void addReplyStatusFormat(redisClient *c, const char *fmt, ...) {
 		va_list ap;
 		va_start(ap,fmt);
@@ -316,6 +359,10 @@ void freeClient(redisClient *c) {
 		 * this, because this call adds the READABLE event. */
 		sdsfree(c->querybuf);
 		c->querybuf = NULL;
+		if (c->flags & REDIS_BLOCKED) flightLeave(c);
+		if (c->upload) uploadAbort(c);
+		traceFreeClient(c);
+		sdsfree(c->fmname);
 
 		/* Obvious cleanup */
 		aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
@@ -331,7 +378,7 @@ void freeClient(redisClient *c) {
 		zfree(c);
 }
 
-void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+static void _sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 		redisClient *c = privdata;
 		int nwritten = 0, totwritten = 0, objlen;
 		size_t objmem;
@@ -396,7 +443,11 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 						return;
 				}
 		}
-		if (totwritten > 0) c->lastinteraction = time(NULL);
+		if (totwritten > 0) {
+				c->lastinteraction = time(NULL);
+				c->bytes_sent += totwritten;
+				if (c->traces) traceWritten(c);
+		}
 		if (c->bufpos == 0 && listLength(c->reply) == 0) {
 				c->sentlen = 0;
 				aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
@@ -406,6 +457,12 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 		}
 }
 
+void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+		int phase = latencyEnterPhase(LATENCY_PHASE_WRITE);
+
+		_sendReplyToClient(el,fd,privdata,mask);
+		latencyEnterPhase(phase);
+}
 
 void addReplyLongLong(redisClient *c, long long ll) {
 		if (ll == 0)
@@ -598,6 +655,8 @@ int processMultibulkBuffer(redisClient *c) {
 }
 
 void processInputBuffer(redisClient *c) {
+		int tag, ok;
+
 		/* Keep processing while there is something in the input buffer */
 		while(sdslen(c->querybuf)) {
 
@@ -606,8 +665,14 @@ void processInputBuffer(redisClient *c) {
 				 * this flag has been set (i.e. don't process more commands). */
 				if (c->flags & REDIS_CLOSE_AFTER_REPLY) return;
 
-				/* Determine request type when unknown. */
+				/* A blocked client waits for its flight to land before the
+				 * commands that follow are run. */
+				if (c->flags & REDIS_BLOCKED) return;
+
+				/* Determine request type when unknown, and stamp the start of
+				 * the command: pipelined commands get a stamp of their own. */
 				if (!c->reqtype) {
+						c->querytime = ustime();
 						if (c->querybuf[0] == '*') {
 								c->reqtype = REDIS_REQ_MULTIBULK;
 						} else {
@@ -615,13 +680,17 @@ void processInputBuffer(redisClient *c) {
 						}
 				}
 
+				/* The arguments are tagged as such until freed. */
+				tag = zmalloc_set_tag(ZMALLOC_TAG_ARGV);
 				if (c->reqtype == REDIS_REQ_INLINE) {
-						if (processInlineBuffer(c) != REDIS_OK) break;
+						ok = processInlineBuffer(c);
 				} else if (c->reqtype == REDIS_REQ_MULTIBULK) {
-						if (processMultibulkBuffer(c) != REDIS_OK) break;
+						ok = processMultibulkBuffer(c);
 				} else {
 						redisPanic("Unknown request type");
 				}
+				zmalloc_set_tag(tag);
+				if (ok != REDIS_OK) break;
 
 				/* Multibulk processing could see a <= 0 length. */
 				if (c->argc == 0) {
@@ -634,7 +703,7 @@ void processInputBuffer(redisClient *c) {
 		}
 }
 
-void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+static void _readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 		redisClient *c = (redisClient*) privdata;
 		char buf[REDIS_IOBUF_LEN];
 		int nread;
@@ -677,6 +746,13 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 		server.current_client = NULL;
 }
 
+void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+		int phase = latencyEnterPhase(LATENCY_PHASE_READ);
+
+		_readQueryFromClient(el,fd,privdata,mask);
+		latencyEnterPhase(phase);
+}
+
 void getClientsMaxBuffers(unsigned long *longest_output_list, unsigned long *biggest_input_buffer) {
 		redisClient *c;
 		listNode *ln;
@@ -753,12 +829,15 @@ sds getAllClientsInfoString(void) {
  * needed it will be free'd, otherwise it ends up in a robj. */
 void _addReplySdsToList(redisClient *c, sds s) {
 		robj *tail;
+		int tag;
 
 		if (c->flags & REDIS_CLOSE_AFTER_REPLY) {
 				sdsfree(s);
 				return;
 		}
 
+		tag = zmalloc_set_tag(ZMALLOC_TAG_REPLY);
+		c->bytes_queued += sdslen(s);
 		if (listLength(c->reply) == 0) {
 				listAddNodeTail(c->reply,createObject(REDIS_STRING,s));
 				c->reply_bytes += zmalloc_size_sds(s);
@@ -779,6 +858,7 @@ void _addReplySdsToList(redisClient *c, sds s) {
 						c->reply_bytes += zmalloc_size_sds(s);
 				}
 		}
+		zmalloc_set_tag(tag);
 }
 
 void addReplySds(redisClient *c, sds s) {
@@ -90,3 +90,14 @@ robj *getDecodedObject(robj *o) {
 		}
 }
 
+
+/* Given an object returns the min number of seconds the object was never
+ * requested, using an approximated LRU algorithm. */
+unsigned long estimateObjectIdleTime(robj *o) {
+		if (server.lruclock >= o->lru) {
+				return (server.lruclock - o->lru) * REDIS_LRU_CLOCK_RESOLUTION;
+		} else {
+				return ((REDIS_LRU_CLOCK_MAX - o->lru) + server.lruclock) *
+						REDIS_LRU_CLOCK_RESOLUTION;
+		}
+}
@@ -0,0 +1,240 @@
+#define _GNU_SOURCE /* dladdr() */
+#include "gsh.h"
+
+/*-----------------------------------------------------------------------------
+ * Sampling profiler
+ *
+ *   profile start [<hz>]       sample the main thread hz times per second of
+ *                              CPU it uses (99 by default)
+ *   profile stop
+ *   profile dump               the stacks sampled, folded
+ *
+ * A timer on the CPU clock of the main thread sends it SIGPROF, the handler
+ * takes the stack with backtrace() and the formula running, if any, into a
+ * ring of samples allocated by profile start: it does not allocate, lock or
+ * call anything but backtrace(), which is called once before arming the
+ * timer so that it has loaded what it needs. When the ring is full the
+ * oldest samples are overwritten.
+ *
+ * profile dump turns the samples into folded stacks, one line per distinct
+ * stack, the outermost frame first, then the number of samples:
+ *
+ *   formula:sina;main;aeMain;...;gsh_formula_sina_run 42
+ *
+ * which flamegraph.pl and the like read as they are. The samples taken
+ * while a formula ran start with formula:<name>. Frames are named with
+ * dladdr(), which needs the symbols exported (-rdynamic): static functions
+ * show as the module they are in.
+ *----------------------------------------------------------------------------*/
+
+#ifdef HAVE_BACKTRACE
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/syscall.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define PROFILE_SAMPLES 8192
+#define PROFILE_DEPTH   64
+#define PROFILE_DEFAULT_HZ 99
+#define PROFILE_MAX_HZ  10000
+
+typedef struct profileSample {
+		int fmid;                   /* formula running, -1 if none */
+		int depth;
+		void *pc[PROFILE_DEPTH];    /* innermost first */
+} profileSample;
+
+static struct {
+		profileSample *samples;     /* PROFILE_SAMPLES of them */
+		volatile unsigned long long taken; /* samples[taken%PROFILE_SAMPLES] is next */
+		volatile sig_atomic_t running;
+		timer_t timer;
+} prof;
+
+static void profileHandler(int sig, siginfo_t *info, void *secret) {
+		void *trace[PROFILE_DEPTH+3], *pc;
+		profileSample *s;
+		int n, j, skip, saved = errno;
+		REDIS_NOTUSED(sig);
+		REDIS_NOTUSED(info);
+
+		if (!prof.running) return;
+		n = backtrace(trace,PROFILE_DEPTH+3);
+
+		/* Drop the frames of the handler and of the signal trampoline: the
+		 * stack starts at the instruction interrupted. */
+		pc = getMcontextEip((ucontext_t*)secret);
+		for (skip = 0; skip < n && skip < 3 && trace[skip] != pc; skip++);
+		if (skip == n || skip == 3) skip = n > 2 ? 2 : n;
+
+		s = &prof.samples[prof.taken%PROFILE_SAMPLES];
+		s->fmid = server.fm_running;
+		for (j = skip; j < n && j-skip < PROFILE_DEPTH; j++)
+				s->pc[j-skip] = trace[j];
+		s->depth = j-skip;
+		prof.taken++;
+		errno = saved;
+}
+
+static void profileStop(void) {
+		struct sigaction act;
+
+		if (!prof.running) return;
+		prof.running = 0;
+		timer_delete(prof.timer);
+		sigemptyset(&act.sa_mask);
+		act.sa_flags = 0;
+		act.sa_handler = SIG_IGN;
+		sigaction(SIGPROF,&act,NULL);
+}
+
+static int profileStart(int hz) {
+		struct sigaction act;
+		struct sigevent sev;
+		struct itimerspec its;
+		long long ns = 1000000000LL/hz;
+		void *trace[1];
+
+		if (!prof.samples) prof.samples = zmalloc(sizeof(profileSample)*PROFILE_SAMPLES);
+		prof.taken = 0;
+		backtrace(trace,1);
+
+		sigemptyset(&act.sa_mask);
+		act.sa_flags = SA_RESTART | SA_SIGINFO;
+		act.sa_sigaction = profileHandler;
+		sigaction(SIGPROF,&act,NULL);
+
+		memset(&sev,0,sizeof(sev));
+		sev.sigev_notify = SIGEV_THREAD_ID;
+		sev.sigev_signo = SIGPROF;
+		sev.sigev_notify_thread_id = syscall(SYS_gettid);
+		if (timer_create(CLOCK_THREAD_CPUTIME_ID,&sev,&prof.timer) == -1) {
+				redisLog(REDIS_WARNING,"Can't create the profiling timer: %s",strerror(errno));
+				return REDIS_ERR;
+		}
+		its.it_interval.tv_sec = ns/1000000000LL;
+		its.it_interval.tv_nsec = ns%1000000000LL;
+		its.it_value = its.it_interval;
+		prof.running = 1;
+		if (timer_settime(prof.timer,0,&its,NULL) == -1) {
+				redisLog(REDIS_WARNING,"Can't arm the profiling timer: %s",strerror(errno));
+				profileStop();
+				return REDIS_ERR;
+		}
+		return REDIS_OK;
+}
+
+static sds profileFrame(sds s, void *pc) {
+		Dl_info di;
+		char *mod;
+
+		if (!dladdr(pc,&di)) return sdscat(s,"[unknown]");
+		if (di.dli_sname) return sdscat(s,(char*)di.dli_sname);
+		mod = di.dli_fname ? strrchr(di.dli_fname,'/') : NULL;
+		return sdscatprintf(s,"[%s]",mod ? mod+1 : (di.dli_fname ? di.dli_fname : "unknown"));
+}
+
+static dictType profileDictType = {
+		dictSdsHash,                /* hash function */
+		NULL,                       /* key dup */
+		NULL,                       /* val dup */
+		dictSdsKeyCompare,          /* key compare */
+		dictSdsDestructor,          /* key destructor */
+		NULL                        /* val destructor */
+};
+
+/* Folded stacks of the samples kept. */
+static sds profileDump(void) {
+		unsigned long long n, j;
+		dict *stacks = dictCreate(&profileDictType,NULL);
+		dictIterator *di;
+		dictEntry *de;
+		sds out = sdsempty(), key;
+		sigset_t mask, old;
+		int k;
+
+		/* The handler does not write the samples being read. */
+		sigemptyset(&mask);
+		sigaddset(&mask,SIGPROF);
+		sigprocmask(SIG_BLOCK,&mask,&old);
+
+		n = prof.taken < PROFILE_SAMPLES ? prof.taken : PROFILE_SAMPLES;
+		for (j = prof.taken-n; j < prof.taken; j++) {
+				profileSample *s = &prof.samples[j%PROFILE_SAMPLES];
+
+				key = sdsempty();
+				if (s->fmid >= 0)
+						key = sdscatprintf(key,"formula:%s;",server.fmtable[s->fmid]->name);
+				for (k = s->depth-1; k >= 0; k--) {
+						key = profileFrame(key,s->pc[k]);
+						if (k) key = sdscatlen(key,";",1);
+				}
+				if ((de = dictFind(stacks,key)) != NULL) {
+						dictSetHashVal(stacks,de,(void*)((long)dictGetEntryVal(de)+1));
+						sdsfree(key);
+				} else {
+						dictAdd(stacks,key,(void*)1L);
+				}
+		}
+		sigprocmask(SIG_SETMASK,&old,NULL);
+
+		di = dictGetSafeIterator(stacks);
+		while ((de = dictNext(di)) != NULL)
+				out = sdscatprintf(out,"%s %ld\n",(char*)dictGetEntryKey(de),(long)dictGetEntryVal(de));
+		dictReleaseIterator(di);
+		dictRelease(stacks);
+		return out;
+}
+
+/* profile start [<hz>] | stop | dump */
+void profileCommand(redisClient *c) {
+		char *sub = c->argv[1]->ptr;
+		long long hz = PROFILE_DEFAULT_HZ;
+		sds s;
+
+		if (!strcasecmp(sub,"start") && c->argc <= 3) {
+				if (c->argc == 3 &&
+						(!string2ll(c->argv[2]->ptr,sdslen(c->argv[2]->ptr),&hz) ||
+						 hz < 1 || hz > PROFILE_MAX_HZ)) {
+						addReplyErrorFormat(c,"hz must be between 1 and %d",PROFILE_MAX_HZ);
+						return;
+				}
+				if (prof.running) {
+						addReplyError(c,"the profiler is already running, see PROFILE STOP");
+						return;
+				}
+				if (profileStart((int)hz) == REDIS_ERR) {
+						addReplyError(c,"can't start the profiler, see the log");
+						return;
+				}
+				redisLog(REDIS_NOTICE,"Profiling started, %lld Hz",hz);
+				addReply(c,shared.ok);
+		} else if (!strcasecmp(sub,"stop") && c->argc == 2) {
+				if (prof.running) {
+						profileStop();
+						redisLog(REDIS_NOTICE,"Profiling stopped, %llu samples",prof.taken);
+				}
+				addReply(c,shared.ok);
+		} else if (!strcasecmp(sub,"dump") && c->argc == 2) {
+				if (!prof.samples) {
+						addReplyError(c,"nothing sampled, see PROFILE START");
+						return;
+				}
+				s = profileDump();
+				addReplyBulkCBuffer(c,s,sdslen(s));
+				sdsfree(s);
+		} else {
+				addReplyError(c,"syntax error, try PROFILE START [hz]|STOP|DUMP");
+		}
+}
+
+#else
+
+void profileCommand(redisClient *c) {
+		addReplyError(c,"the profiler needs backtrace(), not available on this system");
+}
+
+#endif /* HAVE_BACKTRACE */
@@ -0,0 +1,162 @@
+#include "gsh.h"
+#include <ctype.h>
+
+/*-----------------------------------------------------------------------------
+ * Formula request schemas
+ *
+ * A formula exporting gsh_formula_<name>_schema (see common/formula.h) gets
+ * its "data" checked before it is called. The field list is compiled once,
+ * when the formula is loaded, into an open addressing table keyed by the
+ * lowercased field names. A request is then validated on the sjson tape in
+ * a single walk of the members of "data": one hash lookup per member, a
+ * type mask test, and a walk of the elements of the arrays whose element
+ * type is constrained. The members that matched a field are remembered by
+ * position, so once the cJSON view is built the items handed to the formula
+ * in ctx->fields are found in one more walk, without any name lookup.
+ *----------------------------------------------------------------------------*/
+
+static unsigned int schemaHash(const char *name, size_t len) {
+		unsigned int h = 5381;
+
+		while (len--) h = h*33 + tolower((unsigned char)*name++);
+		return h;
+}
+
+/* Return the index of the field called name, -1 if there is none. */
+static int schemaLookup(fmSchema *s, const char *name, size_t len) {
+		unsigned int j = schemaHash(name,len) & s->mask;
+		fmField *f;
+
+		while (s->slots[j]) {
+				f = &s->fields[s->slots[j]-1];
+				if (strlen(f->name) == len && !strncasecmp(f->name,name,len))
+						return s->slots[j]-1;
+				j = (j+1) & s->mask;
+		}
+		return -1;
+}
+
+/* Compile the NULL terminated field list exported by a formula. Returns
+ * NULL and sets err when the list is not a valid schema. */
+fmSchema *schemaCompile(fmField *fields, char **err) {
+		fmSchema *s;
+		unsigned int size = 8, j;
+		int i;
+
+		s = zcalloc(sizeof(*s));
+		s->fields = fields;
+		while (fields[s->nfields].name) {
+				if (s->nfields == FM_SCHEMA_MAX_FIELDS) {
+						*err = "too many fields";
+						goto err;
+				}
+				s->nfields++;
+		}
+		while (size < (unsigned int)s->nfields*2) size *= 2;
+		s->mask = size-1;
+		s->slots = zcalloc(size);
+
+		for (i = 0; i < s->nfields; i++) {
+				fmField *f = &fields[i];
+
+				if (!f->type || (f->type & ~FM_ANY) || (f->elemtype & ~FM_ANY)) {
+						*err = "bad field type";
+						goto err;
+				}
+				if (f->elemtype && !(f->type & FM_ARRAY)) {
+						*err = "element type on a field that is not an array";
+						goto err;
+				}
+				if (schemaLookup(s,f->name,strlen(f->name)) != -1) {
+						*err = "duplicate field";
+						goto err;
+				}
+				j = schemaHash(f->name,strlen(f->name)) & s->mask;
+				while (s->slots[j]) j = (j+1) & s->mask;
+				s->slots[j] = i+1;
+				if (f->flags & FM_REQUIRED) s->required |= 1ULL << i;
+		}
+		return s;
+err:
+		schemaFree(s);
+		return NULL;
+}
+
+void schemaFree(fmSchema *s) {
+		if (!s) return;
+		zfree(s->slots);
+		zfree(s);
+}
+
+static int schemaTypeOf(sjsonParser *p, size_t v) {
+		switch (sjsonType(p,v)) {
+				case SJSON_NULL: return FM_NULL;
+				case SJSON_TRUE:
+				case SJSON_FALSE: return FM_BOOL;
+				case SJSON_INT64: return FM_INT;
+				case SJSON_DOUBLE: return FM_DOUBLE;
+				case SJSON_STRING: return FM_STRING;
+				case SJSON_ARRAY: return FM_ARRAY;
+				default: return FM_OBJECT;
+		}
+}
+
+static int schemaFail(fmSchema *s, const char *fmt, const char *name) {
+		snprintf(s->err,sizeof(s->err),fmt,name);
+		return REDIS_ERR;
+}
+
+/* Check the document last parsed by p against the schema. On error
+ * REDIS_ERR is returned and s->err tells why. Duplicate members are
+ * resolved like cJSON_GetObjectItem() does: the first one counts. */
+int schemaValidate(fmSchema *s, sjsonParser *p) {
+		size_t root = sjsonRoot(p), key, val, e;
+		unsigned long long seen = 0;
+		const char *name;
+		size_t len;
+		int member = 0, i;
+
+		s->nhits = 0;
+		if (sjsonType(p,root) != SJSON_OBJECT) {
+				snprintf(s->err,sizeof(s->err),"data is not an object");
+				return REDIS_ERR;
+		}
+		for (key = sjsonFirst(p,root); key; key = sjsonNext(p,val), member++) {
+				val = sjsonNext(p,key);
+				name = sjsonString(p,key,&len);
+				if ((i = schemaLookup(s,name,len)) == -1 || (seen & (1ULL << i)))
+						continue;
+
+				fmField *f = &s->fields[i];
+				if (!(schemaTypeOf(p,val) & f->type))
+						return schemaFail(s,"field '%s' has the wrong type",f->name);
+				if (f->elemtype && sjsonType(p,val) == SJSON_ARRAY) {
+						for (e = sjsonFirst(p,val); e; e = sjsonNext(p,e))
+								if (!(schemaTypeOf(p,e) & f->elemtype))
+										return schemaFail(s,"field '%s' has an element of the wrong type",f->name);
+				}
+				seen |= 1ULL << i;
+				s->hits[s->nhits].member = member;
+				s->hits[s->nhits].field = i;
+				s->nhits++;
+		}
+		if (s->required & ~seen) {
+				for (i = 0; !(s->required & ~seen & (1ULL << i)); i++);
+				return schemaFail(s,"field '%s' is required",s->fields[i].name);
+		}
+		return REDIS_OK;
+}
+
+/* Return the ctx->fields array for the cJSON view of the document that
+ * passed schemaValidate(). */
+void **schemaResolve(fmSchema *s, cJSON *data) {
+		cJSON *c = data->child;
+		int member = 0, h;
+
+		memset(s->resolved,0,sizeof(void*)*s->nfields);
+		for (h = 0; h < s->nhits; h++) {
+				for (; member < s->hits[h].member; member++) c = c->next;
+				s->resolved[s->hits[h].field] = c;
+		}
+		return s->resolved;
+}
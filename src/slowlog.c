@@ -0,0 +1,148 @@
+#include "gsh.h"
+
+/*-----------------------------------------------------------------------------
+ * Slow log
+ *
+ * The grun calls that took longer than slowlog-log-slower-than microseconds
+ * are remembered, the newest first, up to slowlog-max-len of them, with the
+ * formula, the start of the request (up to SLOWLOG_PAYLOAD_MAX bytes), the
+ * client and where the time went: parsing "data", running the formula and
+ * the rest, the envelope and the reply. An inline call is timed by call();
+ * a call run from a flight (deterministic, async or worker formulas) is
+ * logged when the flight lands, with the time of its run and its "data".
+ *
+ *   slowlog get [<count>]
+ *   slowlog len
+ *   slowlog reset
+ *
+ * Each entry of slowlog get is an id, the unix time it was logged, the
+ * duration, the formula, the request, the client address and the parse,
+ * run and reply times, -1 for the parts a call did not have.
+ *----------------------------------------------------------------------------*/
+
+void slowlogInit(void) {
+		server.slowlog = listCreate();
+		server.slowlog_entry_id = 0;
+		listSetFreeMethod(server.slowlog,slowlogFreeEntry);
+}
+
+/* Ids keep growing across resets. */
+static void slowlogReset(void) {
+		while (listLength(server.slowlog))
+				listDelNode(server.slowlog,listFirst(server.slowlog));
+}
+
+void slowlogFreeEntry(void *ptr) {
+		slowlogEntry *se = ptr;
+
+		sdsfree(se->formula);
+		sdsfree(se->payload);
+		sdsfree(se->addr);
+		zfree(se);
+}
+
+static sds slowlogPayload(const char *p, size_t len) {
+		sds s;
+
+		if (len <= SLOWLOG_PAYLOAD_MAX) return sdsnewlen(p,len);
+		s = sdsnewlen(p,SLOWLOG_PAYLOAD_MAX);
+		return sdscatprintf(s,"... (%zu more bytes)",len-SLOWLOG_PAYLOAD_MAX);
+}
+
+static sds slowlogAddr(redisClient *c) {
+		char ip[32];
+		int port;
+
+		if (!c || anetPeerToString(c->fd,ip,&port) == -1)
+				return sdsnew("?");
+		return sdscatprintf(sdsempty(),"%s:%d",ip,port);
+}
+
+static void slowlogPush(redisClient *c, FMITEM *fm, const char *p, size_t len,
+				long long duration, long long parse, long long run, long long reply) {
+		slowlogEntry *se = zmalloc(sizeof(*se));
+
+		se->id = server.slowlog_entry_id++;
+		se->time = time(NULL);
+		se->duration = duration;
+		se->parse = parse;
+		se->run = run;
+		se->reply = reply;
+		se->formula = sdsdup(fm->name);
+		se->payload = slowlogPayload(p,len);
+		se->addr = slowlogAddr(c);
+		listAddNodeHead(server.slowlog,se);
+
+		while (listLength(server.slowlog) > server.slowlog_max_len)
+				listDelNode(server.slowlog,listLast(server.slowlog));
+}
+
+static int slowlogWanted(long long duration) {
+		return server.slowlog_log_slower_than >= 0 &&
+				duration >= server.slowlog_log_slower_than;
+}
+
+/* Called by call() for the grun calls run inline, c->fm is the formula. */
+void slowlogPushEntryIfNeeded(redisClient *c, long long duration) {
+		long long rest;
+		sds req;
+
+		if (!slowlogWanted(duration)) return;
+		rest = duration-(c->parse_us > 0 ? c->parse_us : 0)-(c->run_us > 0 ? c->run_us : 0);
+		req = c->argv[2]->ptr;
+		slowlogPush(c,c->fm,req,sdslen(req),duration,c->parse_us,c->run_us,
+						rest < 0 ? 0 : rest);
+}
+
+/* Called when a flight lands, before its waiters are answered. */
+void slowlogPushFlight(fmFlight *f) {
+		long long duration = (f->parse_us > 0 ? f->parse_us : 0)+(f->run_us > 0 ? f->run_us : 0);
+		listNode *ln;
+
+		if (!slowlogWanted(duration)) return;
+		ln = listFirst(f->waiters);
+		slowlogPush(ln ? ((fmWaiter*)listNodeValue(ln))->client : NULL,f->fm,
+						f->key.data,f->key.datalen,duration,f->parse_us,f->run_us,-1);
+}
+
+static void addReplySlowlogEntry(redisClient *c, slowlogEntry *se) {
+		addReplyMultiBulkLen(c,9);
+		addReplyLongLong(c,se->id);
+		addReplyLongLong(c,se->time);
+		addReplyLongLong(c,se->duration);
+		addReplyBulkCBuffer(c,se->formula,sdslen(se->formula));
+		addReplyBulkCBuffer(c,se->payload,sdslen(se->payload));
+		addReplyBulkCBuffer(c,se->addr,sdslen(se->addr));
+		addReplyLongLong(c,se->parse);
+		addReplyLongLong(c,se->run);
+		addReplyLongLong(c,se->reply);
+}
+
+/* slowlog get [<count>] | len | reset */
+void slowlogCommand(redisClient *c) {
+		char *sub = c->argv[1]->ptr;
+		long long count = 10;
+		listIter li;
+		listNode *ln;
+
+		if (!strcasecmp(sub,"reset") && c->argc == 2) {
+				slowlogReset();
+				addReply(c,shared.ok);
+		} else if (!strcasecmp(sub,"len") && c->argc == 2) {
+				addReplyLongLong(c,listLength(server.slowlog));
+		} else if (!strcasecmp(sub,"get") && c->argc <= 3) {
+				if (c->argc == 3 &&
+						!string2ll(c->argv[2]->ptr,sdslen(c->argv[2]->ptr),&count)) {
+						addReplyError(c,"count is not an integer");
+						return;
+				}
+				if (count < 0 || (unsigned long long)count > listLength(server.slowlog))
+						count = listLength(server.slowlog);
+				addReplyMultiBulkLen(c,count);
+				listRewind(server.slowlog,&li);
+				while (count-- && (ln = listNext(&li)) != NULL)
+						addReplySlowlogEntry(c,listNodeValue(ln));
+		} else {
+				addReplyError(c,"syntax error, try SLOWLOG GET [count]|LEN|RESET");
+		}
+}
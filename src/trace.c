@@ -0,0 +1,200 @@
+#include "gsh.h"
+
+/*-----------------------------------------------------------------------------
+ * Request tracing
+ *
+ * With trace-file set, one grun request in trace-sample-rate, and every
+ * request whose envelope has "trace":true, is followed through the server:
+ * when its first byte was read, its envelope parsed, its formula started
+ * and ended (the run of its flight for the formulas run from one), its
+ * reply queued and the last byte of the reply written.
+ *
+ * The main thread hands the finished records to a ring it is the only one
+ * to write and the tracing thread the only one to read, without a lock: a
+ * record finding the ring full is dropped. The tracing thread appends them
+ * to trace-file as Chrome trace events (the JSON array format, which may be
+ * left unterminated), for chrome://tracing or ui.perfetto.dev: a request is
+ * an async slice in the lane of its connection, with its stages nested in
+ * it, so requests pipelined on a connection show how they queue. The
+ * requests read at once share the time of that read: their "read" stage
+ * includes waiting for the ones before them.
+ *----------------------------------------------------------------------------*/
+
+#define TRACE_RING_SIZE 4096        /* records, power of 2 */
+#define TRACE_FLUSH_MS  100
+
+static struct {
+		traceRecord ring[TRACE_RING_SIZE];
+		unsigned long long head;    /* written by the main thread */
+		unsigned long long tail;    /* written by the tracing thread */
+		long long dropped;          /* records that found the ring full */
+		long long seq;              /* requests seen, for sampling */
+		long long ids;              /* records made */
+		FILE *fp;
+} tr;
+
+static char *traceStageNames[TRACE_STAGES] = {
+		"read", "parsed", "formula_start", "formula_end", "queued", "written"
+};
+
+static void tracePush(traceRecord *r) {
+		unsigned long long head = tr.head;
+
+		if (head-__atomic_load_n(&tr.tail,__ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+				tr.dropped++;
+				return;
+		}
+		tr.ring[head&(TRACE_RING_SIZE-1)] = *r;
+		__atomic_store_n(&tr.head,head+1,__ATOMIC_RELEASE);
+}
+
+/* A stage as a nested async slice, from stage a to stage b. */
+static void traceSlice(traceRecord *r, char *name, int a, int b, int pid) {
+		if (!r->ts[a] || !r->ts[b]) return;
+		fprintf(tr.fp,
+						"{\"name\":\"%s\",\"cat\":\"grun\",\"ph\":\"b\",\"id\":%lld,\"pid\":%d,\"tid\":%d,\"ts\":%lld},\n"
+						"{\"name\":\"%s\",\"cat\":\"grun\",\"ph\":\"e\",\"id\":%lld,\"pid\":%d,\"tid\":%d,\"ts\":%lld},\n",
+						name,r->id,pid,r->fd,r->ts[a],name,r->id,pid,r->fd,r->ts[b]);
+}
+
+static void traceWrite(traceRecord *r, int pid) {
+		int j, last = TRACE_READ;
+
+		for (j = 0; j < TRACE_STAGES; j++)
+				if (r->ts[j]) last = j;
+		fprintf(tr.fp,
+						"{\"name\":\"grun %s\",\"cat\":\"grun\",\"ph\":\"b\",\"id\":%lld,\"pid\":%d,\"tid\":%d,\"ts\":%lld,"
+						"\"args\":{\"parse_us\":%lld,\"run_us\":%lld,\"last_stage\":\"%s\"}},\n",
+						r->formula,r->id,pid,r->fd,r->ts[TRACE_READ],r->parse_us,r->run_us,
+						traceStageNames[last]);
+		traceSlice(r,"read",TRACE_READ,TRACE_PARSED,pid);
+		traceSlice(r,"wait",TRACE_PARSED,TRACE_FM_START,pid);
+		traceSlice(r,"formula",TRACE_FM_START,TRACE_FM_END,pid);
+		if (r->ts[TRACE_FM_END])
+				traceSlice(r,"reply",TRACE_FM_END,TRACE_QUEUED,pid);
+		else
+				traceSlice(r,"reply",TRACE_PARSED,TRACE_QUEUED,pid);
+		traceSlice(r,"send",TRACE_QUEUED,TRACE_WRITTEN,pid);
+		fprintf(tr.fp,
+						"{\"name\":\"grun %s\",\"cat\":\"grun\",\"ph\":\"e\",\"id\":%lld,\"pid\":%d,\"tid\":%d,\"ts\":%lld},\n",
+						r->formula,r->id,pid,r->fd,r->ts[last]);
+}
+
+static void *traceThread(void *arg) {
+		unsigned long long head, tail;
+		int pid = (int)getpid();
+		REDIS_NOTUSED(arg);
+
+		while (1) {
+				head = __atomic_load_n(&tr.head,__ATOMIC_ACQUIRE);
+				for (tail = tr.tail; tail != head; tail++) {
+						traceWrite(&tr.ring[tail&(TRACE_RING_SIZE-1)],pid);
+						__atomic_store_n(&tr.tail,tail+1,__ATOMIC_RELEASE);
+				}
+				fflush(tr.fp);
+				usleep(TRACE_FLUSH_MS*1000);
+		}
+		return NULL;
+}
+
+void traceInit(void) {
+		pthread_t tid;
+
+		if (!server.trace_file) return;
+		if (!(tr.fp = fopen(server.trace_file,"w"))) {
+				redisLog(REDIS_WARNING,"Can't open the trace file %s: %s, requests are not traced",
+								server.trace_file,strerror(errno));
+				return;
+		}
+		fputs("[\n",tr.fp);
+		if (pthread_create(&tid,NULL,traceThread,NULL) != 0) {
+				redisLog(REDIS_WARNING,"Can't create the tracing thread, requests are not traced");
+				fclose(tr.fp);
+				tr.fp = NULL;
+				return;
+		}
+		pthread_detach(tid);
+}
+
+/* Called once the envelope of the request of c is parsed: starts tracing
+ * it if it is sampled or asks for it. */
+void traceStart(redisClient *c, envelope *env) {
+		traceRecord *r;
+		size_t len;
+		sds name;
+
+		if (!tr.fp) return;
+		tr.seq++;
+		if (!(env->flags & ENVELOPE_TRACE) &&
+				(!server.trace_sample_rate || tr.seq%server.trace_sample_rate)) return;
+
+		r = zcalloc(sizeof(*r));
+		r->id = ++tr.ids;
+		r->fd = c->fd;
+		r->ts[TRACE_READ] = c->querytime;
+		r->ts[TRACE_PARSED] = ustime();
+		r->parse_us = r->run_us = -1;
+		/*the name goes into the JSON unescaped: keep it only if it is one
+		  a formula can have.*/
+		len = env->formulalen < sizeof(r->formula)-1 ? env->formulalen : sizeof(r->formula)-1;
+		name = sdsnewlen(env->formula,len);
+		if (fmValidName(name))
+				memcpy(r->formula,name,len);
+		else
+				strcpy(r->formula,"?");
+		sdsfree(name);
+		c->trace = r;
+}
+
+/* The reply of the traced request of c is queued, it is done once the
+ * bytes queued so far are written. */
+void traceQueued(redisClient *c) {
+		traceRecord *r = c->trace;
+
+		r->ts[TRACE_QUEUED] = ustime();
+		r->mark = c->bytes_queued;
+		if (!c->traces) c->traces = listCreate();
+		listAddNodeTail(c->traces,r);
+		c->trace = NULL;
+}
+
+/* Called when bytes were written to c. */
+void traceWritten(redisClient *c) {
+		listNode *ln;
+		traceRecord *r;
+		long long now = 0;
+
+		while ((ln = listFirst(c->traces)) != NULL) {
+				r = listNodeValue(ln);
+				if (r->mark > c->bytes_sent) break;
+				if (!now) now = ustime();
+				r->ts[TRACE_WRITTEN] = now;
+				tracePush(r);
+				zfree(r);
+				listDelNode(c->traces,ln);
+		}
+}
+
+/* The client is going away: its requests are traced as far as they went. */
+void traceFreeClient(redisClient *c) {
+		listNode *ln;
+
+		if (c->trace) {
+				tracePush(c->trace);
+				zfree(c->trace);
+				c->trace = NULL;
+		}
+		if (!c->traces) return;
+		while ((ln = listFirst(c->traces)) != NULL) {
+				tracePush(listNodeValue(ln));
+				zfree(listNodeValue(ln));
+				listDelNode(c->traces,ln);
+		}
+		listRelease(c->traces);
+		c->traces = NULL;
+}
+
+sds traceInfoString(sds info) {
+		if (!tr.fp) return info;
+		return sdscatprintf(info,"traced_requests:%lld\r\ntrace_dropped:%lld\r\n",tr.ids,tr.dropped);
+}
@@ -0,0 +1,200 @@
+#include "gsh.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*-----------------------------------------------------------------------------
+ * Formula upload
+ *
+ *   fmupload begin <name> <size> <crc32>
+ *   fmupload chunk <bytes>                 (as many as needed)
+ *   fmupload commit
+ *   fmupload abort
+ *
+ * The library is sent as raw bulk arguments, in chunks small enough to stay
+ * under the query buffer limit, and written as it comes to a temp file in
+ * lib/. On commit the size and the CRC-32 (hex, as cksum -a crc32b prints
+ * it) announced by begin are checked, and the file is renamed over
+ * lib/lib<name>.so, so a running load never sees half a library. The
+ * formula is then loaded in the background, or reloaded if it is already
+ * there (see loader.c). An upload belongs to its connection: it is dropped
+ * if the client goes away before committing.
+ *----------------------------------------------------------------------------*/
+
+/* Names end up in paths: no slashes, no dots. */
+int fmValidName(sds name) {
+		size_t j;
+
+		if (!sdslen(name)) return 0;
+		for (j = 0; j < sdslen(name); j++)
+				if (!isalnum((unsigned char)name[j]) && name[j] != '_' && name[j] != '-')
+						return 0;
+		return 1;
+}
+
+/* Move the library at tmp to lib/lib<name>.so and load it, as a new version
+ * if the formula is loaded and replace is set. Answers c. */
+void fmInstall(redisClient *c, sds name, char *tmp, int replace) {
+		FMITEM *it = dictFetchValue(server.fms,name);
+		char path[BUFSIZ];
+
+		if (it && !replace) {
+				addReplyErrorFormat(c,"formula [%s] is already loaded, see reload",name);
+				unlink(tmp);
+				return;
+		}
+		if (fmLoadRunning(name)) {
+				addReplyErrorFormat(c,"formula [%s] is already loading",name);
+				unlink(tmp);
+				return;
+		}
+
+		snprintf(path,sizeof(path),"./lib/lib%s.so",name);
+		if (chmod(tmp,S_IRWXU) == -1 || rename(tmp,path) == -1) {
+				redisLog(REDIS_WARNING,"Installing %s as %s: %s",tmp,path,strerror(errno));
+				addReplyErrorFormat(c,"can't install %s: %s",path,strerror(errno));
+				unlink(tmp);
+				return;
+		}
+		fmLoadStart(c,name,it ? it->version+1 : 1,it != NULL);
+}
+
+void uploadAbort(redisClient *c) {
+		fmUpload *u = c->upload;
+
+		close(u->fd);
+		unlink(u->tmpfile);
+		sdsfree(u->tmpfile);
+		sdsfree(u->name);
+		zfree(u);
+		c->upload = NULL;
+}
+
+static void uploadBegin(redisClient *c) {
+		sds name;
+		long long size;
+		unsigned long crc;
+		char *eptr;
+		fmUpload *u;
+		int fd;
+
+		if (c->argc != 5) {
+				addReplyError(c,"wrong number of arguments for 'fmupload begin'");
+				return;
+		}
+		name = c->argv[2]->ptr;
+		if (!fmValidName(name)) {
+				addReplyErrorFormat(c,"invalid formula name '%s'",name);
+				return;
+		}
+		if (!string2ll(c->argv[3]->ptr,sdslen(c->argv[3]->ptr),&size) || size <= 0) {
+				addReplyError(c,"invalid size");
+				return;
+		}
+		errno = 0;
+		crc = strtoul(c->argv[4]->ptr,&eptr,16);
+		if (errno || *eptr || eptr == c->argv[4]->ptr || crc > 0xffffffffUL) {
+				addReplyError(c,"invalid crc32");
+				return;
+		}
+		if (c->upload) uploadAbort(c);
+
+		u = zmalloc(sizeof(*u));
+		u->tmpfile = sdscatprintf(sdsempty(),"./lib/.lib%s.so.upload.%d",name,c->fd);
+		if ((fd = open(u->tmpfile,O_WRONLY|O_CREAT|O_TRUNC,S_IRUSR|S_IWUSR)) == -1) {
+				addReplyErrorFormat(c,"can't create %s: %s",u->tmpfile,strerror(errno));
+				sdsfree(u->tmpfile);
+				zfree(u);
+				return;
+		}
+		u->name = sdsdup(name);
+		u->fd = fd;
+		u->size = size;
+		u->written = 0;
+		u->crc = 0;
+		u->expected = (uint32_t)crc;
+		c->upload = u;
+		addReply(c,shared.ok);
+}
+
+/* Answers the bytes written so far. */
+static void uploadChunk(redisClient *c) {
+		fmUpload *u = c->upload;
+		size_t len, off = 0;
+		ssize_t nwritten;
+		sds chunk;
+
+		if (c->argc != 3) {
+				addReplyError(c,"wrong number of arguments for 'fmupload chunk'");
+				return;
+		}
+		chunk = c->argv[2]->ptr;
+		len = sdslen(chunk);
+		if (len > u->size-u->written) {
+				addReplyErrorFormat(c,"upload is larger than the %zu bytes announced",u->size);
+				uploadAbort(c);
+				return;
+		}
+		while (off < len) {
+				nwritten = write(u->fd,chunk+off,len-off);
+				if (nwritten == -1) {
+						if (errno == EINTR) continue;
+						addReplyErrorFormat(c,"writing %s: %s",u->tmpfile,strerror(errno));
+						uploadAbort(c);
+						return;
+				}
+				off += nwritten;
+		}
+		u->crc = crc32(u->crc,chunk,len);
+		u->written += len;
+		addReplyLongLong(c,(long long)u->written);
+}
+
+static void uploadCommit(redisClient *c) {
+		fmUpload *u = c->upload;
+		sds name, tmp;
+
+		if (u->written != u->size) {
+				addReplyErrorFormat(c,"upload has %zu bytes of the %zu announced",u->written,u->size);
+				uploadAbort(c);
+				return;
+		}
+		if (u->crc != u->expected) {
+				addReplyErrorFormat(c,"crc32 mismatch: got %08x, expected %08x",u->crc,u->expected);
+				uploadAbort(c);
+				return;
+		}
+		if (fsync(u->fd) == -1 || close(u->fd) == -1) {
+				addReplyErrorFormat(c,"writing %s: %s",u->tmpfile,strerror(errno));
+				u->fd = -1;
+				uploadAbort(c);
+				return;
+		}
+
+		name = u->name;
+		tmp = u->tmpfile;
+		zfree(u);
+		c->upload = NULL;
+		fmInstall(c,name,tmp,1);
+		sdsfree(name);
+		sdsfree(tmp);
+}
+
+void fmuploadCommand(redisClient *c) {
+		char *sub = c->argv[1]->ptr;
+
+		if (!strcasecmp(sub,"begin")) {
+				uploadBegin(c);
+		} else if (!c->upload) {
+				addReplyError(c,"no upload in progress, see 'fmupload begin'");
+		} else if (!strcasecmp(sub,"chunk")) {
+				uploadChunk(c);
+		} else if (!strcasecmp(sub,"commit") && c->argc == 2) {
+				uploadCommit(c);
+		} else if (!strcasecmp(sub,"abort") && c->argc == 2) {
+				uploadAbort(c);
+				addReply(c,shared.ok);
+		} else {
+				addReplyError(c,"syntax error, try FMUPLOAD BEGIN|CHUNK|COMMIT|ABORT");
+		}
+}
@@ -0,0 +1,563 @@
+#include "gsh.h"
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+/*-----------------------------------------------------------------------------
+ * Formula workers
+ *
+ * formula-workers <name> <n> runs a formula in n child processes instead of
+ * the event loop: a crash of the formula takes down one worker, not the
+ * server, and the formula gets n cores. Workers are forked once the formula
+ * is loaded, so its init is done once and they start from its state, and
+ * are forked again from serverCron() when they die: the request a worker
+ * was running is answered with an error, the ones queued behind it are sent
+ * again to the new worker.
+ *
+ * Each worker is linked to the server by two single producer single consumer
+ * rings in shared memory, one for requests and one for replies. The "data"
+ * of a request is written once to the request ring and the formula reads it
+ * there, its reply, protocol included, is read back from the reply ring:
+ * nothing goes through a pipe. A reply larger than a record is split in
+ * several, all but the last flagged WORKER_REC_MORE. The side waiting on an empty ring sleeps on
+ * an eventfd, which the other side only writes to when it says it sleeps.
+ *
+ * Requests go through flights (see flight.c), so the cache and the single
+ * flight of deterministic formulas work as for inline formulas. A worker
+ * answers in order, the flights it was sent are kept in the same order to
+ * match the replies. Workers only ever call the run entry point.
+ *----------------------------------------------------------------------------*/
+
+#define WORKER_RING_SIZE (1024*1024*4)      /* bytes per ring, power of 2 */
+#define WORKER_RECORD_MAX (WORKER_RING_SIZE/2)
+#define WORKER_REC_PAD 1                    /* filler up to the ring end */
+#define WORKER_REC_CACHEABLE 2              /* a successful reply */
+#define WORKER_REC_INVALID 4                /* rejected by the schema */
+#define WORKER_REC_MORE 8                   /* the reply goes on in the next */
+
+/* Positions only grow, a position is at buf[pos & (WORKER_RING_SIZE-1)].
+ * head and tail are each written by one side, on their own cache line. */
+typedef struct fmRing {
+		uint64_t head;              /* next record to read, consumer's */
+		char pad1[56];
+		uint64_t tail;              /* next record to write, producer's */
+		char pad2[56];
+		int sleeping;               /* the consumer waits on efd */
+		int efd;
+		char buf[WORKER_RING_SIZE];
+} fmRing;
+
+/* Every record starts 8 bytes aligned with its header. */
+typedef struct fmRecord {
+		uint32_t len;               /* of the payload that follows */
+		uint32_t flags;             /* WORKER_REC_* */
+} fmRecord;
+
+#define WORKER_REC_SPACE(len) (sizeof(fmRecord)+(((len)+7) & ~(size_t)7))
+
+static fmRing *ringCreate(int efdflags) {
+		fmRing *r = mmap(NULL,sizeof(*r),PROT_READ|PROT_WRITE,
+						MAP_SHARED|MAP_ANONYMOUS,-1,0);
+
+		if (r == MAP_FAILED) return NULL;
+		if ((r->efd = eventfd(0,efdflags)) == -1) {
+				munmap(r,sizeof(*r));
+				return NULL;
+		}
+		return r;
+}
+
+static void ringFree(fmRing *r) {
+		if (!r) return;
+		close(r->efd);
+		munmap(r,sizeof(*r));
+}
+
+/* Where to write a record of len bytes, NULL if the ring is too full. The
+ * consumer sees it once ringCommit() is called with the same len. A record
+ * that does not fit before the end of the ring goes at its start. */
+static char *ringReserve(fmRing *r, size_t len) {
+		uint64_t head = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+		size_t off = r->tail & (WORKER_RING_SIZE-1);
+		size_t need = WORKER_REC_SPACE(len), skip = 0;
+
+		if (need > WORKER_RING_SIZE-off) skip = WORKER_RING_SIZE-off;
+		if (WORKER_RING_SIZE-(r->tail-head) < skip+need) return NULL;
+		return r->buf+(skip ? 0 : off)+sizeof(fmRecord);
+}
+
+static void ringCommit(fmRing *r, size_t len, int flags) {
+		size_t off = r->tail & (WORKER_RING_SIZE-1);
+		size_t need = WORKER_REC_SPACE(len);
+		uint64_t tail = r->tail;
+		fmRecord *rec;
+
+		if (need > WORKER_RING_SIZE-off) {
+				rec = (fmRecord*)(r->buf+off);
+				rec->len = WORKER_RING_SIZE-off-sizeof(fmRecord);
+				rec->flags = WORKER_REC_PAD;
+				tail += WORKER_RING_SIZE-off;
+				off = 0;
+		}
+		rec = (fmRecord*)(r->buf+off);
+		rec->len = len;
+		rec->flags = flags;
+		__atomic_store_n(&r->tail,tail+need,__ATOMIC_RELEASE);
+}
+
+/* The next record, NULL if the ring is empty. */
+static fmRecord *ringPeek(fmRing *r) {
+		uint64_t tail = __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE);
+		fmRecord *rec;
+
+		while (r->head != tail) {
+				rec = (fmRecord*)(r->buf+(r->head & (WORKER_RING_SIZE-1)));
+				if (!(rec->flags & WORKER_REC_PAD)) return rec;
+				__atomic_store_n(&r->head,r->head+WORKER_REC_SPACE(rec->len),__ATOMIC_RELEASE);
+		}
+		return NULL;
+}
+
+/* Give the space of the record ringPeek() returned back to the producer. */
+static void ringConsume(fmRing *r, fmRecord *rec) {
+		__atomic_store_n(&r->head,r->head+WORKER_REC_SPACE(rec->len),__ATOMIC_RELEASE);
+}
+
+/* Called by the producer after ringCommit(). The fences pair with the ones
+ * of ringWait(): either the consumer sees the record before sleeping, or
+ * the producer sees it sleeping. */
+static void ringWake(fmRing *r) {
+		uint64_t one = 1;
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&r->sleeping,__ATOMIC_RELAXED)) return;
+		while (write(r->efd,&one,sizeof(one)) == -1 && errno == EINTR);
+}
+
+/* Block the consumer until the producer wakes it, if the ring is empty. */
+static void ringWait(fmRing *r) {
+		uint64_t n;
+
+		__atomic_store_n(&r->sleeping,1,__ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!ringPeek(r))
+				while (read(r->efd,&n,sizeof(n)) == -1 && errno == EINTR);
+		__atomic_store_n(&r->sleeping,0,__ATOMIC_RELAXED);
+}
+
+/*-----------------------------------------------------------------------------
+ * Worker side
+ *----------------------------------------------------------------------------*/
+
+/* Drop what the worker inherited from the server and does not use: a client
+ * connection stays open as long as a process holds it. */
+static void workerSetup(pid_t ppid) {
+		struct sigaction act;
+		listNode *ln;
+		listIter li;
+
+		sigemptyset(&act.sa_mask);
+		act.sa_flags = 0;
+		act.sa_handler = SIG_DFL;
+		sigaction(SIGTERM,&act,NULL);
+		sigaction(SIGSEGV,&act,NULL);
+		sigaction(SIGBUS,&act,NULL);
+		sigaction(SIGFPE,&act,NULL);
+		sigaction(SIGILL,&act,NULL);
+
+		/* Go with the server. */
+		prctl(PR_SET_PDEATHSIG,SIGKILL);
+		if (getppid() != ppid) _exit(1);
+
+		if (server.ipfd > 0) close(server.ipfd);
+		close(server.async_pipe[0]);
+		close(server.async_pipe[1]);
+		listRewind(server.clients,&li);
+		while ((ln = listNext(&li)) != NULL) {
+				redisClient *c = listNodeValue(ln);
+
+				close(c->fd);
+		}
+}
+
+/* Requests are the encoding as an int32_t followed by the "data" bytes,
+ * replies these times and usage followed by the reply bytes. */
+typedef struct fmWorkerTimes {
+		int64_t parse_us;
+		int64_t run_us;
+		int64_t cpu_us;
+		int64_t mem_net;
+		int64_t mem_peak;
+} fmWorkerTimes;
+
+static void workerSendReply(fmWorker *w, fmWorkerTimes *t, const char *s, size_t len, int flags) {
+		size_t n, head = sizeof(*t);
+		char *p;
+
+		do {
+				n = head+len > WORKER_RECORD_MAX ? WORKER_RECORD_MAX : head+len;
+
+				/* The server is behind on the replies, give it time. */
+				while ((p = ringReserve(w->rep,n)) == NULL) usleep(100);
+				memcpy(p,t,head);
+				memcpy(p+head,s,n-head);
+				s += n-head;
+				len -= n-head;
+				ringCommit(w->rep,n,len ? WORKER_REC_MORE : flags);
+				ringWake(w->rep);
+				head = 0;
+		} while (len);
+}
+
+static void workerMain(fmWorker *w, FMITEM *fm) {
+		long long invalid;
+		fmWorkerTimes t;
+		fmRecord *rec;
+		fmFlight f;
+		robj *reply;
+		sds s;
+		int flags;
+
+		/* The server caches the replies, this copy of the formula does not. */
+		fm->cache = NULL;
+		memset(&f,0,sizeof(f));
+		f.fm = fm;
+
+		while (1) {
+				if (!(rec = ringPeek(w->req))) {
+						ringWait(w->req);
+						continue;
+				}
+				memcpy(&f.key.encoding,rec+1,sizeof(int32_t));
+				f.key.data = (char*)(rec+1)+sizeof(int32_t);
+				f.key.datalen = rec->len-sizeof(int32_t);
+
+				invalid = server.stat_invalid_requests;
+				reply = grunFlight(&f);
+				s = reply->ptr;
+				flags = (s[0] == '$') ? WORKER_REC_CACHEABLE : 0;
+				if (server.stat_invalid_requests != invalid) flags |= WORKER_REC_INVALID;
+				t.parse_us = f.parse_us;
+				t.run_us = f.run_us;
+				t.cpu_us = f.usage.cpu_us;
+				t.mem_net = f.usage.mem_net;
+				t.mem_peak = f.usage.mem_peak;
+				workerSendReply(w,&t,s,sdslen(s),flags);
+				decrRefCount(reply);
+
+				/* The formula read the "data" in place until now. */
+				ringConsume(w->req,rec);
+		}
+}
+
+/*-----------------------------------------------------------------------------
+ * Server side
+ *----------------------------------------------------------------------------*/
+
+static int workerFork(fmWorkerPool *pool, fmWorker *w) {
+		pid_t ppid = getpid();
+		pid_t pid = fork();
+
+		if (pid == -1) {
+				redisLog(REDIS_WARNING,"Can't fork a worker of formula [%s]: %s",
+								pool->name,strerror(errno));
+				w->pid = 0;
+				return REDIS_ERR;
+		}
+		if (pid == 0) {
+				workerSetup(ppid);
+				workerMain(w,pool->fm);
+				_exit(0);
+		}
+		w->pid = pid;
+		redisLog(REDIS_VERBOSE,"formula [%s] worker started, pid %d",pool->name,(int)pid);
+		return REDIS_OK;
+}
+
+/* Land the flights whose replies are in the ring, in the order sent. */
+static void workerReadReplies(fmWorker *w) {
+		fmWorkerTimes t;
+		fmUsage usage;
+		fmRecord *rec;
+		listNode *ln;
+		fmFlight *f;
+		robj *reply;
+		char *p;
+		size_t len;
+
+		while ((rec = ringPeek(w->rep)) != NULL && (ln = listFirst(w->inflight)) != NULL) {
+				/* A reply in several records is put back together. */
+				if (rec->flags & WORKER_REC_MORE) {
+						if (!w->partial) w->partial = sdsempty();
+						w->partial = sdscatlen(w->partial,rec+1,rec->len);
+						ringConsume(w->rep,rec);
+						continue;
+				}
+				if (w->partial) {
+						w->partial = sdscatlen(w->partial,rec+1,rec->len);
+						p = w->partial;
+						len = sdslen(w->partial);
+				} else {
+						p = (char*)(rec+1);
+						len = rec->len;
+				}
+				f = listNodeValue(ln);
+				listDelNode(w->inflight,ln);
+				memcpy(&t,p,sizeof(t));
+				reply = createObject(REDIS_STRING,sdsnewlen(p+sizeof(t),len-sizeof(t)));
+				sdsfree(w->partial);
+				w->partial = NULL;
+				fmStatsTimes(f->fm,t.parse_us,t.run_us);
+				usage.cpu_us = t.cpu_us;
+				usage.mem_net = t.mem_net;
+				usage.mem_peak = t.mem_peak;
+				fmStatsUsage(f->fm,&usage,1);
+				if (rec->flags & WORKER_REC_INVALID) {
+						server.stat_invalid_requests++;
+						f->fm->stats->invalid++;
+				}
+				if ((rec->flags & WORKER_REC_CACHEABLE) && f->fm->cache)
+						fmCacheStore(f->fm->cache,&f->key,reply);
+				ringConsume(w->rep,rec);
+				flightFinish(f,reply);
+		}
+}
+
+static void workerReplyHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+		fmWorkerPool *pool = privdata;
+		FMITEM *fm = pool->fm;
+		uint64_t n;
+		int j;
+		REDIS_NOTUSED(el);
+		REDIS_NOTUSED(mask);
+
+		if (read(fd,&n,sizeof(n)) == -1) return;
+
+		/* Landing the last flight of a retired version unloads it, with its
+		 * workers: hold it until done. */
+		fm->refcount++;
+		for (j = 0; j < pool->n; j++)
+				if (pool->workers[j].rep->efd == fd) workerReadReplies(pool->workers+j);
+		releasefm(fm);
+}
+
+/* Start the workers of fm. On failure fm runs inline. */
+void workerStart(sds name, FMITEM *fm) {
+		fmWorkerPool *pool = zcalloc(sizeof(*pool));
+		fmWorker *w;
+		int j;
+
+		pool->name = sdsdup(name);
+		pool->fm = fm;
+		pool->n = fm->nworkers;
+		pool->workers = zcalloc(sizeof(fmWorker)*pool->n);
+		fm->pool = pool;
+		listAddNodeTail(server.pools,pool);
+
+		for (j = 0; j < pool->n; j++) {
+				w = pool->workers+j;
+				w->inflight = listCreate();
+				w->req = ringCreate(0);
+				w->rep = ringCreate(EFD_NONBLOCK);
+				if (!w->req || !w->rep) {
+						redisLog(REDIS_WARNING,"Can't create the rings of formula [%s]: %s, it runs inline",
+										name,strerror(errno));
+						workerStop(fm);
+						return;
+				}
+				/* The server sleeps in the event loop, always wake it. */
+				w->rep->sleeping = 1;
+				if (aeCreateFileEvent(server.el,w->rep->efd,AE_READABLE,
+						workerReplyHandler,pool) == AE_ERR) {
+						redisLog(REDIS_WARNING,"Can't watch the workers of formula [%s], it runs inline",name);
+						workerStop(fm);
+						return;
+				}
+		}
+		for (j = 0; j < pool->n; j++) workerFork(pool,pool->workers+j);
+		redisLog(REDIS_NOTICE,"formula [%s] version %d runs in %d workers",
+						name,fm->version,pool->n);
+}
+
+/* Kill the workers of fm, once its flights have landed. */
+void workerStop(FMITEM *fm) {
+		fmWorkerPool *pool = fm->pool;
+		fmWorker *w;
+		int j;
+
+		for (j = 0; j < pool->n; j++) {
+				w = pool->workers+j;
+				if (w->pid) {
+						kill(w->pid,SIGKILL);
+						waitpid(w->pid,NULL,0);
+				}
+				if (w->rep) aeDeleteFileEvent(server.el,w->rep->efd,AE_READABLE);
+				ringFree(w->req);
+				ringFree(w->rep);
+				if (w->inflight) listRelease(w->inflight);
+				sdsfree(w->partial);
+		}
+		listDelNode(server.pools,listSearchKey(server.pools,pool));
+		sdsfree(pool->name);
+		zfree(pool->workers);
+		zfree(pool);
+		fm->pool = NULL;
+}
+
+void workerInit(void) {
+		dictIterator *di = dictGetSafeIterator(server.fms);
+		dictEntry *de;
+		FMITEM *fm;
+
+		while ((de = dictNext(di)) != NULL) {
+				fm = dictGetEntryVal(de);
+				if (fm->nworkers) workerStart(dictGetEntryKey(de),fm);
+		}
+		dictReleaseIterator(di);
+}
+
+/* Write the request of f to the ring of w, 0 if it is too full. */
+static int workerSend(fmWorker *w, fmFlight *f) {
+		size_t len = sizeof(int32_t)+f->key.datalen;
+		int32_t encoding = f->key.encoding;
+		char *p;
+
+		if ((p = ringReserve(w->req,len)) == NULL) return 0;
+		memcpy(p,&encoding,sizeof(encoding));
+		memcpy(p+sizeof(encoding),f->key.data,f->key.datalen);
+		ringCommit(w->req,len,0);
+		ringWake(w->req);
+		return 1;
+}
+
+/* Send the request of f to the least busy worker of its formula. Returns 1
+ * when sent, the flight then lands from workerReplyHandler(), else *reply
+ * is the answer. */
+int workerSubmit(fmFlight *f, robj **reply) {
+		fmWorkerPool *pool = f->fm->pool;
+		size_t len = sizeof(int32_t)+f->key.datalen;
+		fmWorker *w = NULL;
+		int j;
+
+		for (j = 0; j < pool->n; j++) {
+				fmWorker *cand = pool->workers+j;
+
+				if (!cand->pid) continue;
+				if (!w || listLength(cand->inflight) < listLength(w->inflight)) w = cand;
+		}
+		if (len > WORKER_RECORD_MAX) {
+				*reply = createObject(REDIS_STRING,
+								sdsnew("-ERR request too large for the formula workers\r\n"));
+				return 0;
+		}
+		if (!w) {
+				*reply = createObject(REDIS_STRING,
+								sdsnew("-ERR no formula worker running, retry later\r\n"));
+				return 0;
+		}
+		if (!workerSend(w,f)) {
+				*reply = shared.busyerr;
+				incrRefCount(*reply);
+				return 0;
+		}
+		listAddNodeTail(w->inflight,f);
+		w->stat_requests++;
+		return 1;
+}
+
+static void workerFail(fmFlight *f) {
+		flightFinish(f,createObject(REDIS_STRING,
+						sdsnew("-ERR formula worker crashed\r\n")));
+}
+
+/* The worker w died: land what it answered and fail the request it was
+ * running, the first one not answered, then send the ones queued behind it
+ * to a new worker. */
+static void workerRestart(fmWorkerPool *pool, fmWorker *w, int status) {
+		listNode *ln;
+		listIter li;
+		list *queued;
+
+		if (WIFSIGNALED(status))
+				redisLog(REDIS_WARNING,"formula [%s] worker %d killed by signal %d, restarting",
+								pool->name,(int)w->pid,WTERMSIG(status));
+		else
+				redisLog(REDIS_WARNING,"formula [%s] worker %d exited with %d, restarting",
+								pool->name,(int)w->pid,WEXITSTATUS(status));
+		pool->stat_crashes++;
+		w->pid = 0;
+
+		workerReadReplies(w);
+		sdsfree(w->partial);
+		w->partial = NULL;
+		if ((ln = listFirst(w->inflight)) != NULL) {
+				fmFlight *f = listNodeValue(ln);
+
+				listDelNode(w->inflight,ln);
+				workerFail(f);
+		}
+		queued = w->inflight;
+		w->inflight = listCreate();
+		w->req->head = w->req->tail = 0;
+		w->req->sleeping = 0;
+		w->rep->head = w->rep->tail = 0;
+		workerFork(pool,w);
+
+		/* They fitted in the ring before, they do again from its start. The
+		 * ones all waiters gave up on meanwhile are not sent again. */
+		listRewind(queued,&li);
+		while ((ln = listNext(&li)) != NULL) {
+				fmFlight *f = listNodeValue(ln);
+
+				if (flightExpire(f)) continue;
+				if (w->pid && workerSend(w,f)) listAddNodeTail(w->inflight,f);
+				else workerFail(f);
+		}
+		listRelease(queued);
+}
+
+/* Restart the workers that died, called from serverCron(). */
+void workerCron(void) {
+		fmWorkerPool *pool;
+		listNode *ln;
+		listIter li;
+		fmWorker *w;
+		int j, status;
+		pid_t pid;
+
+		listRewind(server.pools,&li);
+		while ((ln = listNext(&li)) != NULL) {
+				pool = listNodeValue(ln);
+				pool->fm->refcount++;   /* see workerReplyHandler() */
+				for (j = 0; j < pool->n; j++) {
+						w = pool->workers+j;
+						if (!w->pid) {
+								workerFork(pool,w);
+								continue;
+						}
+						status = 0;
+						pid = waitpid(w->pid,&status,WNOHANG);
+						if (pid == w->pid || (pid == -1 && errno == ECHILD))
+								workerRestart(pool,w,status);
+				}
+				releasefm(pool->fm);
+		}
+}
+
+sds workerInfoString(sds info, char *name, FMITEM *fm) {
+		fmWorkerPool *pool = fm->pool;
+		long long requests = 0;
+		unsigned long inflight = 0;
+		int j, running = 0;
+
+		if (!pool) return info;
+		for (j = 0; j < pool->n; j++) {
+				if (pool->workers[j].pid) running++;
+				requests += pool->workers[j].stat_requests;
+				inflight += listLength(pool->workers[j].inflight);
+		}
+		return sdscatprintf(info,"workers[%s]=running:%d,requests:%lld,inflight:%lu,crashes:%lld\r\n",
+						name,running,requests,inflight,pool->stat_crashes);
+}